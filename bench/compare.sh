@@ -0,0 +1,44 @@
+#!/bin/sh
+# Runs bench/run.sh once per bridge given and prints one JSON object per payload size and client count,
+# comparing every bridge after the first against it: throughput and bridge CPU time per frame as ratios,
+# above 1 meaning faster. Takes the same environment knobs as bench/run.sh.
+#   usage: bench/compare.sh BASELINE.exe CANDIDATE.exe...
+
+set -eu
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 BASELINE.exe CANDIDATE.exe..." >&2
+    exit 1
+fi
+
+DIR=$(dirname "$0")
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+# Pulls a numeric field out of a flat JSON object
+field() {
+    printf '%s' "$1" | sed -n "s/.*\"$2\":\([0-9.-]*\).*/\1/p"
+}
+
+BRIDGE=$1 "$DIR/run.sh" > "$OUT/baseline.json"
+baseline=$1
+shift
+
+for bridge in "$@"; do
+    BRIDGE=$bridge "$DIR/run.sh" > "$OUT/candidate.json"
+
+    # run.sh goes through the same sizes and client counts in the same order every time
+    paste -d '\n' "$OUT/baseline.json" "$OUT/candidate.json" | while read -r base && read -r cand; do
+        fps=$(awk -v a="$(field "$base" frames_per_sec)" -v b="$(field "$cand" frames_per_sec)" \
+            'BEGIN { printf "%.3f", (a > 0 ? b / a : 0) }')
+        cpu=$(awk -v a="$(field "$base" bridge_cpu_us_per_frame)" -v b="$(field "$cand" bridge_cpu_us_per_frame)" \
+            'BEGIN { printf "%.3f", (b > 0 ? a / b : 0) }')
+
+        printf '{"baseline":"%s","bridge":"%s","clients":%s,"payload":%s,' \
+            "$baseline" "$bridge" "$(field "$cand" clients)" "$(field "$cand" payload)"
+        printf '"frames_per_sec":%s,"baseline_frames_per_sec":%s,"throughput_speedup":%s,' \
+            "$(field "$cand" frames_per_sec)" "$(field "$base" frames_per_sec)" "$fps"
+        printf '"bridge_cpu_us_per_frame":%s,"baseline_bridge_cpu_us_per_frame":%s,"cpu_speedup":%s}\n' \
+            "$(field "$cand" bridge_cpu_us_per_frame)" "$(field "$base" bridge_cpu_us_per_frame)" "$cpu"
+    done
+done
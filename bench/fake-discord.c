@@ -0,0 +1,265 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// Native stand-in for Discord's IPC server, for benchmarking the bridge without a Discord client
+// Answers HANDSHAKE with READY, echoes every command back as its own reply, PING with PONG,
+// and hangs up on CLOSE. When the last connection is gone it prints the CPU time the connecting
+// process used, as a single JSON object on stdout.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "bridge/ipc.h"
+
+#define MAX_CONNS   64
+#define READY_JSON  "{\"cmd\":\"DISPATCH\",\"data\":{\"v\":1,\"config\":{\"cdn_host\":\"cdn.discordapp.com\"," \
+                    "\"api_endpoint\":\"//discord.com/api\",\"environment\":\"production\"},\"user\":{\"id\":\"0\"," \
+                    "\"username\":\"bench\",\"discriminator\":\"0\"}},\"evt\":\"READY\",\"nonce\":null}"
+
+struct conn {
+    int         fd;
+    char       *buf;
+    size_t      len;
+    uint64_t    frames;
+};
+
+static struct conn conns[MAX_CONNS];
+static int live_conns;
+static int bridge_pid;
+static uint64_t total_frames;
+
+static int send_frame(int fd, uint32_t opcode, const char *payload, uint32_t length) {
+    char header[IPC_HEADER_SIZE];
+    memcpy(header, &opcode, sizeof(opcode));
+    memcpy(header + sizeof(opcode), &length, sizeof(length));
+
+    struct iovec iov[] = { { header, sizeof(header) }, { (void*)payload, length } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    size_t left = sizeof(header) + length;
+
+    // Blocking socket, a short write only happens on a signal
+    while (left > 0) {
+        ssize_t written = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        left -= written;
+        while (msg.msg_iovlen > 0 && (size_t)written >= msg.msg_iov->iov_len) {
+            written -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + written;
+            msg.msg_iov->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+// Returns -1 once the connection should go away
+static int handle_frames(struct conn *conn) {
+    size_t off = 0;
+    int result = 0;
+
+    while (conn->len - off >= IPC_HEADER_SIZE) {
+        struct ipc_frame frame;
+        memcpy(&frame.opcode, conn->buf + off, sizeof(frame.opcode));
+        memcpy(&frame.length, conn->buf + off + sizeof(frame.opcode), sizeof(frame.length));
+
+        if (frame.length > IPC_MAX_FRAME - IPC_HEADER_SIZE) {
+            fprintf(stderr, "Oversized frame of %u bytes.\n", frame.length);
+            return -1;
+        }
+
+        if (conn->len - off < IPC_FRAME_SIZE(&frame)) break;
+
+        frame.data = conn->buf + off;
+        off += IPC_FRAME_SIZE(&frame);
+        conn->frames++;
+
+        switch (frame.opcode) {
+            case IPC_HANDSHAKE:
+                result = send_frame(conn->fd, IPC_FRAME, READY_JSON, sizeof(READY_JSON) - 1);
+                break;
+            case IPC_FRAME:
+                result = send_frame(conn->fd, IPC_FRAME, IPC_PAYLOAD(&frame), frame.length);
+                break;
+            case IPC_PING:
+                result = send_frame(conn->fd, IPC_PONG, IPC_PAYLOAD(&frame), frame.length);
+                break;
+            default:
+                result = -1;
+                break;
+        }
+
+        if (result < 0) return -1;
+    }
+
+    memmove(conn->buf, conn->buf + off, conn->len - off);
+    conn->len -= off;
+    return 0;
+}
+
+// utime and stime of the bridge, fields 14 and 15 of /proc/<pid>/stat
+static long long bridge_cpu_us(void) {
+    char path[64], line[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", bridge_pid);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return -1;
+
+    size_t length = fread(line, 1, sizeof(line) - 1, file);
+    fclose(file);
+    line[length] = '\0';
+
+    // The command name may hold spaces, fields are counted from its closing parenthesis
+    char *p = strrchr(line, ')');
+    unsigned long long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+        return -1;
+
+    return (long long)((utime + stime) * 1000000ULL / (unsigned long long)sysconf(_SC_CLK_TCK));
+}
+
+static void conn_close(struct conn *conn) {
+    // Read before the last socket closes, the bridge exits right after
+    if (live_conns == 1 && bridge_pid > 0) {
+        printf("{\"bridge_pid\":%d,\"bridge_cpu_us\":%lld,\"server_frames\":%llu}\n",
+               bridge_pid, bridge_cpu_us(), (unsigned long long)(total_frames + conn->frames));
+        fflush(stdout);
+    }
+
+    total_frames += conn->frames;
+    close(conn->fd);
+    free(conn->buf);
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = -1;
+    live_conns--;
+}
+
+int main(int argc, char *argv[]) {
+    int slot = 0, once = 0, opt;
+
+    while ((opt = getopt(argc, argv, "n:1")) != -1) {
+        switch (opt) {
+            case 'n': slot = atoi(optarg); break;
+            case '1': once = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n PIPE] [-1]\n"
+                        "Serves $XDG_RUNTIME_DIR/discord-ipc-PIPE, -1 exits after the first bridge is done.\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir == NULL) {
+        fprintf(stderr, "XDG_RUNTIME_DIR is not set.\n");
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/discord-ipc-%d", dir, slot);
+    unlink(addr.sun_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, MAX_CONNS) < 0) {
+        fprintf(stderr, "Failed to listen on \"%s\": %s.\n", addr.sun_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = MAX_CONNS };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+    for (int i = 0; i < MAX_CONNS; i++)
+        conns[i].fd = -1;
+
+    while (!once || bridge_pid == 0 || live_conns > 0) {
+        struct epoll_event events[MAX_CONNS];
+        int count = epoll_wait(epoll_fd, events, MAX_CONNS, -1);
+
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to wait for events: %s.\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        for (int i = 0; i < count; i++) {
+            uint32_t id = events[i].data.u32;
+
+            if (id == MAX_CONNS) {
+                int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                if (fd < 0) continue;
+
+                struct conn *conn = NULL;
+                for (int j = 0; j < MAX_CONNS && conn == NULL; j++)
+                    if (conns[j].fd < 0) {
+                        conn = &conns[j];
+                        id = j;
+                    }
+
+                struct ucred cred;
+                socklen_t cred_len = sizeof(cred);
+
+                if (conn == NULL || (conn->buf = malloc(IPC_MAX_FRAME)) == NULL) {
+                    close(fd);
+                    continue;
+                }
+
+                if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0)
+                    bridge_pid = cred.pid;
+
+                conn->fd = fd;
+                live_conns++;
+
+                struct epoll_event conn_event = { .events = EPOLLIN, .data.u32 = id };
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &conn_event);
+                continue;
+            }
+
+            // Level-triggered, one read per wakeup never blocks
+            struct conn *conn = &conns[id];
+            ssize_t length = read(conn->fd, conn->buf + conn->len, IPC_MAX_FRAME - conn->len);
+
+            if (length < 0 && errno == EINTR) continue;
+
+            if (length <= 0 || (conn->len += length, handle_frames(conn) < 0))
+                conn_close(conn);
+        }
+    }
+
+    close(listen_fd);
+    unlink(addr.sun_path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,335 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// Windows-side load generator for the bench target, run under Wine next to the bridge
+// Every client connects to the bridge's pipe, handshakes, then sends commands of a fixed size back to
+// back, timing each round trip through the bridge and bench/fake-discord.c, which echoes them.
+// Prints the results as a single JSON object on stdout.
+
+#include <windows.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bridge/ipc.h"
+
+#define PIPE_NAME           "\\\\.\\pipe\\discord-ipc-0"
+#define CONNECT_TIMEOUT     10000       // ms, covers Wine starting the bridge
+#define MAX_WORKERS         32          // The bridge's own client limit
+#define REQUEST_HEAD        "{\"cmd\":\"BENCH\",\"nonce\":\""
+#define REQUEST_PAD         "\",\"args\":{\"pad\":\""
+#define REQUEST_TAIL        "\"}}"
+#define NONCE_DIGITS        8
+#define ACTIVITY_JSON       "{\"cmd\":\"SET_ACTIVITY\",\"nonce\":\"a%u\",\"args\":{\"pid\":%d," \
+                            "\"activity\":{\"state\":\"Bench\",\"details\":\"Update %u\"}}}"
+
+struct worker {
+    int         id;
+    HANDLE      hThread;
+    HANDLE      hPipe;
+    char       *request;        // Whole frame, header included
+    size_t      request_len;
+    char       *reply;
+    uint64_t   *samples;        // Round trips in QPC ticks
+    size_t      count;
+    size_t      cap;
+};
+
+static struct worker workers[MAX_WORKERS];
+static size_t payload_size = 256;
+static unsigned activity_every;     // 0 sends no SET_ACTIVITY at all
+static HANDLE hStart;
+static LONG volatile ready_workers;
+static LONG volatile stop_requested;
+
+static BOOL pipe_write(HANDLE hPipe, const char *buf, size_t length) {
+    while (length > 0) {
+        DWORD cbWritten;
+        if (!WriteFile(hPipe, buf, (DWORD)length, &cbWritten, NULL)) return FALSE;
+        buf += cbWritten;
+        length -= cbWritten;
+    }
+
+    return TRUE;
+}
+
+static BOOL pipe_read(HANDLE hPipe, char *buf, size_t length) {
+    while (length > 0) {
+        DWORD cbRead;
+        if (!ReadFile(hPipe, buf, (DWORD)length, &cbRead, NULL) || cbRead == 0) return FALSE;
+        buf += cbRead;
+        length -= cbRead;
+    }
+
+    return TRUE;
+}
+
+static BOOL read_frame(struct worker *worker, uint32_t *opcode) {
+    uint32_t length;
+
+    if (!pipe_read(worker->hPipe, worker->reply, IPC_HEADER_SIZE)) return FALSE;
+
+    memcpy(opcode, worker->reply, sizeof(*opcode));
+    memcpy(&length, worker->reply + sizeof(*opcode), sizeof(length));
+
+    return length <= IPC_MAX_FRAME - IPC_HEADER_SIZE &&
+           pipe_read(worker->hPipe, worker->reply + IPC_HEADER_SIZE, length);
+}
+
+// Skips the replies to SET_ACTIVITY, which arrive whenever the bridge lets the update through
+static BOOL read_reply(struct worker *worker, uint32_t *opcode) {
+    size_t head = strlen(REQUEST_HEAD);
+    uint32_t length;
+
+    do {
+        if (!read_frame(worker, opcode)) return FALSE;
+        memcpy(&length, worker->reply + sizeof(*opcode), sizeof(length));
+    } while (length < head || memcmp(worker->reply + IPC_HEADER_SIZE, REQUEST_HEAD, head) != 0);
+
+    return TRUE;
+}
+
+static size_t build_frame(char *buf, uint32_t opcode, const char *payload, size_t length) {
+    uint32_t length32 = (uint32_t)length;
+    memcpy(buf, &opcode, sizeof(opcode));
+    memcpy(buf + sizeof(opcode), &length32, sizeof(length32));
+    memcpy(buf + IPC_HEADER_SIZE, payload, length);
+    return IPC_HEADER_SIZE + length;
+}
+
+// A BENCH command padded out to payload_size, the nonce right after REQUEST_HEAD gets rewritten per request
+static BOOL build_request(struct worker *worker) {
+    size_t fixed = strlen(REQUEST_HEAD) + NONCE_DIGITS + strlen(REQUEST_PAD) + strlen(REQUEST_TAIL);
+    size_t pad = payload_size > fixed ? payload_size - fixed : 0;
+    size_t length = fixed + pad;
+
+    char *payload = malloc(length);
+    if (payload == NULL || (worker->request = malloc(IPC_HEADER_SIZE + length)) == NULL) {
+        free(payload);
+        return FALSE;
+    }
+
+    char *p = payload;
+    p += sprintf(p, REQUEST_HEAD "%0*d" REQUEST_PAD, NONCE_DIGITS, 0);
+    memset(p, 'x', pad);
+    memcpy(p + pad, REQUEST_TAIL, strlen(REQUEST_TAIL));
+
+    worker->request_len = build_frame(worker->request, IPC_FRAME, payload, length);
+    free(payload);
+    return TRUE;
+}
+
+static BOOL record(struct worker *worker, uint64_t ticks) {
+    if (worker->count == worker->cap) {
+        size_t cap = worker->cap > 0 ? worker->cap * 2 : 4096;
+        uint64_t *samples = realloc(worker->samples, cap * sizeof(*samples));
+        if (samples == NULL) return FALSE;
+        worker->samples = samples;
+        worker->cap = cap;
+    }
+
+    worker->samples[worker->count++] = ticks;
+    return TRUE;
+}
+
+DWORD WINAPI worker_thread(LPVOID lpParam) {
+    struct worker *worker = lpParam;
+    ULONGLONG deadline = GetTickCount64() + CONNECT_TIMEOUT;
+
+    while ((worker->hPipe = CreateFileA(PIPE_NAME, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL))
+           == INVALID_HANDLE_VALUE) {
+        if (GetTickCount64() > deadline) {
+            fprintf(stderr, "Client %d failed to connect to the bridge: error %lu.\n", worker->id, GetLastError());
+            return EXIT_FAILURE;
+        }
+
+        // Not up yet or every instance taken, the bridge creates the next one right away
+        Sleep(10);
+    }
+
+    char handshake[64], frame[IPC_HEADER_SIZE + sizeof(handshake)];
+    int length = snprintf(handshake, sizeof(handshake), "{\"v\":1,\"client_id\":\"bench-%d\"}", worker->id);
+    uint32_t opcode;
+
+    if (!pipe_write(worker->hPipe, frame, build_frame(frame, IPC_HANDSHAKE, handshake, length)) ||
+        !read_frame(worker, &opcode) || opcode != IPC_FRAME) {
+        fprintf(stderr, "Client %d failed to handshake.\n", worker->id);
+        return EXIT_FAILURE;
+    }
+
+    InterlockedIncrement(&ready_workers);
+    WaitForSingleObject(hStart, INFINITE);
+
+    char *nonce = worker->request + IPC_HEADER_SIZE + strlen(REQUEST_HEAD);
+
+    for (unsigned n = 1; !stop_requested; n++) {
+        char digits[NONCE_DIGITS + 1];
+        snprintf(digits, sizeof(digits), "%0*u", NONCE_DIGITS, n % 100000000u);
+        memcpy(nonce, digits, NONCE_DIGITS);
+
+        // A fresh state every time, so the bridge can't drop it as unchanged
+        if (activity_every > 0 && n % activity_every == 0) {
+            char activity[192], update[IPC_HEADER_SIZE + sizeof(activity)];
+            length = snprintf(activity, sizeof(activity), ACTIVITY_JSON, n, (int)GetCurrentProcessId(), n);
+
+            if (!pipe_write(worker->hPipe, update, build_frame(update, IPC_FRAME, activity, length))) {
+                fprintf(stderr, "Client %d lost the bridge.\n", worker->id);
+                return EXIT_FAILURE;
+            }
+        }
+
+        LARGE_INTEGER before, after;
+        QueryPerformanceCounter(&before);
+
+        if (!pipe_write(worker->hPipe, worker->request, worker->request_len) || !read_reply(worker, &opcode)) {
+            fprintf(stderr, "Client %d lost the bridge.\n", worker->id);
+            return EXIT_FAILURE;
+        }
+
+        QueryPerformanceCounter(&after);
+
+        if (!record(worker, (uint64_t)(after.QuadPart - before.QuadPart))) {
+            fprintf(stderr, "Client %d ran out of memory for samples.\n", worker->id);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank over sorted samples
+static double percentile_us(const uint64_t *samples, size_t count, int percent, double us_per_tick) {
+    return count > 0 ? samples[(count - 1) * percent / 100] * us_per_tick : 0.0;
+}
+
+static uint64_t filetime_us(FILETIME ft) {
+    return (((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10;
+}
+
+static uint64_t process_cpu_us(void) {
+    FILETIME ftCreation, ftExit, ftKernel, ftUser;
+    if (!GetProcessTimes(GetCurrentProcess(), &ftCreation, &ftExit, &ftKernel, &ftUser)) return 0;
+    return filetime_us(ftKernel) + filetime_us(ftUser);
+}
+
+int main(int argc, char *argv[]) {
+    int clients = 1, duration = 5, opt;
+
+    while ((opt = getopt(argc, argv, "c:s:d:a:")) != -1) {
+        switch (opt) {
+            case 'c': clients = atoi(optarg); break;
+            case 's': payload_size = strtoul(optarg, NULL, 10); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'a': activity_every = strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: load-client.exe [-c CLIENTS] [-s PAYLOAD_BYTES] [-d SECONDS] [-a EVERY]\n");
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (clients < 1 || clients > MAX_WORKERS || duration < 1 || payload_size > IPC_MAX_FRAME - IPC_HEADER_SIZE) {
+        fprintf(stderr, "Between 1 and %d clients, at least a second, and payloads that fit a frame.\n", MAX_WORKERS);
+        return EXIT_FAILURE;
+    }
+
+    if ((hStart = CreateEventA(NULL, TRUE, FALSE, NULL)) == NULL) {
+        fprintf(stderr, "Failed to create event: error %lu.\n", GetLastError());
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < clients; i++) {
+        workers[i].id = i;
+
+        if (!build_request(&workers[i]) || (workers[i].reply = malloc(IPC_MAX_FRAME)) == NULL) {
+            fprintf(stderr, "Failed to allocate buffers.\n");
+            return EXIT_FAILURE;
+        }
+
+        if ((workers[i].hThread = CreateThread(NULL, 0, worker_thread, &workers[i], 0, NULL)) == NULL) {
+            fprintf(stderr, "Failed to create thread: error %lu.\n", GetLastError());
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Measure only once every client got through the handshake
+    while (ready_workers < clients) {
+        for (int i = 0; i < clients; i++) {
+            if (WaitForSingleObject(workers[i].hThread, 0) == WAIT_OBJECT_0)
+                return EXIT_FAILURE;
+        }
+        Sleep(1);
+    }
+
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    uint64_t cpu_start = process_cpu_us();
+    QueryPerformanceCounter(&start);
+
+    SetEvent(hStart);
+    Sleep(duration * 1000);
+    (VOID)InterlockedExchange(&stop_requested, TRUE);
+
+    size_t total = 0;
+    for (int i = 0; i < clients; i++) {
+        DWORD dwExitCode;
+        WaitForSingleObject(workers[i].hThread, INFINITE);
+        if (!GetExitCodeThread(workers[i].hThread, &dwExitCode) || dwExitCode != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        total += workers[i].count;
+    }
+
+    QueryPerformanceCounter(&end);
+    uint64_t cpu_us = process_cpu_us() - cpu_start;
+
+    uint64_t *samples = malloc((total > 0 ? total : 1) * sizeof(*samples));
+    if (samples == NULL) {
+        fprintf(stderr, "Failed to allocate samples.\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t off = 0;
+    for (int i = 0; i < clients; i++) {
+        memcpy(samples + off, workers[i].samples, workers[i].count * sizeof(*samples));
+        off += workers[i].count;
+        CloseHandle(workers[i].hPipe);
+    }
+
+    qsort(samples, total, sizeof(*samples), compare_samples);
+
+    double seconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+    double us_per_tick = 1e6 / frequency.QuadPart;
+
+    printf("{\"clients\":%d,\"payload\":%lu,\"seconds\":%.3f,\"frames\":%lu,\"frames_per_sec\":%.1f,"
+           "\"rtt_p50_us\":%.1f,\"rtt_p99_us\":%.1f,\"rtt_max_us\":%.1f,\"client_cpu_us\":%lu}\n",
+           clients, (unsigned long)payload_size, seconds, (unsigned long)total, total / seconds,
+           percentile_us(samples, total, 50, us_per_tick), percentile_us(samples, total, 99, us_per_tick),
+           percentile_us(samples, total, 100, us_per_tick), (unsigned long)cpu_us);
+
+    free(samples);
+    return EXIT_SUCCESS;
+}
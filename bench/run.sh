@@ -0,0 +1,66 @@
+#!/bin/sh
+# Runs bin/load-client.exe against a fresh bridge and bench/fake-discord.c for every payload size and
+# client count, printing one JSON object per run on stdout. Tunable through the environment:
+#   BENCH_SIZES     payload sizes in bytes          (default: 64 512 4096 32768)
+#   BENCH_CLIENTS   concurrent RPC clients          (default: 1 4 16)
+#   BENCH_DURATION  seconds measured per run        (default: 5)
+#   BENCH_ACTIVITY  SET_ACTIVITY every N commands   (default: 0, none)
+#   BENCH_SPLIT     1 for split mode, through $BIN_DIR/winerpc-companion from make native; the bridge
+#                   has to be built with make SPLIT=1 (default: 0)
+#   BRIDGE          bridge under test               (default: $BIN_DIR/winerpcbridge.exe)
+#   WINE            wine binary, WINEPREFIX is honoured as usual
+
+set -eu
+
+BIN_DIR=${BIN_DIR:-bin}
+WINE=${WINE:-wine}
+SIZES=${BENCH_SIZES:-"64 512 4096 32768"}
+CLIENTS=${BENCH_CLIENTS:-"1 4 16"}
+DURATION=${BENCH_DURATION:-5}
+ACTIVITY=${BENCH_ACTIVITY:-0}
+SPLIT=${BENCH_SPLIT:-0}
+BRIDGE=${BRIDGE:-"$BIN_DIR/winerpcbridge.exe"}
+
+# Private runtime dir, so neither a real Discord nor another bridge gets in the way
+XDG_RUNTIME_DIR=$(mktemp -d)
+export XDG_RUNTIME_DIR
+trap 'rm -rf "$XDG_RUNTIME_DIR"' EXIT
+
+# One companion serves every bridge started below, each picks it up as it comes
+BRIDGE_ARGS=--log-level=none
+if [ "$SPLIT" = 1 ]; then
+    "$BIN_DIR/winerpc-companion" &
+    companion=$!
+    trap 'kill "$companion" 2>/dev/null; rm -rf "$XDG_RUNTIME_DIR"' EXIT
+    BRIDGE_ARGS="$BRIDGE_ARGS --split"
+fi
+
+# Pulls a numeric field out of a flat JSON object
+field() {
+    printf '%s' "$1" | sed -n "s/.*\"$2\":\([0-9.-]*\).*/\1/p"
+}
+
+for size in $SIZES; do
+    for clients in $CLIENTS; do
+        "$BIN_DIR/fake-discord" -1 > "$XDG_RUNTIME_DIR/server.json" &
+        server=$!
+
+        while [ ! -S "$XDG_RUNTIME_DIR/discord-ipc-0" ]; do sleep 0.05; done
+
+        "$WINE" "$BRIDGE" $BRIDGE_ARGS &
+        bridge=$!
+
+        client=$("$WINE" "$BIN_DIR/load-client.exe" -c "$clients" -s "$size" -d "$DURATION" -a "$ACTIVITY")
+
+        # The bridge exits with its last client, and the server with the bridge
+        wait "$bridge" || true
+        wait "$server"
+        server=$(cat "$XDG_RUNTIME_DIR/server.json")
+        rm -f "$XDG_RUNTIME_DIR/discord-ipc-0"
+
+        per_frame=$(awk -v cpu="$(field "$server" bridge_cpu_us)" -v frames="$(field "$client" frames)" \
+            'BEGIN { printf "%.2f", (frames > 0 ? cpu / frames : 0) }')
+
+        printf '%s,%s,"bridge_cpu_us_per_frame":%s}\n' "${client%\}}" "$(printf '%s' "${server#\{}" | sed 's/}$//')" "$per_frame"
+    done
+done
@@ -0,0 +1,51 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#pragma once
+
+#include <stddef.h>
+
+#define HUB_NAME    "winerpc-hub"   // Socket of src/native/hub.c, next to Discord's
+
+// Directory Discord puts its sockets in, also home to the bridge's own files
+const char* get_sock_parent_path(void);
+
+// Finds and connects to a Discord IPC socket, remembering the last one that worked
+// Returns a connected non-blocking socket, or a negative errno
+int discovery_connect(void);
+
+// For callers that connect on their own: the index-th Discord socket, the last one that worked first and never
+// the hub. Returns -LINUX_ENOENT past the last one. discovery_found() remembers the one that worked.
+int discovery_path(int index, char *path, size_t size);
+void discovery_found(const char *path);
+
+// Whether discovery_connect() tries the hub ahead of Discord, which it does unless the hub itself says otherwise
+void discovery_prefer_hub(int prefer);
+
+// Connects ahead of time, so the next discovery_connect() hands out a ready socket instead of searching
+// Returns a negative errno when Discord can't be reached, which costs nothing but the head start
+// Does nothing while discovery leads to the hub, which keeps a socket ready itself
+int discovery_warm(void);
+
+// Returns an inotify descriptor that becomes readable whenever a candidate directory gains an entry,
+// created on first use; discovery_drain() consumes what woke it
+int discovery_watch(void);
+void discovery_drain(void);
@@ -0,0 +1,100 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Every frame is an opcode and a payload length, both little-endian, followed by a JSON payload
+#define IPC_HEADER_SIZE     8
+#define IPC_MAX_FRAME       (64 * 1024)     // Same cap as Discord's own RPC library, header included
+#define IPC_INLINE_SIZE     2048            // Frames up to this size never touch the heap
+
+#define IPC_PAYLOAD(frame)      ((frame)->data + IPC_HEADER_SIZE)
+#define IPC_FRAME_SIZE(frame)   (IPC_HEADER_SIZE + (size_t)(frame)->length)
+
+enum ipc_opcode {
+    IPC_HANDSHAKE,
+    IPC_FRAME,
+    IPC_CLOSE,
+    IPC_PING,
+    IPC_PONG
+};
+
+enum ipc_status {
+    IPC_INVALID = -1,   // Stream can't be trusted anymore
+    IPC_AGAIN,          // Need more bytes
+    IPC_OK              // Frame available
+};
+
+struct ipc_frame {
+    uint32_t    opcode;
+    uint32_t    length;     // Payload only
+    const char *data;       // Header immediately followed by the payload, see IPC_FRAME_SIZE
+};
+
+// Commands the bridge makes decisions on, anything else is IPC_CMD_OTHER
+enum ipc_command {
+    IPC_CMD_NONE,           // No "cmd", or not a FRAME
+    IPC_CMD_OTHER,
+    IPC_CMD_DISPATCH,       // Events from Discord, named by "evt"
+    IPC_CMD_SET_ACTIVITY
+};
+
+// A string value inside the payload, escapes left as they are; data is NULL when the key is missing or
+// its value isn't a string
+struct ipc_span {
+    const char *data;
+    uint32_t    length;
+};
+
+// Top-level fields of a FRAME payload, pointing into it
+// evt is only looked for in DISPATCH frames, other frames have it only where it comes last as in Discord's replies
+struct ipc_class {
+    enum ipc_command    command;
+    struct ipc_span     cmd;
+    struct ipc_span     evt;
+    struct ipc_span     nonce;
+};
+
+// Reassembles frames in place out of arbitrarily split reads
+// Frames stay valid until the next call to ipc_reader_space()
+struct ipc_reader {
+    char   *buf;
+    size_t  cap;
+    size_t  start;          // First byte not yet handed out as a frame
+    size_t  end;            // One past the last byte read
+    char    inline_buf[IPC_INLINE_SIZE];
+};
+
+void ipc_reader_init(struct ipc_reader *reader);
+void ipc_reader_free(struct ipc_reader *reader);
+char *ipc_reader_space(struct ipc_reader *reader, size_t *avail);
+void ipc_reader_commit(struct ipc_reader *reader, size_t count);
+enum ipc_status ipc_reader_next(struct ipc_reader *reader, struct ipc_frame *frame);
+void ipc_reader_drop(struct ipc_reader *reader);
+void ipc_frame_classify(const struct ipc_frame *frame, struct ipc_class *cls);
+int ipc_span_is(const struct ipc_span *span, const char *str);
+const char *ipc_frame_value(const struct ipc_frame *frame, const char *key);
+long ipc_frame_pid(const struct ipc_frame *frame);
+uint64_t ipc_frame_hash(const struct ipc_frame *frame, const struct ipc_class *cls);
+const char *ipc_opcode_name(uint32_t opcode);
@@ -21,9 +21,6 @@
 
 #pragma once
 
-#define GPG_KEY_SIZE 8
-#define SKIP_GPG_KEY(buf) (&buf[GPG_KEY_SIZE])
-
 enum log_level {
     _INVALID = -1,
     LL_NONE,
@@ -34,6 +31,29 @@ enum log_level {
     LL_TRACE
 };
 
+// Levels past this one compile away, arguments and all, e.g. -DLOG_LEVEL_MAX=LL_INFO for release builds
+#ifndef LOG_LEVEL_MAX
+    #define LOG_LEVEL_MAX LL_TRACE
+#endif
+
 extern enum log_level g_log_level;
+extern unsigned g_log_sample;           // TRACE keeps one record in this many, 0 or 1 keeps all of them
+extern unsigned g_log_sampled;
+
+// Moves formatting output onto a background thread, bridge_log() writes synchronously until then
+void bridge_log_init(void);
 void __attribute__((format(printf, 2, 3))) \
-    bridge_log(enum log_level log_level, const char *fmt, ...);
+    bridge_log_write(enum log_level log_level, const char *fmt, ...);
+
+// Any thread may log, a lost count only shifts which records are kept
+static inline int log_sampled(void) {
+    return g_log_sample <= 1 || __atomic_fetch_add(&g_log_sampled, 1, __ATOMIC_RELAXED) % g_log_sample == 0;
+}
+
+// A level that's off costs an inlined compare, and nothing is evaluated before it passes
+#define bridge_log(log_level, ...)                                                  \
+    do {                                                                            \
+        if ((log_level) <= LOG_LEVEL_MAX && (log_level) <= g_log_level &&           \
+            ((log_level) != LL_TRACE || log_sampled()))                             \
+            bridge_log_write((log_level), __VA_ARGS__);                             \
+    } while (0)
@@ -0,0 +1,58 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_TRACKED 16      // Frames in flight per direction and client that can be timed
+
+enum metrics_dir {
+    DIR_TO_DISCORD,     // Read from the pipe, written to the socket
+    DIR_TO_CLIENT,      // Read from the socket, written to the pipe
+    DIR_COUNT
+};
+
+// FIFO of frames that were read but not yet fully written, in stream order
+struct frame_track {
+    struct {
+        uint32_t opcode;
+        uint32_t size;      // Header included
+        uint64_t stamp;     // metrics_now() when the frame's last byte was read
+    } frames[METRICS_TRACKED];
+    int     first;
+    int     count;
+    size_t  done;           // Bytes of the oldest frame already written
+};
+
+void metrics_init(void);
+uint64_t metrics_now(void);
+uint64_t metrics_ms(void);
+uint64_t metrics_ns(uint64_t ticks);
+void metrics_track_reset(struct frame_track *track);
+int metrics_track(struct frame_track *track, uint32_t opcode, size_t size, uint64_t stamp);
+// A frame read at stamp was fully written at now
+void metrics_sample(enum metrics_dir dir, uint32_t opcode, uint64_t stamp, uint64_t now);
+// An RPC client connected at stamp got its first frame to Discord at now, returns the wait in ns
+uint64_t metrics_startup(uint64_t stamp, uint64_t now);
+void metrics_written(struct frame_track *track, enum metrics_dir dir, size_t bytes);
+void metrics_dump(void);
@@ -0,0 +1,60 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bridge/ipc.h"
+
+#define QUEUE_SLOTS     32                  // Power of two, frames held per queue
+#define QUEUE_CELL      IPC_INLINE_SIZE     // Frames up to this size are copied into the slab
+
+struct queue_cell {
+    char       *data;       // Whole frame, in the slab or on the heap when it doesn't fit a cell
+    uint32_t    size;       // Header included
+    uint32_t    opcode;
+    uint64_t    stamp;      // metrics_now() when it was read, 0 for frames that aren't timed
+};
+
+// Bounded single-producer single-consumer queue of frames between a reader and a writer stage
+// Cell i always copies into slab slot i, so the slab needs no bookkeeping and the steady state no malloc.
+// Only the producer moves tail and only the consumer moves head and off. Both stages run on the backend's
+// event loop, so these are plain fields.
+struct frame_queue {
+    char               *slab;       // QUEUE_SLOTS * QUEUE_CELL bytes, one allocation per queue
+    struct queue_cell   cells[QUEUE_SLOTS];
+    size_t              head;       // Next cell to write out
+    size_t              tail;       // Next cell to fill
+    size_t              off;        // Bytes of the head cell already written
+};
+
+int queue_init(struct frame_queue *queue);
+void queue_free(struct frame_queue *queue);
+int queue_push(struct frame_queue *queue, const char *data, size_t size, uint32_t opcode, uint64_t stamp);
+size_t queue_count(const struct frame_queue *queue);
+int queue_full(const struct frame_queue *queue);
+struct queue_cell *queue_at(struct frame_queue *queue, size_t index);
+void queue_pop(struct frame_queue *queue);
+void queue_clear(struct frame_queue *queue);
+void queue_retain(struct frame_queue *queue, int (*keep)(const struct queue_cell *cell));
+size_t queue_bytes(const struct frame_queue *queue);
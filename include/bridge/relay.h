@@ -0,0 +1,150 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "bridge/ipc.h"
+#include "bridge/metrics.h"
+#include "bridge/queue.h"
+
+#define RELAY_IOV_BATCH         16              // frames handed to the socket per send
+#define RELAY_ACTIVITY_BURST    5               // SET_ACTIVITY updates Discord accepts per window
+#define RELAY_ACTIVITY_WINDOW   20000           // in ms
+#define RELAY_NO_DEADLINE       UINT64_MAX
+#define RELAY_CLEAR_SIZE        (IPC_HEADER_SIZE + 128)     // SET_ACTIVITY the relay sends to clear one
+#define RELAY_HUSH              4               // Replies the RPC client mustn't see, outstanding at once
+#define RELAY_NONCE_SIZE        48
+#define RELAY_PONG_SIZE         (IPC_HEADER_SIZE + 256)     // Larger PINGs go to Discord, see relay_ping()
+#define RELAY_KEEPALIVE         30000           // in ms, a Discord session this quiet gets a PING of the bridge's own
+#define RELAY_KEEPALIVE_SIZE    (IPC_HEADER_SIZE + RELAY_NONCE_SIZE + 16)
+#define RELAY_RUN               METRICS_TRACKED // Queued frames handed to the pipe per write
+
+// Same layout as struct iovec, so backends hand it to sendmsg as is
+struct relay_iov {
+    void   *base;
+    size_t  len;
+};
+
+struct relay;
+
+// What the relay needs from the platform, one RPC client pipe and one Discord socket per relay
+// The pipe side completes like overlapped I/O: an operation started here finishes later through
+// relay_pipe_read_done() or relay_pipe_write_done(). The socket side is non-blocking and readiness
+// based; relay_sock_ready() is called whenever it may have changed, and a sock_recv() shorter than asked
+// for means nothing more came in until then. Socket errors are negated Linux errno values, and a backend
+// that fails a pipe operation has closed the client by the time it returns.
+// A sock_open() that only gets its answer later returns -LINUX_EINPROGRESS and calls relay_attach() again then.
+// One that failed on its own side rather than for want of Discord returns -LINUX_EIO, relay_attach() closes the client.
+struct transport {
+    int     (*pipe_read)(struct relay *relay, char *buf, size_t len);
+    int     (*pipe_write)(struct relay *relay, const char *buf, size_t len);
+    int     (*sock_open)(struct relay *relay);          // Negative while Discord can't be reached
+    void    (*sock_close)(struct relay *relay);
+    ssize_t (*sock_send)(struct relay *relay, const struct relay_iov *iov, int count);
+    ssize_t (*sock_recv)(struct relay *relay, char *buf, size_t len);
+    void    (*wait)(struct relay *relay);               // No Discord, relay_attach() again once there may be one
+    void    (*close)(struct relay *relay, int failed);  // Done for good, relay_free() follows
+};
+
+// Everything a client's relay needs lives here, so the cost per client is fixed
+struct relay {
+    const struct transport *transport;
+    void               *ctx;                    // The backend's own client
+    int                 id;                     // Only for logs
+    int                 active;                 // Between relay_start() and the client closing
+    int                 attached;               // Has a Discord socket
+    int                 on_demand;              // Set before relay_start(), attaches on the client's first frame instead
+    int                 read_pending;
+    int                 write_pending;
+    uint64_t            start_stamp;            // metrics_now() at relay_start(), 0 once a frame reached Discord
+
+    // RPC client -> Discord, the pipe is read on regardless of how fast Discord takes frames
+    struct ipc_reader   from_pipe;
+    uint64_t            pipe_stamp;             // When the last pipe read completed
+    struct frame_queue  to_sock;                // Between the pipe reader and the socket writer
+    char               *preamble;               // Replay sent ahead of the queue on a new session
+    size_t              preamble_len;
+    size_t              preamble_off;
+
+    // Survives Discord restarts, see relay_detach()
+    char               *handshake;              // Last frames of their kind, header included
+    size_t              handshake_len;
+    char               *activity;
+    size_t              activity_len;
+    int                 replay;                 // Had a session, so the next one starts with a replay
+    int                 closed;                 // A CLOSE went by either way, the session ends with the socket
+    int                 swallow;                // Replies to the replay the RPC client must not see
+
+    // Hands the session to the next client on the same pipe, see relay_park()
+    char               *ready;                  // Discord's READY for this session, header included
+    size_t              ready_len;
+    int                 stateful;               // Sent commands whose effects outlive the client
+    int                 parked;                 // Between relay_park() and the next client's first frame
+    char                fence[32];              // Nonce of the last reply meant for the previous client
+    int                 fence_len;              // 0 when there's none
+
+    // SET_ACTIVITY pacing, see activity_admit()
+    uint64_t            activity_sent[RELAY_ACTIVITY_BURST];    // When recent updates went out, oldest at activity_next
+    int                 activity_next;
+    uint64_t            activity_hash;                          // Of the update Discord has, nonce left out
+    int                 activity_pending;                       // relay->activity is newer and waits for the window
+    uint64_t            activity_at;                            // metrics_ms() of the last update showing something
+    int                 muted;                                  // Updates are held back, see relay_mute()
+    int                 activity_answered;                      // relay->activity got its reply while shown
+    char                hush[RELAY_HUSH][RELAY_NONCE_SIZE];     // Nonces of replies the RPC client mustn't see,
+    int                 hush_count;                             // in the order Discord sends them
+
+    // The client's keepalives never reach Discord, the bridge keeps the session alive itself, see relay_keepalive()
+    char                pong[RELAY_PONG_SIZE];  // Header included
+    size_t              pong_len;               // Waiting for the pipe, 0 when there's none
+    uint64_t            sock_at;                // metrics_ms() of the last bytes either way on the socket
+    char                keepalive[RELAY_KEEPALIVE_SIZE];    // PING sent to Discord, header included
+    size_t              keepalive_len;                      // 0 once Discord answered it
+
+    // Discord -> RPC client, the socket is read on while the pipe takes its time, up to a full queue
+    struct ipc_reader   from_sock;
+    uint64_t            sock_stamp;             // When the last socket read returned data
+    struct frame_queue  to_pipe;                // Between the socket reader and the pipe writer
+    const char         *sock_out;               // Being written to the pipe: a PONG, the kept READY or queued frames
+    size_t              sock_out_len;
+    size_t              sock_off;
+    size_t              sock_out_cells;         // Queued frames sock_out covers, popped once it's written
+    char               *run;                    // Back-to-back queued frames copied together for one pipe write
+    size_t              run_size;
+    struct frame_track  to_pipe_track;
+};
+
+void relay_init(struct relay *relay, const struct transport *transport, void *ctx, int id);
+void relay_free(struct relay *relay);
+void relay_start(struct relay *relay);
+int relay_attach(struct relay *relay);
+int relay_park(struct relay *relay);
+void relay_mute(struct relay *relay, int muted);
+void relay_pipe_read_done(struct relay *relay, size_t count);
+void relay_pipe_write_done(struct relay *relay, size_t count);
+void relay_sock_ready(struct relay *relay);
+uint64_t relay_schedule(struct relay *relay, uint64_t now);
+int relay_sock_pending(const struct relay *relay);
+int relay_sock_wanted(const struct relay *relay);
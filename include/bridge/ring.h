@@ -0,0 +1,112 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "bridge/relay.h"
+
+// Split mode: Discord's sockets belong to src/native/companion.c, a native process that drives them with
+// io_uring, and the bridge trades bytes with it through a file both map next to the Discord sockets. Each relay
+// gets a channel, a pair of single-producer single-consumer byte rings. A side only wakes the other through a
+// futex for a ring that went from empty to not or from full to not, and only once the other announced it's
+// going to sleep; until then the other looks at the rings again before it does. The layout is shared by PE and
+// native builds, every field at its natural alignment.
+#define RING_MAGIC      0x474E5257u         // "WRNG"
+#define RING_VERSION    3                   // 3: the companion announces its sleep, 2: state changes go through ready
+#define RING_PREFIX     "winerpc-ring-"     // Followed by the bridge's Linux pid
+#define RING_CHANNELS   32                  // One per relay, ids index them
+#define RING_BYTES      (32 * 1024)         // Each way, a power of two
+#define RING_LINE       64                  // Producer and consumer fields never share a cache line
+
+enum ring_state {
+    RING_IDLE,          // No connection, the bridge may ask for one
+    RING_CONNECT,       // Asked for by the bridge, the companion reports the outcome through ready
+    RING_OPEN,          // Connected by the companion
+    RING_FAILED,        // Connecting failed with error
+    RING_HANGUP,        // Discord hung up, or failed with error; what it sent before is still there to read
+    RING_CLOSE          // The bridge is done, the companion closes the socket and reports going back to RING_IDLE
+};
+
+struct ring {
+    uint32_t head;                          // Bytes ever produced, only the producer writes it
+    uint32_t full;                          // Set by a producer that found no room, the consumer wakes it
+    uint8_t  pad0[RING_LINE - 8];
+    uint32_t tail;                          // Bytes ever consumed, only the consumer writes it
+    uint8_t  pad1[RING_LINE - 4];
+    char     data[RING_BYTES];
+};
+
+struct ring_channel {
+    uint32_t    state;                      // enum ring_state
+    int32_t     error;                      // Negated errno behind RING_FAILED and RING_HANGUP, 0 for a hangup
+    uint8_t     pad[RING_LINE - 8];
+    struct ring to_discord;                 // The bridge produces
+    struct ring to_client;                  // The companion produces
+};
+
+struct ring_block {
+    uint32_t magic;                         // Written last, the file is only complete once it's there
+    uint32_t version;
+    uint32_t size;                          // sizeof(struct ring_block)
+    uint32_t bridge_pid;                    // Linux pid, so a companion notices a bridge that died
+    uint32_t companion_pid;                 // Of the companion serving the file, 0 until one does
+    uint32_t companion_wake;                // Futex words, bumped by the other side for every wakeup
+    uint32_t bridge_wake;
+    uint32_t ready;                         // Channels with news for the bridge, one bit each
+    uint32_t closing;                       // The bridge is leaving, the companion lets go of the file
+    uint32_t bridge_asleep;                 // ring_wait() is blocked, the only time bridge_wake needs a futex wake
+    uint32_t companion_asleep;              // The companion waits without looking, the only time ring_send() and
+                                            // ring_recv() need to wake it
+    uint8_t  pad[RING_LINE - 44];
+    struct ring_channel channels[RING_CHANNELS];
+};
+
+// Bridge side, single threaded like the event loop except for ring_wait()
+
+// Creates and maps <runtime>/RING_PREFIX<pid> for a companion to find, returns a negative errno on failure
+int ring_init(uint32_t pid);
+void ring_shutdown(void);
+
+// Whether a companion serves the file, until one stops answering
+int ring_served(void);
+
+// Has the companion connect the channel to Discord without waiting for it: -LINUX_EINPROGRESS until ring_wait()
+// or ring_poll() reports the channel and calling again gives 0 or the errno it failed with. -LINUX_ENODEV when
+// there's no companion to ask or it stopped answering, in which case the caller connects on its own.
+int ring_connect(int channel);
+void ring_close(int channel);
+
+// Milliseconds until a connect the companion hasn't answered is overdue, RELAY_NO_DEADLINE without one
+// Calling ring_connect() again then gives up on the companion.
+uint64_t ring_schedule(uint64_t now);
+
+// Socket-like, negated errno values and -LINUX_EAGAIN until ring_wait() reports the channel again
+ssize_t ring_send(int channel, const struct relay_iov *iov, int count);
+ssize_t ring_recv(int channel, char *buf, size_t len);
+
+// Blocks until the companion has news, returns the channels it's about; meant for a thread of its own
+uint32_t ring_wait(void);
+
+// Same without blocking, for the event loop to pick up news itself between waits, 0 when there's none
+uint32_t ring_poll(void);
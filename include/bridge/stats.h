@@ -0,0 +1,74 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#pragma once
+
+#include <stdint.h>
+
+// Live counters published in a file under the runtime directory, one per bridge process
+// The layout is shared with tools/winerpc-stats.c and only ever grows at the end, so a reader takes any version
+// from its own on and reads no further than size. A field that would change meaning is added anew instead, along
+// with a version bump. Every field sits at its natural alignment so PE and native builds agree on it.
+#define STATS_MAGIC     0x53505257u         // "WRPS"
+#define STATS_VERSION   2                   // 2: backlog_drops counts every frame the queue toward Discord had no room for
+#define STATS_PREFIX    "winerpc-stats-"    // Followed by the bridge's Linux pid
+
+enum stats_dir {
+    STATS_TO_DISCORD,
+    STATS_TO_CLIENT,
+    STATS_DIRS
+};
+
+struct stats_block {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;              // sizeof(struct stats_block) as written, readers ignore what they don't know
+    uint32_t pid;
+
+    uint64_t frames[STATS_DIRS];
+    uint64_t bytes[STATS_DIRS];
+    uint64_t reconnects;        // Discord sessions resumed with a replay
+    uint64_t backlog_drops;     // Frames that didn't fit the queue toward Discord, attached or not (version 2)
+    uint64_t activity_drops;    // SET_ACTIVITY updates superseded or unchanged
+
+    uint32_t clients;           // Connected RPC clients
+    uint32_t waiting;           // ... of which are waiting for Discord
+    uint32_t queued_frames;     // Toward Discord, across clients
+    uint32_t backlog_bytes;     // Queued while Discord is away
+    int32_t  last_sock_error;   // Linux errno, negated as returned
+    uint32_t last_pipe_error;   // GetLastError()
+
+    uint64_t activity_updates;  // SET_ACTIVITY frames read from RPC clients, drops included
+    uint64_t events;            // DISPATCH frames from Discord
+    uint64_t first_frame_us;    // Latest RPC client's wait from connecting to its first frame reaching Discord
+    uint64_t resumes;           // RPC clients that picked up the Discord session of the one before
+    uint64_t pongs;             // PINGs answered by the bridge itself
+    uint64_t keepalives;        // PINGs the bridge sent Discord on quiet sessions
+};
+
+// Only the event loop writes, so a plain load and an atomic store are enough; readers load atomically
+#define STATS_ADD(field, n)     __atomic_store_n(&g_stats->field, g_stats->field + (n), __ATOMIC_RELAXED)
+#define STATS_SET(field, value) __atomic_store_n(&g_stats->field, (value), __ATOMIC_RELAXED)
+
+extern struct stats_block *g_stats;
+
+void stats_init(void);
+void stats_shutdown(void);
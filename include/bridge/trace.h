@@ -0,0 +1,61 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "bridge/ipc.h"
+#include "bridge/metrics.h"
+
+// Binary capture of every frame the relay reads, replayed by src/native/relay-replay.c
+// A struct trace_header, then records: a struct trace_record followed by the frame as read, header included,
+// padded to 8 bytes. Records never straddle a TRACE_WINDOW boundary, a record of size 0 toward Discord ends
+// the window early; that is also what a trace cut short by a crash ends with. Layout is the same for PE and native.
+#define TRACE_MAGIC     0x54525257u         // "WRRT"
+#define TRACE_VERSION   1
+#define TRACE_WINDOW    (1024 * 1024)       // Mapped at a time, whole pages and far more than a frame
+#define TRACE_PREFIX    "winerpc-trace-"    // Followed by the bridge's Linux pid, unless given a path
+#define TRACE_GONE      DIR_COUNT           // Direction of the record marking a client that left
+
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t window;                // TRACE_WINDOW as written
+    uint32_t reserved;
+};
+
+struct trace_record {
+    uint64_t stamp;                 // ns since trace_open()
+    uint32_t size;                  // Of the frame, 0 for TRACE_GONE
+    uint16_t client;                // Relay id
+    uint8_t  dir;                   // enum metrics_dir or TRACE_GONE
+    uint8_t  reserved;
+};
+
+#define TRACE_RECORD_SIZE(size)     (sizeof(struct trace_record) + (((size) + 7) & ~(size_t)7))
+
+// path is a Linux path, NULL for the default next to the stats file
+// Tracing is best effort: failing to open or extend the file logs and turns it off
+void trace_open(const char *path);
+void trace_frame(enum metrics_dir dir, int client, const struct ipc_frame *frame);
+void trace_gone(int client);
+void trace_close(void);
@@ -21,4 +21,9 @@
 
 #pragma once
 
+extern int g_persistent;    // Keep serving once the last RPC client leaves
+extern int g_split;         // Leave Discord's sockets to the companion, see bridge/ring.h
+extern int g_trace;         // Record a trace, see bridge/trace.h
+extern char *g_trace_path;  // NULL for the default one
+
 void parse_args(int argc, char *argv[]);
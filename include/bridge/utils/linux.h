@@ -23,12 +23,64 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 #define PROT_READ   1
 #define PROT_WRITE  2
+#define MAP_SHARED  0x01
 #define MAP_PRIVATE 0x02
 #define MAP_FIXED   0x10
 #define MAP_ANON    0x20
+#define LINUX_PAGE_SIZE     4096    // Unit of mmap2 offsets
+
+/* fcntl.h comes from MinGW and carries the Windows values */
+#define LINUX_O_RDONLY      0x0000
+#define LINUX_O_WRONLY      0x0001
+#define LINUX_O_RDWR        0x0002
+#define LINUX_O_CREAT       0x0040
+#define LINUX_O_TRUNC       0x0200
+#define LINUX_O_DIRECTORY   0x10000
+#define LINUX_O_CLOEXEC     0x80000
+
+#define MSG_PEEK        0x02
+#define MSG_DONTWAIT    0x40
+#define MSG_NOSIGNAL    0x4000
+
+#define SOCK_NONBLOCK   0x800
+#define SOCK_CLOEXEC    0x80000
+
+#define EPOLL_CLOEXEC   0x80000
+#define EPOLL_CTL_ADD   1
+#define EPOLL_CTL_DEL   2
+#define EPOLL_CTL_MOD   3
+
+#define EPOLLIN         0x001
+#define EPOLLOUT        0x004
+#define EPOLLERR        0x008
+#define EPOLLHUP        0x010
+#define EPOLLRDHUP      0x2000
+#define EPOLLET         (1u << 31)
+
+#define IN_NONBLOCK     0x800
+#define IN_CLOEXEC      0x80000
+#define IN_MOVED_TO     0x080
+#define IN_CREATE       0x100
+#define IN_ONLYDIR      0x01000000
+
+#define LINUX_FUTEX_WAIT    0       // Shared, never FUTEX_PRIVATE_FLAG: the other side is another process
+#define LINUX_FUTEX_WAKE    1
+
+#define DT_UNKNOWN      0
+#define DT_SOCK         12
+
+#define LINUX_ENOENT        2
+#define LINUX_EINTR         4
+#define LINUX_EIO           5
+#define LINUX_EAGAIN        11
+#define LINUX_ENODEV        19
+#define LINUX_EPIPE         32
+#define LINUX_ECONNREFUSED  111
+#define LINUX_EINPROGRESS   115
 
 typedef struct {
     unsigned short sun_family;               /* AF_UNIX */
@@ -37,11 +89,59 @@ typedef struct {
 
 typedef char sockaddr;
 
+/* Syscalls use the native ABI of the build, so these match the kernel's layout as-is */
+typedef struct {
+    void    *iov_base;                       /* Starting address */
+    size_t   iov_len;                        /* Number of bytes to transfer */
+} iovec;
+
+typedef struct {
+    void     *msg_name;                      /* Optional address */
+    uint32_t  msg_namelen;                   /* Size of address */
+    iovec    *msg_iov;                       /* Scatter/gather array */
+    size_t    msg_iovlen;                    /* # elements in msg_iov */
+    void     *msg_control;                   /* Ancillary data */
+    size_t    msg_controllen;                /* Ancillary data buffer len */
+    int       msg_flags;                     /* Flags on received message */
+} msghdr;
+
+typedef struct {
+    uint64_t       d_ino;                    /* 64-bit inode number */
+    int64_t        d_off;                    /* 64-bit offset to next structure */
+    unsigned short d_reclen;                 /* Size of this dirent */
+    unsigned char  d_type;                   /* File type */
+    char           d_name[];                 /* Filename (null-terminated) */
+} linux_dirent64;
+
+typedef struct {
+    intptr_t tv_sec;                         /* Seconds, long in the build's native ABI */
+    intptr_t tv_nsec;                        /* Nanoseconds */
+} linux_timespec;
+
+typedef struct __attribute__((packed)) {
+    uint32_t events;                         /* Epoll events */
+    uint64_t data;                           /* User data variable */
+} epoll_event;
+
 ssize_t linux_read(int fd, void *buf, size_t count);
 ssize_t linux_write(int fd, const void *buf, size_t count);
 int linux_open(const char *path, int flags, int mode);
 int linux_close(int fd);
 int linux_socket(int domain, int type, int protocol);
 int linux_connect(int socket, sockaddr *address, size_t address_len);
-void *linux_mmap2(void *addr, size_t len, int prot, int flags, int fd);
-int linux_munmap(void *addr, size_t len);
\ No newline at end of file
+ssize_t linux_readv(int fd, const iovec *iov, int iovcnt);
+ssize_t linux_writev(int fd, const iovec *iov, int iovcnt);
+ssize_t linux_sendmsg(int socket, const msghdr *msg, int flags);
+ssize_t linux_recvmsg(int socket, msghdr *msg, int flags);
+void *linux_mmap2(void *addr, size_t len, int prot, int flags, int fd, size_t pgoff);
+int linux_munmap(void *addr, size_t len);
+int linux_epoll_create1(int flags);
+int linux_epoll_ctl(int epfd, int op, int fd, epoll_event *event);
+int linux_epoll_wait(int epfd, epoll_event *events, int maxevents, int timeout);
+int linux_getdents64(int fd, void *dirp, size_t count);
+int linux_inotify_init1(int flags);
+int linux_inotify_add_watch(int fd, const char *path, uint32_t mask);
+int linux_ftruncate(int fd, size_t length);
+int linux_unlink(const char *path);
+ssize_t linux_readlink(const char *path, char *buf, size_t size);
+int linux_futex(uint32_t *uaddr, int op, uint32_t val, const linux_timespec *timeout);
@@ -0,0 +1,54 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#pragma once
+
+// Native Linux backend for the relay, where a connected stream socket stands in for the named pipe
+// Discord is found the same way the bridge finds it, so it runs against the real client or bench/fake-discord.c.
+// Single threaded like the bridge's own loop: everything happens inside posix_relay_poll().
+
+#define POSIX_MAX_CLIENTS   32
+
+// Split mode, see bridge/ring.h: from now on clients reach Discord through a companion once one serves the
+// ring file, and connect directly otherwise. Returns -1 if the file or the thread waiting on it can't be set up.
+int posix_relay_split(void);
+
+// From now on clients connect to Discord with their first frame rather than once added, and a connection is
+// kept ready for the next one, see discovery_warm(). For serving other bridges, most of which sit idle.
+void posix_relay_on_demand(void);
+
+// Takes over pipe_fd, returns the client's id or -1 when every entry is taken
+int posix_relay_add(int pipe_fd);
+
+// One round of the event loop, waiting up to timeout ms (-1 for no limit) for something to do
+// Returns how many clients are still being served, or -1 if polling itself failed
+int posix_relay_poll(int timeout);
+
+// Clients that were closed because of an error rather than by either side hanging up
+int posix_relay_failures(void);
+
+// The client's relay, NULL when the entry is free
+struct relay *posix_relay_get(int id);
+
+// Polls fd for reading along with the clients, e.g. a listening socket; posix_relay_poll() then keeps waiting
+// with no clients left. posix_relay_watched() tells whether the last round found it readable.
+void posix_relay_watch(int fd);
+int posix_relay_watched(void);
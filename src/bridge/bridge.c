@@ -28,30 +28,116 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
-#include <assert.h>
 
 #include "bridge/utils/linux.h"
 #include "bridge/utils/windows.h"
 #include "bridge/utils/arg_parser.h"
+#include "bridge/ipc.h"
+#include "bridge/relay.h"
+#include "bridge/discovery.h"
+#include "bridge/metrics.h"
+#include "bridge/stats.h"
+#include "bridge/trace.h"
+#include "bridge/ring.h"
 #include "bridge/log.h"
 
-#define ARR_LEN(arr) (sizeof(arr) / sizeof(arr[0]))
-
-#define AF_UNIX      1
-#define SOCK_STREAM  1
-#define BUF_SIZE     2048 // size of read/write buffers
-
-static HANDLE hPipe;
-static int sock_fd;
+#define BUF_SIZE     2048           // size of the named pipe buffers
+#define PIPE_SLOTS   10             // discord-ipc-0 through discord-ipc-9
+#define MAX_CLIENTS  32             // upper bound on concurrently served RPC clients; fits sock_ready
+#define STACK_SIZE   (64 * 1024)    // epoll thread stack, it only ever holds the event array
+#define WATCH_TOKEN  MAX_CLIENTS    // epoll data of the discovery watch, past every client id
+#define WAKE_KEY     MAX_CLIENTS    // completion key of wakeups posted from other threads, past every client id
+#define COMPLETIONS  64             // completion packets dequeued per wait
+#define RETRY_MS     50             // Discord binds its socket a moment before it listens on it
+#define RETRY_COUNT  20
+#define LINGER_MS    10000          // Without --persistent, how long a kept Discord session waits for its game to come back
+
+enum client_state {
+    CS_FREE,
+    CS_LISTENING,   // Pipe instance waiting in ConnectNamedPipe
+    CS_CONNECTED,   // Relaying between pipe and socket, or waiting for Discord while relay.attached is 0
+    CS_CLOSING      // Closed, but packets of cancelled operations are still on their way through the port
+};
+
+// Win32 named pipe on one side, raw Linux socket on the other; the frames themselves are relay.c's
+struct client {
+    enum client_state state;
+    int         id;
+    int         slot;
+    HANDLE      hPipe;          // Associated with hPort, keyed by id
+    int         sock_fd;
+    BOOL        fSplit;         // Connected through the companion's channel instead, see bridge/ring.h
+    BOOL        fConnecting;    // Asked the companion for the channel, relay_attach() again once it answers
+
+    OVERLAPPED  ovRead;         // ConnectNamedPipe while listening, ReadFile afterwards
+    OVERLAPPED  ovWrite;
+    BOOL        fConnectPending;
+    int         packets;        // Of cancelled operations, still to be dequeued
+
+    struct relay relay;
+};
+
+static struct client clients[MAX_CLIENTS];
+static int slot_listening[PIPE_SLOTS];  // Pipe instances waiting in ConnectNamedPipe per slot
+static BOOL rearm_pending;              // A client left, see slots_rearm()
+
+static int epoll_fd = -1;
+static HANDLE hPort;                    // Every pipe operation completes here, as do wakeups from other threads
+static LONG volatile wake_posted;       // A WAKE_KEY packet is queued and not yet dequeued
+static LONG volatile sock_ready;        // Bitmask of client ids with socket activity
+static LONG volatile loop_idle;         // Blocked on the port, the only time ring_thread() has to post a wakeup
+static LONG volatile watch_ready;       // Set by epoll_thread when a socket directory gains an entry
+static BOOL watching;
+static int attach_retries;              // Left before waiting clients only wake up on the watch again
+static uint64_t next_retry;             // metrics_ms() of the next one, due whether or not the wait timed out
+static BOOL warm_pending;               // A client took the socket connected ahead of time, see discovery_warm()
+
+static int active_clients;
+static BOOL served_any;
+static uint64_t linger_until;           // Kept sessions hold the bridge up until then, see client_recycle()
+static int exit_code = EXIT_SUCCESS;
+
+static LONG volatile dump_requested;    // Set from the console handler thread, see console_handler()
+static LONG volatile quit_requested;
 
 enum log_level g_log_level = _INVALID;
 
-static const char* get_sock_parent_path(void);
-DWORD WINAPI winwrite_thread();
+static BOOL slot_listen(int slot);
+static BOOL client_listen(struct client *client);
+static void slots_rearm(void);
+static void slot_yield(struct client *client);
+static void client_connected(struct client *client);
+static DWORD clients_schedule(void);
+static void stats_gauges(void);
+static void clients_attach(void);
+static void client_close(struct client *client, BOOL fFailed);
+static void client_recycle(struct client *client);
+static void client_complete(struct client *client, LPOVERLAPPED lpOverlapped);
+static void loop_wake(void);
+static int win_pipe_read(struct relay *relay, char *buf, size_t len);
+static int win_pipe_write(struct relay *relay, const char *buf, size_t len);
+static int win_sock_open(struct relay *relay);
+static void win_sock_close(struct relay *relay);
+static ssize_t win_sock_send(struct relay *relay, const struct relay_iov *iov, int count);
+static ssize_t win_sock_recv(struct relay *relay, char *buf, size_t len);
+static void win_wait(struct relay *relay);
+static void win_close(struct relay *relay, int failed);
+static BOOL WINAPI console_handler(DWORD dwCtrlType);
+DWORD WINAPI epoll_thread(LPVOID lpUnused);
+DWORD WINAPI ring_thread(LPVOID lpUnused);
+
+static const struct transport win_transport = {
+    .pipe_read  = win_pipe_read,
+    .pipe_write = win_pipe_write,
+    .sock_open  = win_sock_open,
+    .sock_close = win_sock_close,
+    .sock_send  = win_sock_send,
+    .sock_recv  = win_sock_recv,
+    .wait       = win_wait,
+    .close      = win_close
+};
 
 int main(int argc, char *argv[])  {
-    int exit_code = EXIT_SUCCESS;
-
     parse_args(argc, argv);
 
     if (g_log_level == _INVALID) {
@@ -60,239 +146,761 @@ int main(int argc, char *argv[])  {
         g_log_level = LL_NONE;
     }
 
-    DWORD   dwThreadId          = 0;
-    DWORD   dwThreadExitCode    = 0;
-    HANDLE  hThread             = NULL;
-    LPCSTR  lpszPipename        = "//./pipe/discord-ipc-0";
+    if (g_log_level > LOG_LEVEL_MAX) {
+        g_log_level = LOG_LEVEL_MAX;
+        bridge_log(LL_WARNING, "Log level is past what this build was compiled with, logging less.\n");
+    }
+
+    if (g_log_level > LL_NONE)
+        bridge_log_init();
+
+    metrics_init();
+    stats_init();
+
+    if (g_trace)
+        trace_open(g_trace_path);
+
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        clients[i].id = i;
+
+    // https://learn.microsoft.com/en-us/windows/win32/fileio/createiocompletionport
+    // Only the loop below ever dequeues, so one concurrent thread
+    if ((hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1)) == NULL) {
+        LPTSTR lpBuffer = GetLastErrorAsString();
+        bridge_log(LL_ERROR, "Failed to create completion port: %s", lpBuffer);
+        LocalFree(lpBuffer);
+        return EXIT_FAILURE;
+    }
+
+    if ((epoll_fd = linux_epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        bridge_log(LL_ERROR, "Failed to create epoll instance: %s.\n", strerror(-epoll_fd));
+        return EXIT_FAILURE;
+    }
+
+    // https://learn.microsoft.com/en-us/windows/win32/api/processthreadsapi/nf-processthreadsapi-createthread
+    // Wine can't wait on a Linux fd and a Windows handle at once, so a helper blocks in epoll_wait
+    // and forwards readiness; every read and write still happens on the loop below
+    HANDLE hThread = CreateThread(
+        NULL,                               // Default security attribute
+        STACK_SIZE,                         // Small stack, see STACK_SIZE
+        epoll_thread,                       // thread proc
+        NULL,                               // thread parameter
+        STACK_SIZE_PARAM_IS_A_RESERVATION,  // not suspended, reserve rather than commit
+        NULL                                // thread ID not needed
+    );
+
+    if (hThread == NULL) {
+        LPTSTR lpBuffer = GetLastErrorAsString();
+        bridge_log(LL_ERROR, "Failed to create thread: %s", lpBuffer);
+        LocalFree(lpBuffer);
+        return EXIT_FAILURE;
+    }
+
+    CloseHandle(hThread);
+
+    // Experimental, only builds made with SPLIT=1 take it, see README.md
+#ifndef SPLIT_MODE
+    if (g_split) bridge_log(LL_WARNING, "Split mode is left out of this build, connecting directly.\n");
+    g_split = 0;
+#endif
+
+    // Split mode, a second helper does for the companion's channels what epoll_thread does for sockets.
+    // Without a file to share, or without a companion to serve it, every client connects on its own.
+    if (g_split && g_stats->pid == 0) {
+        bridge_log(LL_WARNING, "Split mode needs the Linux pid, connecting directly.\n");
+    } else if (g_split && ring_init(g_stats->pid) == 0) {
+        if ((hThread = CreateThread(NULL, STACK_SIZE, ring_thread, NULL, STACK_SIZE_PARAM_IS_A_RESERVATION, NULL)) == NULL) {
+            LPTSTR lpBuffer = GetLastErrorAsString();
+            bridge_log(LL_WARNING, "Failed to create thread, connecting directly: %s", lpBuffer);
+            LocalFree(lpBuffer);
+            ring_shutdown();
+        } else {
+            CloseHandle(hThread);
+        }
+    }
+
+    // https://learn.microsoft.com/en-us/windows/console/setconsolectrlhandler
+    // Not fatal, only costs the on-demand latency report
+    if (!SetConsoleCtrlHandler(console_handler, TRUE))
+        bridge_log(LL_WARNING, "Failed to install console handler, Ctrl+Break won't report latency.\n");
+
+    for (int slot = 0; slot < PIPE_SLOTS; slot++)
+        (VOID)slot_listen(slot);
 
-    bridge_log(LL_INFO, "Creating named pipe for connection to RPC client at \"%s\".\n", lpszPipename);
+    // The game is still starting, so finding Discord now takes the search off its first handshake
+    (VOID)discovery_warm();
+
+    // Serve until the last RPC client leaves and its session stops waiting for it, or until no slot can accept one anymore
+    while (g_persistent || active_clients > 0 || !served_any || metrics_ms() < linger_until) {
+        OVERLAPPED_ENTRY entries[COMPLETIONS];
+        ULONG nEntries = 0;
+        BOOL fListening = FALSE;
+
+        for (int i = 0; i < MAX_CLIENTS; i++)
+            fListening |= clients[i].state == CS_LISTENING;
+
+        if (!fListening && active_clients == 0) {
+            bridge_log(LL_ERROR, "No pipe slot is able to accept RPC clients.\n");
+            exit_code = EXIT_FAILURE;
+            break;
+        }
+
+        DWORD dwTimeout = clients_schedule();
+        uint64_t now = metrics_ms();
+
+        if (attach_retries > 0) {
+            uint64_t wait = next_retry > now ? next_retry - now : 0;
+            if (dwTimeout > wait)
+                dwTimeout = (DWORD)wait;
+        }
+
+        if (!g_persistent && active_clients == 0 && linger_until > now && dwTimeout > linger_until - now)
+            dwTimeout = (DWORD)(linger_until - now);
+
+        // A companion that doesn't answer a connect in time is given up on, see ring_connect()
+        uint64_t answer = ring_schedule(now);
+        if (answer < dwTimeout)
+            dwTimeout = (DWORD)answer;
+
+        // Set before looking, so ring_thread() either sees it or left its news where this finds it
+        (VOID)InterlockedExchange(&loop_idle, TRUE);
+        (VOID)InterlockedOr(&sock_ready, (LONG)ring_poll());
+        if (sock_ready != 0)
+            dwTimeout = 0;
+
+        // https://learn.microsoft.com/en-us/windows/win32/fileio/getqueuedcompletionstatusex-func
+        // Drains a batch of completions per wakeup instead of one handle per wait
+        if (!GetQueuedCompletionStatusEx(hPort, entries, COMPLETIONS, &nEntries, dwTimeout, FALSE)) {
+            if (GetLastError() != WAIT_TIMEOUT) {
+                LPTSTR lpBuffer = GetLastErrorAsString();
+                bridge_log(LL_ERROR, "Failed to wait for completions: %s", lpBuffer);
+                LocalFree(lpBuffer);
+                exit_code = EXIT_FAILURE;
+                break;
+            }
+
+            nEntries = 0;
+        }
+
+        (VOID)InterlockedExchange(&loop_idle, FALSE);
+
+        // Cleared before reading the flags it stands for, so a later change always posts again
+        for (ULONG i = 0; i < nEntries; i++)
+            if (entries[i].lpCompletionKey == WAKE_KEY)
+                (VOID)InterlockedExchange(&wake_posted, FALSE);
+
+        if (InterlockedExchange(&dump_requested, FALSE))
+            metrics_dump();
+
+        if (quit_requested) {
+            bridge_log(LL_WARNING, "Interrupted, shutting down.\n");
+            break;
+        }
+
+        if (InterlockedExchange(&watch_ready, FALSE)) {
+            discovery_drain();
+            attach_retries = RETRY_COUNT;
+            clients_attach();
+        } else if (attach_retries > 0 && metrics_ms() >= next_retry) {
+            // Completions of other clients keep coming while Discord finishes starting up
+            clients_attach();
+        }
+
+        // Socket side first, it may free up room for pending pipe completions
+        ULONG ready = (ULONG)InterlockedExchange(&sock_ready, 0) | ring_poll();
+        BOOL fOverdue = ring_schedule(metrics_ms()) == 0;
+
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            struct client *client = &clients[i];
+            if (client->state != CS_CONNECTED) continue;
+
+            // The companion answered, or the answer is overdue and the client goes direct
+            if (client->fConnecting) {
+                if (((ready & (1UL << i)) || fOverdue) && relay_attach(&client->relay) < 0)
+                    win_wait(&client->relay);
+            } else if (ready & (1UL << i)) {
+                relay_sock_ready(&client->relay);
+            }
+        }
+
+        for (ULONG i = 0; i < nEntries; i++)
+            if (entries[i].lpCompletionKey < MAX_CLIENTS)
+                client_complete(&clients[entries[i].lpCompletionKey], entries[i].lpOverlapped);
+
+        slots_rearm();
+
+        // Once the current clients were served, never ahead of them
+        if (warm_pending) {
+            warm_pending = FALSE;
+            (VOID)discovery_warm();
+        }
+
+        stats_gauges();
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        if (clients[i].state == CS_LISTENING || clients[i].state == CS_CONNECTED)
+            client_close(&clients[i], FALSE);
+
+    linux_close(epoll_fd);
+    ring_shutdown();
+    metrics_dump();
+    trace_close();
+    stats_shutdown();
+    return exit_code;
+}
+
+static BOOL slot_listen(int slot) {
+    struct client *client = NULL;
+    char szPipename[32];
+
+    for (int i = 0; i < MAX_CLIENTS && client == NULL; i++)
+        if (clients[i].state == CS_FREE)
+            client = &clients[i];
+
+    // Picked up again by slots_rearm() once an entry frees up
+    if (client == NULL) {
+        bridge_log(LL_WARNING, "Client limit reached, slot %d stops listening for now.\n", slot);
+        return FALSE;
+    }
+
+    snprintf(szPipename, sizeof(szPipename), "//./pipe/discord-ipc-%d", slot);
+    bridge_log(LL_INFO, "Creating named pipe for connection to RPC client at \"%s\".\n", szPipename);
 
     // https://learn.microsoft.com/en-us/windows/win32/api/winbase/nf-winbase-createnamedpipea
-    hPipe = CreateNamedPipeA(
-        lpszPipename,           // Pipe name
-        PIPE_ACCESS_DUPLEX,     // RW access
-        PIPE_TYPE_BYTE |        // Message type pipe
-        PIPE_READMODE_BYTE |    // Message-read mode
-        PIPE_WAIT,              // Blocking mode
-        1,                      // Max number of instances
-        BUF_SIZE,               // Output buffer size
-        BUF_SIZE,               // Input buffer size
-        0,                      // Client time-out
-        NULL                    // Default security attribute
+    client->hPipe = CreateNamedPipeA(
+        szPipename,                 // Pipe name
+        PIPE_ACCESS_DUPLEX |        // RW access
+        FILE_FLAG_OVERLAPPED,       // Completes through hPort
+        PIPE_TYPE_BYTE |            // Message type pipe
+        PIPE_READMODE_BYTE |        // Message-read mode
+        PIPE_WAIT,                  // Blocking mode, overlapped I/O decides instead
+        PIPE_UNLIMITED_INSTANCES,   // Bounded by MAX_CLIENTS instead
+        BUF_SIZE,                   // Output buffer size
+        BUF_SIZE,                   // Input buffer size
+        0,                          // Client time-out
+        NULL                        // Default security attribute
     );
 
-    if (hPipe == INVALID_HANDLE_VALUE) {
+    if (client->hPipe == INVALID_HANDLE_VALUE) {
         LPTSTR lpBuffer = GetLastErrorAsString();
         bridge_log(LL_ERROR, "Failed to create named pipe: %s", lpBuffer);
         LocalFree(lpBuffer);
-        exit_code = EXIT_FAILURE; goto exit;
+        return FALSE;
     }
 
-    bridge_log(LL_INFO, "Successfully created named pipe.\n");
-    bridge_log(LL_INFO, "Awaiting connection from RPC client.\n");
+    // https://learn.microsoft.com/en-us/windows/win32/fileio/createiocompletionport
+    if (CreateIoCompletionPort(client->hPipe, hPort, (ULONG_PTR)client->id, 0) == NULL) {
+        LPTSTR lpBuffer = GetLastErrorAsString();
+        bridge_log(LL_ERROR, "Failed to associate named pipe with completion port: %s", lpBuffer);
+        LocalFree(lpBuffer);
+        CloseHandle(client->hPipe);
+        return FALSE;
+    }
+
+    client->slot            = slot;
+    client->sock_fd         = -1;
+    client->fSplit          = FALSE;
+    client->fConnecting     = FALSE;
+    client->fConnectPending = FALSE;
+    client->packets         = 0;
+
+    relay_init(&client->relay, &win_transport, client, client->id);
+
+    bridge_log(LL_INFO, "Awaiting connection from RPC client on \"%s\".\n", szPipename);
+    return client_listen(client);
+}
+
+// Waits for the next RPC client on the entry's pipe instance, new or recycled
+static BOOL client_listen(struct client *client) {
+    client->state = CS_LISTENING;
+    slot_listening[client->slot]++;
+
+    memset(&client->ovRead, 0, sizeof(client->ovRead));
+    memset(&client->ovWrite, 0, sizeof(client->ovWrite));
 
     // https://learn.microsoft.com/en-us/windows/win32/api/namedpipeapi/nf-namedpipeapi-connectnamedpipe
-    BOOL fConnected = ConnectNamedPipe(hPipe, NULL) ? TRUE : (GetLastError() == ERROR_PIPE_CONNECTED);
+    // Overlapped connects always return FALSE
+    (VOID)ConnectNamedPipe(client->hPipe, &client->ovRead);
 
-    if (!fConnected) {
-        LPTSTR lpBuffer = GetLastErrorAsString();
-        bridge_log(LL_ERROR, "Failed to connect to RPC client: %s", lpBuffer);
-        LocalFree(lpBuffer);
-        exit_code = EXIT_FAILURE; goto close_pipe;
+    switch (GetLastError()) {
+        case ERROR_IO_PENDING:
+            client->fConnectPending = TRUE;
+            break;
+        case ERROR_PIPE_CONNECTED:
+            // Client raced us, no completion will be signaled
+            client_connected(client);
+            break;
+        default: {
+            LPTSTR lpBuffer = GetLastErrorAsString();
+            bridge_log(LL_ERROR, "Failed to connect to RPC client: %s", lpBuffer);
+            LocalFree(lpBuffer);
+            client_close(client, FALSE);
+            return FALSE;
+        }
     }
 
-    bridge_log(LL_INFO, "Successfully connected to RPC client.\n");
-    bridge_log(LL_INFO, "Creating socket to Discord client.\n");
+    return TRUE;
+}
+
+// A kept session only gets picked up if its pipe instance is the one the game reconnects to, and a pipe hands
+// new clients to its oldest listener, the fresh one from when this client connected. Those that are still waiting
+// make way, so the game finds the kept session on the slot it left, and parked ones stay for their own games.
+static void slot_yield(struct client *client) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        struct client *other = &clients[i];
 
-    if ((sock_fd = linux_socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
-        bridge_log(LL_ERROR, "Failed to create socket: %s.\n", strerror(-sock_fd));
-        exit_code = EXIT_FAILURE; goto close_pipe;
+        // https://learn.microsoft.com/en-us/windows/win32/api/minwinbase/nf-minwinbase-hasoverlappediocompleted
+        // One that already got a client serves it
+        if (other == client || other->state != CS_LISTENING || other->slot != client->slot ||
+            other->relay.parked || !other->fConnectPending || HasOverlappedIoCompleted(&other->ovRead))
+            continue;
+
+        client_close(other, FALSE);
     }
+}
 
-    sockaddr_un sock_addr = {0};
-    sock_addr.sun_family = AF_UNIX;
+// Slots that ran out of room get their listener back
+// Only from the loop, client_close() runs while relay.c may still be unwinding through the entry it frees
+static void slots_rearm(void) {
+    if (!rearm_pending) return;
+    rearm_pending = FALSE;
 
-    const char *temp_path = get_sock_parent_path();
+    // Failed listeners don't, or a broken slot would come right back here
+    for (int slot = 0; slot < PIPE_SLOTS; slot++)
+        if (!slot_listening[slot] && !slot_listen(slot))
+            break;
+}
 
-    const char *sock_path_templates[] = {
-        "%s/discord-ipc-%d",
-        "%s/app/com.discordapp.Discord/discord-ipc-%d",
-        "%s/snap.discord-canary/discord-ipc-%d",
-        "%s/snap.discord/discord-ipc-%d"
-    };
+static void client_connected(struct client *client) {
+    bridge_log(LL_INFO, "Successfully connected to RPC client %d on slot %d.\n", client->id, client->slot);
 
-    int error = 0;
+    client->state = CS_CONNECTED;
+    active_clients++;
+    served_any = TRUE;
 
-    for (size_t i = 0; i < ARR_LEN(sock_path_templates); i++) {
-        for (int pipe = 0; pipe <= 9; pipe++) {
-            snprintf(sock_addr.sun_path, sizeof(sock_addr.sun_path), sock_path_templates[i], temp_path, pipe);
-            bridge_log(LL_INFO, "Attempting to connect to socket at \"%s\".\n", sock_addr.sun_path);
-            if ((error = linux_connect(sock_fd, (sockaddr*)&sock_addr, sizeof(sock_addr))) < 0)
-                bridge_log(LL_WARNING, "Failed to connect to socket: %s\n", strerror(-error));
-            else
-                goto breakout;
-        }
+    // Keep the slot reachable for the next client before doing anything slow, unless a recycled instance is
+    if (--slot_listening[client->slot] == 0)
+        (VOID)slot_listen(client->slot);
+
+    relay_start(&client->relay);
+}
+
+// Runs the relays' timers, held back updates and keepalives, returns how long until the next one is due
+static DWORD clients_schedule(void) {
+    uint64_t now = metrics_ms();
+    DWORD dwTimeout = INFINITE;
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].state != CS_CONNECTED) continue;
+
+        uint64_t wait = relay_schedule(&clients[i].relay, now);
+        if (wait < dwTimeout)
+            dwTimeout = (DWORD)wait;
     }
 
+    return dwTimeout;
+}
+
+static void clients_attach(void) {
+    next_retry = metrics_ms() + RETRY_MS;
 
-breakout:
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].state != CS_CONNECTED || clients[i].relay.attached) continue;
 
-    if (error) {
-        bridge_log(LL_ERROR, "Could not connect to a Discord client.\n");
-        exit_code = EXIT_FAILURE; goto close_socket;
+        // Whatever stopped this one stops the rest too
+        if (relay_attach(&clients[i].relay) < 0) {
+            attach_retries--;
+            return;
+        }
     }
 
-    bridge_log(LL_INFO, "Successfully connected to Discord client.\n");
+    attach_retries = 0;
+}
 
-    // https://learn.microsoft.com/en-us/windows/win32/api/processthreadsapi/nf-processthreadsapi-createthread
-    hThread = CreateThread(
-        NULL,               // Default security attribute
-        0,                  // Default stack size
-        winwrite_thread,    // thread proc
-        (LPVOID) NULL,      // thread parameter
-        0,                  // not suspended
-        &dwThreadId         // returns thread ID
-    );
+static void client_close(struct client *client, BOOL fFailed) {
+    // https://learn.microsoft.com/en-us/windows/win32/fileio/cancelioex-func
+    // Buffers are owned by the kernel until the cancelled operations complete, which is quick and bounded
+    (VOID)CancelIoEx(client->hPipe, NULL);
+
+    DWORD cbUnused;
+    if (client->fConnectPending || client->relay.read_pending)
+        (VOID)GetOverlappedResult(client->hPipe, &client->ovRead, &cbUnused, TRUE);
+    if (client->relay.write_pending)
+        (VOID)GetOverlappedResult(client->hPipe, &client->ovWrite, &cbUnused, TRUE);
+
+    CloseHandle(client->hPipe);
+
+    // Closing also drops it from the epoll set, stale sock_ready bits only cause a spurious EAGAIN
+    if (client->sock_fd >= 0)
+        linux_close(client->sock_fd);
+    if (client->fSplit || client->fConnecting)
+        ring_close(client->id);
+
+    // Their packets are queued on the port regardless, the entry can't be reused until they're in
+    client->packets += client->fConnectPending + client->relay.read_pending + client->relay.write_pending;
+    relay_free(&client->relay);
+
+    if (client->state == CS_LISTENING) {
+        slot_listening[client->slot]--;
+    } else if (client->state == CS_CONNECTED) {
+        active_clients--;
+        rearm_pending = TRUE;
+    }
 
-    if (hThread == NULL) {
+    if (fFailed) exit_code = EXIT_FAILURE;
+
+    client->state = client->packets > 0 ? CS_CLOSING : CS_FREE;
+}
+
+// The RPC client hung up, its pipe instance and, where relay_park() allows, its Discord session wait for the next
+// one. Without --persistent, a kept session holds the bridge up for LINGER_MS, long enough for a game that
+// reconnects to pick it up instead of a new handshake.
+static void client_recycle(struct client *client) {
+    (VOID)CancelIoEx(client->hPipe, NULL);
+
+    DWORD cbUnused;
+    if (client->relay.read_pending)
+        (VOID)GetOverlappedResult(client->hPipe, &client->ovRead, &cbUnused, TRUE);
+    if (client->relay.write_pending)
+        (VOID)GetOverlappedResult(client->hPipe, &client->ovWrite, &cbUnused, TRUE);
+
+    // https://learn.microsoft.com/en-us/windows/win32/api/namedpipeapi/nf-namedpipeapi-disconnectnamedpipe
+    if (!DisconnectNamedPipe(client->hPipe)) {
         LPTSTR lpBuffer = GetLastErrorAsString();
-        bridge_log(LL_ERROR, "Failed to create thread: %s", lpBuffer);
+        bridge_log(LL_ERROR, "Failed to disconnect named pipe: %s", lpBuffer);
         LocalFree(lpBuffer);
-        exit_code = EXIT_FAILURE; goto close_socket;
+        client_close(client, FALSE);
+        return;
     }
 
-    while (TRUE) {
-        char buf[BUF_SIZE];
-        DWORD bytes_read = 0;
-
-        // https://learn.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-readfile
-        BOOL fSuccess = ReadFile(
-            hPipe,          // Pipe handle
-            buf,            // Buffer to receive data
-            BUF_SIZE - 1,   // Buffer size; Allow us to null-terminate just in case
-            &bytes_read,    // Pointer to receive number of bytes read
-            NULL            // Not asynchronous
-        );
-
-        if (!fSuccess) {
+    // Dequeued ahead of the next connection's, the port keeps them in order
+    client->packets += client->relay.read_pending + client->relay.write_pending;
+    active_clients--;
+
+    BOOL fKept = relay_park(&client->relay);
+
+    // Nobody is left to take the channel when the companion answers
+    if (client->fConnecting) {
+        ring_close(client->id);
+        client->fConnecting = FALSE;
+    }
+
+    if (!client_listen(client) || !fKept) return;
+
+    bridge_log(LL_INFO, "Keeping Discord session of client %d for the next RPC client.\n", client->id);
+    linger_until = metrics_ms() + LINGER_MS;
+
+    // Unless the next one raced in already, the slot's other listener then being its only one
+    if (client->state == CS_LISTENING)
+        slot_yield(client);
+}
+
+// One operation on the client's pipe finished, successfully or not
+static void client_complete(struct client *client, LPOVERLAPPED lpOverlapped) {
+    DWORD cbTransferred = 0;
+
+    // Cancelled operations of a closed or recycled entry, whatever it does now comes after them
+    if (client->packets > 0) {
+        if (--client->packets == 0 && client->state == CS_CLOSING) {
+            client->state = CS_FREE;
+            rearm_pending = TRUE;
+        }
+        return;
+    }
+
+    if (client->state == CS_LISTENING) {
+        client->fConnectPending = FALSE;
+
+        // https://learn.microsoft.com/en-us/windows/win32/api/ioapiset/nf-ioapiset-getoverlappedresult
+        if (!GetOverlappedResult(client->hPipe, &client->ovRead, &cbTransferred, FALSE)) {
+            LPTSTR lpBuffer = GetLastErrorAsString();
+            bridge_log(LL_ERROR, "Failed to connect to RPC client: %s", lpBuffer);
+            LocalFree(lpBuffer);
+            client_close(client, FALSE);
+            return;
+        }
+
+        client_connected(client);
+        return;
+    }
+
+    if (lpOverlapped == &client->ovRead) {
+        client->relay.read_pending = FALSE;
+
+        if (!GetOverlappedResult(client->hPipe, &client->ovRead, &cbTransferred, FALSE)) {
             DWORD dwError = GetLastError();
             if (dwError == ERROR_BROKEN_PIPE) {
-                bridge_log(LL_WARNING, "Connection closed by RPC client.\n");
-            } else if (dwError != ERROR_OPERATION_ABORTED) {
+                bridge_log(LL_WARNING, "Connection closed by RPC client %d.\n", client->id);
+                client_recycle(client);
+            } else {
+                STATS_SET(last_pipe_error, dwError);
                 LPTSTR lpBuffer = GetLastErrorAsString();
                 bridge_log(LL_ERROR, "Failed to read from named pipe: %s", lpBuffer);
                 LocalFree(lpBuffer);
-                exit_code = EXIT_FAILURE;
+                client_close(client, dwError != ERROR_OPERATION_ABORTED);
             }
-            goto cleanup;
+            return;
         }
 
-        // Null-terminate messages so printf doesn't read past into leftover bytes from previous write
-        // fSuccess = TRUE means bytes_read < BUF_SIZE
-        buf[bytes_read] = '\0';
+        bridge_log(LL_TRACE, "%lu bytes received from RPC client %d.\n", cbTransferred, client->id);
+        relay_pipe_read_done(&client->relay, cbTransferred);
+        return;
+    }
 
-        bridge_log(LL_INFO, "%lu bytes received from RPC client.\n", bytes_read);
-        bridge_log(LL_DEBUG, "%s\n", SKIP_GPG_KEY(buf));
+    client->relay.write_pending = FALSE;
 
-        long unsigned int total_written = 0;
-        int written = 0;
+    if (!GetOverlappedResult(client->hPipe, &client->ovWrite, &cbTransferred, FALSE)) {
+        STATS_SET(last_pipe_error, GetLastError());
+        LPTSTR lpBuffer = GetLastErrorAsString();
+        bridge_log(LL_ERROR, "Failed to write to named pipe: %s", lpBuffer);
+        LocalFree(lpBuffer);
+        client_close(client, TRUE);
+        return;
+    }
 
-        while (total_written < bytes_read) {
-            written = linux_write(sock_fd, buf + total_written, bytes_read - total_written);
-            if (written < 0) {
-                bridge_log(LL_ERROR, "Failed to write to socket: %s.\n", strerror(-written));
-                exit_code = EXIT_FAILURE; goto cleanup;
-            }
-            total_written += written;
-            written = 0;
-        }
+    relay_pipe_write_done(&client->relay, cbTransferred);
+}
+
+static int win_pipe_read(struct relay *relay, char *buf, size_t len) {
+    struct client *client = relay->ctx;
+
+    // https://learn.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-readfile
+    // Immediate completions are queued on the port just the same, so both paths end up in client_complete()
+    BOOL fSuccess = ReadFile(
+        client->hPipe,          // Pipe handle
+        buf,                    // Buffer to receive data
+        (DWORD)len,             // Room left for the frame being reassembled
+        NULL,                   // Result is picked up from the overlapped structure
+        &client->ovRead         // Asynchronous
+    );
+
+    if (fSuccess || GetLastError() == ERROR_IO_PENDING)
+        return 0;
+
+    // Same as when the read completes later; relay.c returns as soon as a pipe operation fails, so the
+    // relay can be parked from here just as it can be freed
+    if (GetLastError() == ERROR_BROKEN_PIPE) {
+        bridge_log(LL_WARNING, "Connection closed by RPC client %d.\n", client->id);
+        client_recycle(client);
+    } else {
+        STATS_SET(last_pipe_error, GetLastError());
+        LPTSTR lpBuffer = GetLastErrorAsString();
+        bridge_log(LL_ERROR, "Failed to read from named pipe: %s", lpBuffer);
+        LocalFree(lpBuffer);
+        client_close(client, TRUE);
     }
 
-cleanup:
-    // https://learn.microsoft.com/en-us/windows/win32/api/synchapi/nf-synchapi-waitforsingleobject
-    // Thread will always exit as both it and the main thread rely on functioning socket and pipe
-    // If either breaks both will exit, but we wait out of courtesy
-    (VOID)WaitForSingleObject(hPipe, INFINITE);
-
-    // https://learn.microsoft.com/en-us/windows/win32/api/processthreadsapi/nf-processthreadsapi-getexitcodethread
-    // Already exited, so just grab the code
-    (VOID)GetExitCodeThread(hThread, &dwThreadExitCode);
-
-    // Only exit with a return code of 0 when neither thread caught an error
-    exit_code = (int)(exit_code || dwThreadExitCode);
-close_socket:
-    linux_close(sock_fd);
-close_pipe:
-    CloseHandle(hPipe);
-exit:
-    return exit_code;
+    return -1;
 }
 
-static const char* get_sock_parent_path(void) {
-    const char *env_tmp_paths[] = {"XDG_RUNTIME_DIR", "TMPDIR", "TMP", "TEMP"};
-    char *path;
+static int win_pipe_write(struct relay *relay, const char *buf, size_t len) {
+    struct client *client = relay->ctx;
+
+    // https://learn.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-writefile
+    BOOL fSuccess = WriteFile(
+        client->hPipe,          // Pipe handle
+        buf,                    // Buffer to write from
+        (DWORD)len,             // Remaining unwritten bytes
+        NULL,                   // Result is picked up from the overlapped structure
+        &client->ovWrite        // Asynchronous
+    );
 
-    for (size_t i = 0; i < ARR_LEN(env_tmp_paths); i++)
-        if ((path = getenv(env_tmp_paths[i])))
-            return path;
+    if (fSuccess || GetLastError() == ERROR_IO_PENDING)
+        return 0;
 
-    return "/tmp";
+    STATS_SET(last_pipe_error, GetLastError());
+    LPTSTR lpBuffer = GetLastErrorAsString();
+    bridge_log(LL_ERROR, "Failed to write to named pipe: %s", lpBuffer);
+    LocalFree(lpBuffer);
+    client_close(client, TRUE);
+    return -1;
 }
 
+static int win_sock_open(struct relay *relay) {
+    struct client *client = relay->ctx;
 
-DWORD WINAPI winwrite_thread(LPVOID lpUnused) {
-    // Just to match function signature
-    (VOID)lpUnused;
+    // Channels are numbered like the clients, and without a companion to ask the socket is ours
+    int error = ring_served() ? ring_connect(client->id) : -LINUX_ENODEV;
+    client->fConnecting = error == -LINUX_EINPROGRESS;
 
-    DWORD dwExitCode = EXIT_SUCCESS;
+    if (error != -LINUX_ENODEV) {
+        if (error < 0) return error;
+        client->fSplit = TRUE;
+        return 0;
+    }
 
-    while (TRUE) {
-        char buf[BUF_SIZE];
-        ssize_t bytes_read = linux_read(sock_fd, buf, BUF_SIZE - 1);  // Allow us to null-terminate on the off-chance
+    int sock_fd = discovery_connect();
+    if (sock_fd < 0) return sock_fd;
+
+    epoll_event event = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data   = client->id
+    };
+
+    if ((error = linux_epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &event)) < 0) {
+        bridge_log(LL_ERROR, "Failed to watch socket: %s.\n", strerror(-error));
+        linux_close(sock_fd);
+        return -LINUX_EIO;
+    }
+
+    client->sock_fd = sock_fd;
+    warm_pending = TRUE;
+    return 0;
+}
+
+static void win_sock_close(struct relay *relay) {
+    struct client *client = relay->ctx;
+
+    if (client->fSplit) {
+        ring_close(client->id);
+        client->fSplit = FALSE;
+        return;
+    }
+
+    linux_close(client->sock_fd);
+    client->sock_fd = -1;
+}
+
+static ssize_t win_sock_send(struct relay *relay, const struct relay_iov *iov, int count) {
+    struct client *client = relay->ctx;
+    if (client->fSplit) return ring_send(client->id, iov, count);
+
+    msghdr msg = {
+        .msg_iov    = (iovec*)iov,
+        .msg_iovlen = count
+    };
+
+    // MSG_NOSIGNAL since a dead socket is reported through the return value
+    return linux_sendmsg(client->sock_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// Edge-triggered, so EAGAIN means the next edge comes once more data arrives
+static ssize_t win_sock_recv(struct relay *relay, char *buf, size_t len) {
+    struct client *client = relay->ctx;
+    if (client->fSplit) return ring_recv(client->id, buf, len);
+    return linux_read(client->sock_fd, buf, len);
+}
+
+static void win_wait(struct relay *relay) {
+    struct client *client = relay->ctx;
+
+    if (!watching) {
+        int watch_fd = discovery_watch();
+
+        if (watch_fd < 0) {
+            client_close(client, TRUE);
+            return;
+        }
+
+        // Edge-triggered, discovery_drain() reads the watch empty every time
+        epoll_event event = {
+            .events = EPOLLIN | EPOLLET,
+            .data   = WATCH_TOKEN
+        };
+
+        int error;
+        if ((error = linux_epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watch_fd, &event)) < 0) {
+            bridge_log(LL_ERROR, "Failed to watch socket directories: %s.\n", strerror(-error));
+            client_close(client, TRUE);
+            return;
+        }
+
+        watching = TRUE;
+    }
+
+    // The socket may have appeared before the watch existed, or Discord only dropped the connection
+    if (attach_retries == 0) {
+        attach_retries = 1;
+        next_retry = metrics_ms() + RETRY_MS;
+    }
+}
+
+static void win_close(struct relay *relay, int failed) {
+    client_close(relay->ctx, failed);
+}
+
+// Levels rather than events, cheapest to recount once per loop iteration
+static void stats_gauges(void) {
+    uint32_t connected = 0, waiting = 0, queued = 0, backlog = 0;
 
-        if (bytes_read < 0) {
-            bridge_log(LL_ERROR, "Failed to read from socket: %s.\n", strerror(-bytes_read));
-            dwExitCode = EXIT_FAILURE;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].state != CS_CONNECTED) continue;
+        connected++;
+        waiting += !clients[i].relay.attached;
+        queued += queue_count(&clients[i].relay.to_sock);
+        backlog += clients[i].relay.attached ? 0 : queue_bytes(&clients[i].relay.to_sock);
+    }
+
+    STATS_SET(clients, connected);
+    STATS_SET(waiting, waiting);
+    STATS_SET(queued_frames, queued);
+    STATS_SET(backlog_bytes, backlog);
+}
+
+// Runs on a thread of its own, so only flag the request and let the loop act on it
+static BOOL WINAPI console_handler(DWORD dwCtrlType) {
+    switch (dwCtrlType) {
+        case CTRL_BREAK_EVENT:
+            (VOID)InterlockedExchange(&dump_requested, TRUE);
             break;
-        } else if (bytes_read == 0) {
-            bridge_log(LL_WARNING, "Connection closed by Discord client.\n");
-            dwExitCode = EXIT_FAILURE;
+        case CTRL_C_EVENT:
+        case CTRL_CLOSE_EVENT:
+            (VOID)InterlockedExchange(&quit_requested, TRUE);
             break;
-        }
+        default:
+            return FALSE;
+    }
 
-        // Null-terminate messages so printf doesn't read past into leftover bytes from previous write
-        buf[bytes_read] = '\0';
+    loop_wake();
+    return TRUE;
+}
 
-        bridge_log(LL_INFO, "%ld bytes received from Discord client.\n", (long int)bytes_read);
-        bridge_log(LL_DEBUG, "%s\n", SKIP_GPG_KEY(buf));
+// From other threads, at most one wakeup is ever queued on the port
+static void loop_wake(void) {
+    // https://learn.microsoft.com/en-us/windows/win32/fileio/postqueuedcompletionstatus
+    if (!InterlockedExchange(&wake_posted, TRUE))
+        (VOID)PostQueuedCompletionStatus(hPort, 0, WAKE_KEY, NULL);
+}
 
-        DWORD total_written = 0, cbWritten = 0;
+DWORD WINAPI epoll_thread(LPVOID lpUnused) {
+    // Just to match function signature
+    (VOID)lpUnused;
 
-        // Positive value so safe conversion
-        while (total_written < (DWORD)bytes_read) {
-            // https://learn.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-writefile
-            BOOL fSuccess = WriteFile(
-                hPipe,                      // Pipe handle
-                buf + total_written,        // Buffer to write from
-                bytes_read - total_written, // Remaining unwritten bytes
-                &cbWritten,                 // Pointer to receive number of bytes written
-                NULL                        // NULL = Synchronous I/O
-            );
+    while (TRUE) {
+        epoll_event events[MAX_CLIENTS];
+        int count = linux_epoll_wait(epoll_fd, events, MAX_CLIENTS, -1);
 
-            if (!fSuccess) {
-                LPTSTR lpBuffer = GetLastErrorAsString();
-                bridge_log(LL_ERROR, "Failed to write to named pipe: %s", lpBuffer);
-                LocalFree(lpBuffer);
-                break;
-            }
+        if (count == -LINUX_EINTR) continue;
+
+        if (count < 0) {
+            bridge_log(LL_ERROR, "Failed to wait for socket events: %s.\n", strerror(-count));
+            return EXIT_FAILURE;
+        }
 
-            total_written += cbWritten;
-            cbWritten = 0;
+        ULONG ready = 0;
+        for (int i = 0; i < count; i++) {
+            if (events[i].data == WATCH_TOKEN)
+                (VOID)InterlockedExchange(&watch_ready, TRUE);
+            else
+                ready |= 1UL << events[i].data;
         }
+
+        (VOID)InterlockedOr(&sock_ready, (LONG)ready);
+        loop_wake();
     }
+}
 
-    // https://learn.microsoft.com/en-us/windows/win32/fileio/cancelioex-func
-    // Signals current process to stop all WinAPI I/O operations
-    CancelIoEx(hPipe, NULL);
-    return dwExitCode;
+// Channels the companion has news about count as socket activity, the loop can't tell them apart
+DWORD WINAPI ring_thread(LPVOID lpUnused) {
+    // Just to match function signature
+    (VOID)lpUnused;
+
+    while (TRUE) {
+        (VOID)InterlockedOr(&sock_ready, (LONG)ring_wait());
+
+        // A busy loop picks the bits up before it blocks again, saving a round trip through the port
+        if (loop_idle)
+            loop_wake();
+    }
 }
@@ -0,0 +1,335 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bridge/discovery.h"
+#include "bridge/utils/linux.h"
+#include "bridge/log.h"
+
+#define ARR_LEN(arr) (sizeof(arr) / sizeof(arr[0]))
+
+#define AF_UNIX         1
+#define SOCK_STREAM     1
+#define PATH_SIZE       sizeof(((sockaddr_un*)0)->sun_path)
+#define IPC_PREFIX      "discord-ipc-"
+#define CACHE_NAME      "winerpc-last-socket"   // Lives next to the sockets, in the runtime directory
+
+// Searched in order, each for discord-ipc-0 through discord-ipc-9
+static const char *sock_dir_templates[] = {
+    "%s",
+    "%s/app/com.discordapp.Discord",
+    "%s/snap.discord-canary",
+    "%s/snap.discord"
+};
+
+// Flatpak creates app/ and its Discord directory separately, so both need watching
+static const char *watch_dir_templates[] = {
+    "%s",
+    "%s/app",
+    "%s/app/com.discordapp.Discord",
+    "%s/snap.discord-canary",
+    "%s/snap.discord"
+};
+
+static char last_good[PATH_SIZE];
+static int cache_loaded;
+static int inotify_fd = -1;
+static int warm_fd = -1;        // Connected and not handed out yet, see discovery_warm()
+static int prefer_hub = 1;
+static int via_hub;             // The last socket discovery_open() found was the hub's
+
+const char* get_sock_parent_path(void) {
+    const char *env_tmp_paths[] = {"XDG_RUNTIME_DIR", "TMPDIR", "TMP", "TEMP"};
+    char *path;
+
+    for (size_t i = 0; i < ARR_LEN(env_tmp_paths); i++)
+        if ((path = getenv(env_tmp_paths[i])))
+            return path;
+
+    return "/tmp";
+}
+
+static void cache_load(void) {
+    char cache_path[PATH_SIZE];
+    snprintf(cache_path, sizeof(cache_path), "%s/" CACHE_NAME, get_sock_parent_path());
+
+    int fd = linux_open(cache_path, LINUX_O_RDONLY | LINUX_O_CLOEXEC, 0);
+    if (fd < 0) return;
+
+    ssize_t length = linux_read(fd, last_good, sizeof(last_good) - 1);
+    last_good[length > 0 ? length : 0] = '\0';
+    linux_close(fd);
+
+    bridge_log(LL_DEBUG, "Last working Discord socket was \"%s\".\n", last_good);
+}
+
+static void cache_store(const char *sock_path) {
+    if (strcmp(last_good, sock_path) == 0) return;
+
+    snprintf(last_good, sizeof(last_good), "%s", sock_path);
+
+    char cache_path[PATH_SIZE];
+    snprintf(cache_path, sizeof(cache_path), "%s/" CACHE_NAME, get_sock_parent_path());
+
+    int fd = linux_open(cache_path, LINUX_O_WRONLY | LINUX_O_CREAT | LINUX_O_TRUNC | LINUX_O_CLOEXEC, 0600);
+    if (fd < 0) {
+        bridge_log(LL_DEBUG, "Failed to store last working socket: %s.\n", strerror(-fd));
+        return;
+    }
+
+    // Best effort, a short or failed write only costs a scan next time
+    (void)linux_write(fd, last_good, strlen(last_good));
+    linux_close(fd);
+}
+
+static int try_connect(int sock_fd, const char *sock_path) {
+    sockaddr_un sock_addr = {0};
+    sock_addr.sun_family = AF_UNIX;
+    snprintf(sock_addr.sun_path, sizeof(sock_addr.sun_path), "%s", sock_path);
+
+    bridge_log(LL_INFO, "Attempting to connect to socket at \"%s\".\n", sock_path);
+
+    // Unix sockets connect synchronously even when non-blocking, EAGAIN only means a full backlog
+    int error = linux_connect(sock_fd, (sockaddr*)&sock_addr, sizeof(sock_addr));
+    if (error < 0)
+        bridge_log(LL_WARNING, "Failed to connect to socket: %s\n", strerror(-error));
+
+    return error;
+}
+
+// Bitmask of the discord-ipc-N sockets present, one or two getdents64 calls instead of a connect per name
+static unsigned list_sockets(const char *dir) {
+    unsigned found = 0;
+    int dir_fd = linux_open(dir, LINUX_O_RDONLY | LINUX_O_DIRECTORY | LINUX_O_CLOEXEC, 0);
+
+    if (dir_fd < 0) return 0;
+
+    char buf[1024] __attribute__((aligned(8)));
+    int length;
+
+    while ((length = linux_getdents64(dir_fd, buf, sizeof(buf))) > 0) {
+        const linux_dirent64 *entry;
+
+        for (int off = 0; off < length; off += entry->d_reclen) {
+            entry = (const linux_dirent64*)(buf + off);
+
+            if (entry->d_type != DT_SOCK && entry->d_type != DT_UNKNOWN) continue;
+            if (strncmp(entry->d_name, IPC_PREFIX, strlen(IPC_PREFIX)) != 0) continue;
+
+            const char *digit = entry->d_name + strlen(IPC_PREFIX);
+            if (digit[0] >= '0' && digit[0] <= '9' && digit[1] == '\0')
+                found |= 1u << (digit[0] - '0');
+        }
+    }
+
+    linux_close(dir_fd);
+    return found;
+}
+
+void discovery_prefer_hub(int prefer) {
+    prefer_hub = prefer;
+}
+
+// Quietly, on most hosts there's no hub and this is a single failed connect
+static int hub_connect(int sock_fd) {
+    sockaddr_un sock_addr = {0};
+    sock_addr.sun_family = AF_UNIX;
+    snprintf(sock_addr.sun_path, sizeof(sock_addr.sun_path), "%s/" HUB_NAME, get_sock_parent_path());
+
+    int error = linux_connect(sock_fd, (sockaddr*)&sock_addr, sizeof(sock_addr));
+    if (error == 0)
+        bridge_log(LL_INFO, "Connected to presence hub at \"%s\".\n", sock_addr.sun_path);
+    return error;
+}
+
+static int discovery_open(void) {
+    int sock_fd, error = -LINUX_ENOENT;
+
+    bridge_log(LL_INFO, "Creating socket to Discord client.\n");
+
+    if ((sock_fd = linux_socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        bridge_log(LL_ERROR, "Failed to create socket: %s.\n", strerror(-sock_fd));
+        return sock_fd;
+    }
+
+    // The hub speaks the same protocol and holds the Discord connections for every prefix on the host
+    if ((via_hub = prefer_hub && hub_connect(sock_fd) == 0))
+        return sock_fd;
+
+    if (!cache_loaded) {
+        cache_load();
+        cache_loaded = 1;
+    }
+
+    // Almost always the same socket as last time, so that is a single connect
+    if (last_good[0] != '\0' && (error = try_connect(sock_fd, last_good)) == 0)
+        return sock_fd;
+
+    const char *temp_path = get_sock_parent_path();
+
+    for (size_t i = 0; i < ARR_LEN(sock_dir_templates); i++) {
+        char dir[PATH_SIZE];
+        snprintf(dir, sizeof(dir), sock_dir_templates[i], temp_path);
+
+        unsigned found = list_sockets(dir);
+
+        for (int pipe = 0; pipe <= 9; pipe++) {
+            if (!(found & (1u << pipe))) continue;
+
+            // Too long for sun_path, connecting would fail anyway
+            char sock_path[PATH_SIZE];
+            if (snprintf(sock_path, sizeof(sock_path), "%s/" IPC_PREFIX "%d", dir, pipe) >= (int)sizeof(sock_path))
+                continue;
+
+            if (strcmp(sock_path, last_good) == 0) continue;
+
+            if ((error = try_connect(sock_fd, sock_path)) == 0) {
+                cache_store(sock_path);
+                return sock_fd;
+            }
+        }
+    }
+
+    bridge_log(LL_INFO, "Could not connect to a Discord client.\n");
+    linux_close(sock_fd);
+    return error;
+}
+
+int discovery_path(int index, char *path, size_t size) {
+    if (!cache_loaded) {
+        cache_load();
+        cache_loaded = 1;
+    }
+
+    if (last_good[0] != '\0' && index-- == 0) {
+        snprintf(path, size, "%s", last_good);
+        return 0;
+    }
+
+    const char *temp_path = get_sock_parent_path();
+
+    for (size_t i = 0; i < ARR_LEN(sock_dir_templates); i++) {
+        char dir[PATH_SIZE];
+        snprintf(dir, sizeof(dir), sock_dir_templates[i], temp_path);
+
+        unsigned found = list_sockets(dir);
+
+        for (int pipe = 0; pipe <= 9; pipe++) {
+            if (!(found & (1u << pipe))) continue;
+
+            char sock_path[PATH_SIZE];
+            if (snprintf(sock_path, sizeof(sock_path), "%s/" IPC_PREFIX "%d", dir, pipe) >= (int)sizeof(sock_path))
+                continue;
+
+            if (strcmp(sock_path, last_good) == 0 || index-- > 0) continue;
+
+            snprintf(path, size, "%s", sock_path);
+            return 0;
+        }
+    }
+
+    return -LINUX_ENOENT;
+}
+
+void discovery_found(const char *path) {
+    cache_store(path);
+}
+
+int discovery_connect(void) {
+    int sock_fd = warm_fd;
+
+    if (sock_fd >= 0) {
+        char byte;
+        iovec iov = {&byte, 1};
+        msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+        warm_fd = -1;
+
+        // Discord says nothing before the handshake, so anything but EAGAIN means it went away meanwhile
+        if (linux_recvmsg(sock_fd, &msg, MSG_PEEK | MSG_DONTWAIT) == -LINUX_EAGAIN) {
+            bridge_log(LL_DEBUG, "Using socket connected ahead of time.\n");
+            return sock_fd;
+        }
+
+        linux_close(sock_fd);
+    }
+
+    return discovery_open();
+}
+
+int discovery_warm(void) {
+    // The hub keeps a spare of its own, one here would only be an idle client of it
+    if (warm_fd >= 0 || via_hub) return 0;
+
+    int sock_fd = discovery_open();
+    if (sock_fd < 0) return sock_fd;
+
+    if (via_hub) {
+        linux_close(sock_fd);
+        return 0;
+    }
+
+    bridge_log(LL_INFO, "Connected to Discord ahead of the next RPC client.\n");
+    warm_fd = sock_fd;
+    return 0;
+}
+
+static void add_watches(void) {
+    const char *temp_path = get_sock_parent_path();
+
+    // Directories that don't exist yet are covered by the watch on their parent
+    for (size_t i = 0; i < ARR_LEN(watch_dir_templates); i++) {
+        char dir[PATH_SIZE];
+        snprintf(dir, sizeof(dir), watch_dir_templates[i], temp_path);
+        (void)linux_inotify_add_watch(inotify_fd, dir, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+    }
+}
+
+int discovery_watch(void) {
+    if (inotify_fd >= 0) return inotify_fd;
+
+    if ((inotify_fd = linux_inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        int error = inotify_fd;
+        bridge_log(LL_ERROR, "Failed to create inotify instance: %s.\n", strerror(-error));
+        inotify_fd = -1;
+        return error;
+    }
+
+    add_watches();
+    return inotify_fd;
+}
+
+void discovery_drain(void) {
+    char buf[1024] __attribute__((aligned(8)));
+
+    if (inotify_fd < 0) return;
+
+    // Only the wakeup matters, whatever was created gets found by the next scan
+    while (linux_read(inotify_fd, buf, sizeof(buf)) > 0)
+        ;
+
+    // Watching a directory again is a no-op, but one may have just appeared
+    add_watches();
+}
@@ -0,0 +1,451 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// The SIMD scans are built for any x86 target and picked at run time, see scan_pick()
+#if defined(__i386__) || defined(__x86_64__)
+    #include <immintrin.h>
+    #define SCAN_X86
+#endif
+
+#include "bridge/ipc.h"
+
+void ipc_reader_init(struct ipc_reader *reader) {
+    reader->buf     = reader->inline_buf;
+    reader->cap     = sizeof(reader->inline_buf);
+    reader->start   = 0;
+    reader->end     = 0;
+}
+
+void ipc_reader_free(struct ipc_reader *reader) {
+    if (reader->buf != reader->inline_buf)
+        free(reader->buf);
+
+    ipc_reader_init(reader);
+}
+
+char *ipc_reader_space(struct ipc_reader *reader, size_t *avail) {
+    size_t pending = reader->end - reader->start;
+    size_t needed = IPC_HEADER_SIZE;
+
+    // Oversized buffers only live as long as the frame that needed them
+    if (pending == 0 && reader->buf != reader->inline_buf)
+        ipc_reader_free(reader);
+
+    // At most one partial frame is left over, so this never copies more than a frame
+    if (reader->start > 0) {
+        memmove(reader->buf, reader->buf + reader->start, pending);
+        reader->start = 0;
+        reader->end = pending;
+    }
+
+    if (pending >= IPC_HEADER_SIZE) {
+        uint32_t length;
+        memcpy(&length, reader->buf + sizeof(uint32_t), sizeof(length));
+        // ipc_reader_next() rejected anything larger before we got here
+        assert(length <= IPC_MAX_FRAME - IPC_HEADER_SIZE);
+        needed = IPC_HEADER_SIZE + length;
+    }
+
+    if (needed > reader->cap) {
+        char *buf = malloc(needed);
+        if (buf == NULL) {
+            *avail = 0;
+            return NULL;
+        }
+
+        memcpy(buf, reader->buf, pending);
+        if (reader->buf != reader->inline_buf)
+            free(reader->buf);
+
+        reader->buf = buf;
+        reader->cap = needed;
+    }
+
+    *avail = reader->cap - reader->end;
+    return reader->buf + reader->end;
+}
+
+void ipc_reader_commit(struct ipc_reader *reader, size_t count) {
+    assert(reader->end + count <= reader->cap);
+    reader->end += count;
+}
+
+enum ipc_status ipc_reader_next(struct ipc_reader *reader, struct ipc_frame *frame) {
+    size_t pending = reader->end - reader->start;
+
+    if (pending < IPC_HEADER_SIZE)
+        return IPC_AGAIN;
+
+    const char *data = reader->buf + reader->start;
+
+    // Wire format is little-endian, same as every target we build for
+    memcpy(&frame->opcode, data, sizeof(frame->opcode));
+    memcpy(&frame->length, data + sizeof(frame->opcode), sizeof(frame->length));
+
+    if (frame->length > IPC_MAX_FRAME - IPC_HEADER_SIZE)
+        return IPC_INVALID;
+
+    if (pending < IPC_FRAME_SIZE(frame))
+        return IPC_AGAIN;
+
+    frame->data = data;
+    reader->start += IPC_FRAME_SIZE(frame);
+    return IPC_OK;
+}
+
+// Forgets everything not handed out yet, frames already returned stay valid
+void ipc_reader_drop(struct ipc_reader *reader) {
+    reader->end = reader->start;
+}
+
+#ifdef SCAN_X86
+// Block by block up to the first quote or bracket, or quote or backslash when inside a string, stopping short of
+// the tail that doesn't fill a block
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, const char *end, int in_string) {
+    const __m256i quote = _mm256_set1_epi8('"'), backslash = _mm256_set1_epi8('\\');
+    const __m256i open = _mm256_set1_epi8('{'), close = _mm256_set1_epi8('}');
+    const __m256i open_array = _mm256_set1_epi8('['), close_array = _mm256_set1_epi8(']');
+
+    for (; end - p >= 32; p += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)p);
+        __m256i hits = _mm256_cmpeq_epi8(block, quote);
+
+        if (in_string) {
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, backslash));
+        } else {
+            hits = _mm256_or_si256(hits, _mm256_or_si256(_mm256_cmpeq_epi8(block, open), _mm256_cmpeq_epi8(block, close)));
+            hits = _mm256_or_si256(hits, _mm256_or_si256(_mm256_cmpeq_epi8(block, open_array),
+                                                         _mm256_cmpeq_epi8(block, close_array)));
+        }
+
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+
+    return p;
+}
+
+__attribute__((target("sse2")))
+static const char *scan_sse2(const char *p, const char *end, int in_string) {
+    const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+    const __m128i open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}');
+    const __m128i open_array = _mm_set1_epi8('['), close_array = _mm_set1_epi8(']');
+
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+        __m128i hits = _mm_cmpeq_epi8(block, quote);
+
+        if (in_string) {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, backslash));
+        } else {
+            hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(block, open), _mm_cmpeq_epi8(block, close)));
+            hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(block, open_array), _mm_cmpeq_epi8(block, close_array)));
+        }
+
+        unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+
+    return p;
+}
+#endif
+
+// CPUs without SIMD go byte by byte from the start
+static const char *scan_none(const char *p, const char *end, int in_string) {
+    (void)end;
+    (void)in_string;
+    return p;
+}
+
+static const char *scan_pick(const char *p, const char *end, int in_string);
+static const char *(*scan_blocks)(const char *p, const char *end, int in_string) = scan_pick;
+
+// Settles scan_blocks on the widest scan the CPU runs, so one build serves every CPU of its architecture
+// i686 builds don't assume SSE2 at compile time, so this is how they get it at all
+static const char *scan_pick(const char *p, const char *end, int in_string) {
+    const char *(*scan)(const char *p, const char *end, int in_string) = scan_none;
+
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan = scan_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        scan = scan_sse2;
+#endif
+
+    // Threads that race here all pick the same
+    __atomic_store_n(&scan_blocks, scan, __ATOMIC_RELAXED);
+    return scan(p, end, in_string);
+}
+
+// First quote or bracket at or after p, or first quote or backslash when inside a string; end if there's none
+// Whole blocks are tested at once where the CPU has SIMD, the tail byte by byte
+static const char *scan_next(const char *p, const char *end, int in_string) {
+    p = __atomic_load_n(&scan_blocks, __ATOMIC_RELAXED)(p, end, in_string);
+
+    for (; p < end; p++) {
+        if (*p == '"') return p;
+        if (in_string ? *p == '\\' : (*p == '{' || *p == '}' || *p == '[' || *p == ']')) return p;
+    }
+
+    return end;
+}
+
+// Closing quote of the string starting at p, end if it's cut short
+static const char *string_end(const char *p, const char *end) {
+    while ((p = scan_next(p, end, 1)) < end) {
+        if (*p == '"') return p;
+        if (end - p < 2) return end;
+        p += 2;
+    }
+
+    return end;
+}
+
+static const char *skip_space(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    return p;
+}
+
+static const char *skip_space_back(const char *start, const char *p) {
+    while (p > start && (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\r' || p[-1] == '\n')) p--;
+    return p;
+}
+
+// Opening quote of the string whose closing quote is at p, NULL if there's none
+// A string can't hold an unescaped quote, so the first one back that isn't escaped is it
+static const char *string_start(const char *start, const char *p) {
+    while (--p >= start) {
+        if (*p != '"') continue;
+
+        const char *q = p;
+        while (q > start && q[-1] == '\\') q--;
+        if ((p - q) % 2 == 0) return p;
+    }
+
+    return NULL;
+}
+
+#define KEY_IS(key, key_len, str)   ((key_len) == sizeof(str) - 1 && memcmp((key), (str), sizeof(str) - 1) == 0)
+#define SEEN_CMD                    1
+#define SEEN_EVT                    2
+#define SEEN_NONCE                  4
+#define SEEN_ALL                    7
+#define TAIL_MEMBERS                3
+
+// Records the first value of cmd, evt or nonce, returns the bit of the key or 0 for any other
+static unsigned classify_key(struct ipc_class *cls, unsigned seen, const char *key, size_t key_len,
+                             const char *value, const char *value_end) {
+    struct ipc_span *span;
+    unsigned bit;
+
+    if (KEY_IS(key, key_len, "cmd")) {
+        span = &cls->cmd;
+        bit = SEEN_CMD;
+    } else if (KEY_IS(key, key_len, "evt")) {
+        span = &cls->evt;
+        bit = SEEN_EVT;
+    } else if (KEY_IS(key, key_len, "nonce")) {
+        span = &cls->nonce;
+        bit = SEEN_NONCE;
+    } else {
+        return 0;
+    }
+
+    // A null evt like every reply has is seen all the same
+    if (!(seen & bit) && value != NULL) {
+        span->data = value;
+        span->length = (uint32_t)(value_end - value);
+    }
+
+    return bit;
+}
+
+// Reads the last top-level members back from the closing brace, as long as their values are strings or null
+// Discord's libraries put nonce, and Discord evt, after the args or data that make up most of a frame, so
+// what's found here spares the forward scan from reading through those. Returns the bits of the keys found.
+static unsigned classify_tail(struct ipc_class *cls, const char *start, const char *end) {
+    const char *p = skip_space_back(start, end);
+    unsigned seen = 0;
+
+    if (p == start || *--p != '}') return 0;
+
+    for (int i = 0; i < TAIL_MEMBERS; i++) {
+        const char *value_end = skip_space_back(start, p), *value = NULL, *member;
+
+        if (value_end - start >= 4 && memcmp(value_end - 4, "null", 4) == 0) {
+            member = value_end - 4;
+        } else if (value_end > start && value_end[-1] == '"' && (member = string_start(start, value_end - 1)) != NULL) {
+            value = member + 1;
+            value_end--;
+        } else {
+            break;
+        }
+
+        const char *key_end = skip_space_back(start, member);
+        if (key_end == start || key_end[-1] != ':') break;
+
+        key_end = skip_space_back(start, key_end - 1);
+        const char *key = key_end > start && key_end[-1] == '"' ? string_start(start, key_end - 1) : NULL;
+        if (key == NULL) break;
+
+        // Anything but a comma or the opening brace means this wasn't a member after all
+        p = skip_space_back(start, key);
+        if (p == start || (p[-1] != ',' && p[-1] != '{')) break;
+
+        seen |= classify_key(cls, seen, key + 1, (size_t)(key_end - 1 - (key + 1)), value, value_end);
+        if (*--p == '{') break;
+    }
+
+    return seen;
+}
+
+// Pulls cmd, evt and nonce out of a FRAME without parsing it: the members at the end are read back first, then
+// SIMD skips from one quote or bracket to the next, and only keys at the top level are looked at. Stops once all
+// three were seen, or once cmd says the frame isn't an event and evt doesn't matter.
+void ipc_frame_classify(const struct ipc_frame *frame, struct ipc_class *cls) {
+    const char *p = IPC_PAYLOAD(frame);
+    const char *end = p + frame->length;
+    int depth = 0;
+
+    memset(cls, 0, sizeof(*cls));
+    if (frame->opcode != IPC_FRAME) return;
+
+    unsigned seen = classify_tail(cls, p, end);
+
+    while (seen != SEEN_ALL && (p = scan_next(p, end, 0)) < end) {
+        if (*p != '"') {
+            if (*p == '{' || *p == '[') {
+                depth++;
+            } else if (--depth <= 0) {
+                break;
+            }
+
+            p++;
+            continue;
+        }
+
+        const char *key = p + 1;
+        if ((p = string_end(key, end)) == end) break;
+        size_t key_len = (size_t)(p - key);
+
+        // Keys are followed by a colon, string values in arrays aren't
+        p = skip_space(p + 1, end);
+        if (depth != 1 || p == end || *p != ':') continue;
+
+        // Any other value is numbers and literals the scan skips over, or brackets it steps into
+        p = skip_space(p + 1, end);
+        if (p == end || *p != '"') {
+            seen |= classify_key(cls, seen, key, key_len, NULL, NULL);
+            continue;
+        }
+
+        const char *value = p + 1;
+        if ((p = string_end(value, end)) == end) break;
+
+        seen |= classify_key(cls, seen, key, key_len, value, p);
+        p++;
+
+        // Only events are told apart by evt
+        if (cls->cmd.data != NULL && !ipc_span_is(&cls->cmd, "DISPATCH"))
+            seen |= SEEN_EVT;
+    }
+
+    if (cls->cmd.data == NULL)
+        cls->command = IPC_CMD_NONE;
+    else if (ipc_span_is(&cls->cmd, "DISPATCH"))
+        cls->command = IPC_CMD_DISPATCH;
+    else if (ipc_span_is(&cls->cmd, "SET_ACTIVITY"))
+        cls->command = IPC_CMD_SET_ACTIVITY;
+    else
+        cls->command = IPC_CMD_OTHER;
+}
+
+// Compares as is, escapes included, which the names Discord uses never have
+int ipc_span_is(const struct ipc_span *span, const char *str) {
+    size_t length = strlen(str);
+    return span->data != NULL && span->length == length && memcmp(span->data, str, length) == 0;
+}
+
+// First character of the value of the first "key" in the payload at any depth, NULL without one
+// A plain search, meant for the few keys whose name never shows up as a string value
+const char *ipc_frame_value(const struct ipc_frame *frame, const char *key) {
+    size_t key_len = strlen(key);
+    const char *p = IPC_PAYLOAD(frame);
+    const char *end = p + frame->length;
+
+    for (; (size_t)(end - p) >= key_len + 2; p++) {
+        if (p[0] != '"' || memcmp(p + 1, key, key_len) != 0 || p[key_len + 1] != '"') continue;
+
+        p = skip_space(p + key_len + 2, end);
+        if (p == end || *p != ':') return NULL;
+        p = skip_space(p + 1, end);
+        return p < end ? p : NULL;
+    }
+
+    return NULL;
+}
+
+// The "pid" number of a command's args, -1 without one
+long ipc_frame_pid(const struct ipc_frame *frame) {
+    const char *p = ipc_frame_value(frame, "pid");
+    const char *end = IPC_PAYLOAD(frame) + frame->length;
+    long pid = -1;
+
+    for (; p != NULL && p < end && *p >= '0' && *p <= '9' && pid < 0x7FFFFFFF; p++)
+        pid = (pid < 0 ? 0 : pid * 10) + (*p - '0');
+    return pid;
+}
+
+static uint64_t fnv1a(uint64_t hash, const char *p, const char *end) {
+    while (p < end)
+        hash = (hash ^ (unsigned char)*p++) * 0x100000001B3ULL;
+    return hash;
+}
+
+// FNV-1a over the payload with the nonce's value left out, so a resent state hashes the same
+uint64_t ipc_frame_hash(const struct ipc_frame *frame, const struct ipc_class *cls) {
+    const char *payload = IPC_PAYLOAD(frame);
+    const char *end = payload + frame->length;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    if (cls->nonce.data == NULL)
+        return fnv1a(hash, payload, end);
+
+    hash = fnv1a(hash, payload, cls->nonce.data);
+    return fnv1a(hash, cls->nonce.data + cls->nonce.length, end);
+}
+
+const char *ipc_opcode_name(uint32_t opcode) {
+    switch (opcode) {
+        case IPC_HANDSHAKE: return "HANDSHAKE";
+        case IPC_FRAME:     return "FRAME";
+        case IPC_CLOSE:     return "CLOSE";
+        case IPC_PING:      return "PING";
+        case IPC_PONG:      return "PONG";
+        default:            return "UNKNOWN";
+    }
+}
@@ -19,39 +19,243 @@
     the source code in the root of the project.
  ====================================================================== */
 
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+    #include "bridge/utils/windows.h"
+#endif
+
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
 
 #include "bridge/log.h"
-#include "bridge/utils/windows.h"
-
-void bridge_log(enum log_level log_level, const char *fmt, ...) {
-    if (g_log_level < log_level) return;
 
+static const char *level_tag(enum log_level log_level) {
     switch (log_level) {
-        case LL_ERROR:
-            printf("[ERROR]   ");
-            break;
-        case LL_WARNING:
-            printf("[WARNING] ");
-            break;            
-        case LL_INFO:
-            printf("[INFO]    ");
-            break;
-        case LL_DEBUG:
-            printf("[DEBUG]   ");
-            break;
-        case LL_TRACE:
-            printf("[TRACE]   ");
-            break;
+        case LL_ERROR:      return "[ERROR]   ";
+        case LL_WARNING:    return "[WARNING] ";
+        case LL_INFO:       return "[INFO]    ";
+        case LL_DEBUG:      return "[DEBUG]   ";
+        case LL_TRACE:      return "[TRACE]   ";
         default:
             assert(0 && "Invalid log level");
+            return "";
     }
+}
 
-    va_list args;
+static void log_sync(enum log_level log_level, const char *fmt, va_list args) {
+    printf("%s", level_tag(log_level));
+    vprintf(fmt, args);
+}
+
+#ifdef _WIN32
+
+#define LOG_SLOTS       256     // Power of two, LOG_SLOTS * LOG_RECORD_SIZE caps the memory used
+#define LOG_RECORD_SIZE 512     // Longer messages take as many consecutive slots as they need
+#define LOG_IDLE_WAIT   100     // ms, upper bound on how stale a missed wakeup can leave output
+
+// Bounded multi-producer queue after Dmitry Vyukov's, with the flusher as its only consumer
+// A slot is free for position pos when seq == pos, and holds a record for pos when seq == pos + 1
+struct log_record {
+    size_t volatile     seq;
+    enum log_level      level;
+    int                 length;
+    BOOL                fContinued;     // Rest of the record in the slot before, printed without a tag
+    char                text[LOG_RECORD_SIZE];
+};
+
+static struct log_record ring[LOG_SLOTS];
+static size_t volatile enqueue_pos;
+static size_t dequeue_pos;
+static LONG volatile dropped;
+
+static HANDLE hFlusher;                 // Read by every logging thread, NULL again once the flusher is gone
+static HANDLE hWake;
+static LONG volatile flusher_idle;
+static LONG volatile stopping;
+
+static BOOL log_drain(void) {
+    BOOL fAny = FALSE;
+
+    while (TRUE) {
+        struct log_record *record = &ring[dequeue_pos & (LOG_SLOTS - 1)];
+
+        if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != dequeue_pos + 1)
+            break;
+
+        if (!record->fContinued)
+            fputs(level_tag(record->level), stdout);
+        fwrite(record->text, 1, record->length, stdout);
+
+        // Hand the slot back to producers one lap ahead
+        __atomic_store_n(&record->seq, dequeue_pos + LOG_SLOTS, __ATOMIC_RELEASE);
+        dequeue_pos++;
+        fAny = TRUE;
+    }
+
+    LONG lost = InterlockedExchange(&dropped, 0);
+    if (lost > 0) {
+        printf("%s%ld log records dropped, logger could not keep up.\n", level_tag(LL_WARNING), (long)lost);
+        fAny = TRUE;
+    }
+
+    // One flush per batch instead of one per record
+    if (fAny) fflush(stdout);
+    return fAny;
+}
+
+static DWORD WINAPI flusher_thread(LPVOID lpUnused) {
+    // Just to match function signature
+    (VOID)lpUnused;
+
+    while (TRUE) {
+        if (log_drain()) continue;
+
+        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) break;
+
+        // Producers only pay for SetEvent while we are about to sleep, check again after announcing it
+        __atomic_store_n(&flusher_idle, TRUE, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!log_drain())
+            (VOID)WaitForSingleObject(hWake, LOG_IDLE_WAIT);
+        __atomic_store_n(&flusher_idle, FALSE, __ATOMIC_SEQ_CST);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static void bridge_log_shutdown(void) {
+    HANDLE hThread = hFlusher;
+
+    __atomic_store_n(&stopping, TRUE, __ATOMIC_RELEASE);
+    SetEvent(hWake);
+    (VOID)WaitForSingleObject(hThread, INFINITE);
+
+    // Other threads log synchronously from here on, and this thread is the consumer now
+    __atomic_store_n(&hFlusher, NULL, __ATOMIC_SEQ_CST);
+    CloseHandle(hThread);
+
+    // Whatever was queued by threads that still saw the flusher, some of it maybe still being written
+    for (int spins = 0; spins < LOG_SLOTS && dequeue_pos != __atomic_load_n(&enqueue_pos, __ATOMIC_SEQ_CST); spins++)
+        if (!log_drain())
+            (VOID)SwitchToThread();
+    (VOID)log_drain();
+}
 
+void bridge_log_init(void) {
+    for (size_t i = 0; i < LOG_SLOTS; i++)
+        ring[i].seq = i;
+
+    // https://learn.microsoft.com/en-us/windows/win32/api/synchapi/nf-synchapi-createeventa
+    if ((hWake = CreateEventA(NULL, FALSE, FALSE, NULL)) == NULL)
+        goto sync;
+
+    // https://learn.microsoft.com/en-us/windows/win32/api/processthreadsapi/nf-processthreadsapi-createthread
+    if ((hFlusher = CreateThread(NULL, 0, flusher_thread, NULL, 0, NULL)) == NULL) {
+        CloseHandle(hWake);
+        goto sync;
+    }
+
+    // Whatever is still queued gets written out on the way out of main()
+    atexit(bridge_log_shutdown);
+    return;
+
+sync: {
+        LPTSTR lpBuffer = GetLastErrorAsString();
+        bridge_log(LL_WARNING, "Failed to start log flusher, logging synchronously: %s", lpBuffer);
+        LocalFree(lpBuffer);
+    }
+}
+
+static void log_async(enum log_level log_level, const char *fmt, va_list args) {
+    char buf[LOG_RECORD_SIZE], *text = buf;
+    va_list copy;
+
+    va_copy(copy, args);
+    int length = vsnprintf(buf, sizeof(buf), fmt, args);
+
+    // Formatted again in full, e.g. a DEBUG frame payload of up to IPC_MAX_FRAME
+    if (length >= (int)sizeof(buf) && (text = malloc((size_t)length + 1)) != NULL)
+        (VOID)vsnprintf(text, (size_t)length + 1, fmt, copy);
+    va_end(copy);
+
+    if (length < 0) length = 0;
+    size_t count = length > 0 ? ((size_t)length + LOG_RECORD_SIZE - 1) / LOG_RECORD_SIZE : 1;
+
+    if (text == NULL || count > LOG_SLOTS) {
+        (VOID)InterlockedIncrement(&dropped);
+        goto done;
+    }
+
+    size_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+
+    // The flusher frees slots in order, so the last one being free for its lap means all of them are
+    while (TRUE) {
+        size_t last = pos + count - 1;
+        size_t seq = __atomic_load_n(&ring[last & (LOG_SLOTS - 1)].seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)last;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + count, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // Full, dropping beats stalling the relay
+            (VOID)InterlockedIncrement(&dropped);
+            goto done;
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        struct log_record *record = &ring[(pos + i) & (LOG_SLOTS - 1)];
+        int off = (int)i * LOG_RECORD_SIZE;
+
+        record->level = log_level;
+        record->fContinued = i > 0;
+        record->length = length - off < LOG_RECORD_SIZE ? length - off : LOG_RECORD_SIZE;
+        memcpy(record->text, text + off, record->length);
+
+        __atomic_store_n(&record->seq, pos + i + 1, __ATOMIC_RELEASE);
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&flusher_idle, __ATOMIC_SEQ_CST) && InterlockedExchange(&flusher_idle, FALSE))
+        SetEvent(hWake);
+
+done:
+    if (text != buf)
+        free(text);
+}
+
+#else
+
+// Native builds have no flusher, output goes straight to stdout
+void bridge_log_init(void) {
+}
+
+#endif
+
+unsigned g_log_sample = 1;
+unsigned g_log_sampled;
+
+// Only reached through bridge_log(), which has checked the level already
+void bridge_log_write(enum log_level log_level, const char *fmt, ...) {
+    va_list args;
     va_start(args, fmt);
-    vprintf(fmt, args);
+
+#ifdef _WIN32
+    // Before bridge_log_init() or after shutdown there is nobody to hand records to
+    if (__atomic_load_n(&hFlusher, __ATOMIC_SEQ_CST) != NULL)
+        log_async(log_level, fmt, args);
+    else
+#endif
+        log_sync(log_level, fmt, args);
+
     va_end(args);
-}
\ No newline at end of file
+}
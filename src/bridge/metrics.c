@@ -0,0 +1,196 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+#else
+    #define _POSIX_C_SOURCE 199309L
+    #include <time.h>
+#endif
+
+#include <string.h>
+
+#include "bridge/metrics.h"
+#include "bridge/ipc.h"
+#include "bridge/log.h"
+
+#define SUB_BITS    2                               // 4 buckets per power of two, ~19% worst-case error
+#define SUB_COUNT   (1 << SUB_BITS)
+#define BUCKETS     (64 * SUB_COUNT)
+#define OPCODES     (IPC_PONG + 2)                  // Known opcodes plus one for anything else
+
+struct histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[BUCKETS];
+};
+
+// Only ever touched from the event loop, so plain counters do
+static struct histogram histograms[DIR_COUNT][OPCODES];
+static struct histogram startup;        // From an RPC client connecting to its first frame reaching Discord
+static uint64_t ticks_per_sec;
+
+static const char *dir_names[DIR_COUNT] = {
+    "RPC client -> Discord",
+    "Discord -> RPC client"
+};
+
+static unsigned bucket_of(uint64_t ns) {
+    if (ns < SUB_COUNT) return (unsigned)ns;
+
+    unsigned msb = 63 - __builtin_clzll(ns);
+    unsigned sub = (unsigned)(ns >> (msb - SUB_BITS)) & (SUB_COUNT - 1);
+    return (msb - SUB_BITS + 1) * SUB_COUNT + sub;
+}
+
+// Reports the top of a bucket, so percentiles err on the slow side
+static uint64_t bucket_upper(unsigned bucket) {
+    if (bucket < SUB_COUNT) return bucket;
+
+    unsigned msb = bucket / SUB_COUNT + SUB_BITS - 1;
+    uint64_t width = 1ULL << (msb - SUB_BITS);
+    return (SUB_COUNT + bucket % SUB_COUNT) * width + width - 1;
+}
+
+static uint64_t percentile(const struct histogram *histogram, unsigned permille) {
+    uint64_t target = (histogram->count * permille + 999) / 1000;
+    uint64_t seen = 0;
+
+    for (unsigned i = 0; i < BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= target)
+            return bucket_upper(i) < histogram->max ? bucket_upper(i) : histogram->max;
+    }
+
+    return histogram->max;
+}
+
+#ifdef _WIN32
+
+void metrics_init(void) {
+    LARGE_INTEGER frequency;
+
+    // https://learn.microsoft.com/en-us/windows/win32/api/profileapi/nf-profileapi-queryperformancefrequency
+    // Never fails on anything Wine runs on
+    (VOID)QueryPerformanceFrequency(&frequency);
+    ticks_per_sec = frequency.QuadPart;
+}
+
+uint64_t metrics_now(void) {
+    LARGE_INTEGER counter;
+
+    // https://learn.microsoft.com/en-us/windows/win32/api/profileapi/nf-profileapi-queryperformancecounter
+    (VOID)QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+#else
+
+// Native builds tick in nanoseconds
+void metrics_init(void) {
+    ticks_per_sec = 1000000000ULL;
+}
+
+uint64_t metrics_now(void) {
+    struct timespec now;
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+#endif
+
+// Coarse clock for timeouts, same source as metrics_now()
+uint64_t metrics_ms(void) {
+    return metrics_now() / (ticks_per_sec / 1000);
+}
+
+void metrics_track_reset(struct frame_track *track) {
+    track->first = 0;
+    track->count = 0;
+    track->done = 0;
+}
+
+int metrics_track(struct frame_track *track, uint32_t opcode, size_t size, uint64_t stamp) {
+    if (track->count == METRICS_TRACKED) return 0;
+
+    int slot = (track->first + track->count) % METRICS_TRACKED;
+    track->frames[slot].opcode = opcode;
+    track->frames[slot].size = (uint32_t)size;
+    track->frames[slot].stamp = stamp;
+    track->count++;
+    return 1;
+}
+
+// Duration in metrics_now() ticks to nanoseconds
+uint64_t metrics_ns(uint64_t ticks) {
+    // Split to keep ticks * 1e9 from overflowing on long uptimes
+    return ticks / ticks_per_sec * 1000000000ULL + ticks % ticks_per_sec * 1000000000ULL / ticks_per_sec;
+}
+
+static void histogram_add(struct histogram *histogram, uint64_t ns) {
+    histogram->count++;
+    histogram->buckets[bucket_of(ns)]++;
+    if (ns > histogram->max) histogram->max = ns;
+}
+
+void metrics_sample(enum metrics_dir dir, uint32_t opcode, uint64_t stamp, uint64_t now) {
+    histogram_add(&histograms[dir][opcode <= IPC_PONG ? opcode : OPCODES - 1], metrics_ns(now - stamp));
+}
+
+uint64_t metrics_startup(uint64_t stamp, uint64_t now) {
+    uint64_t ns = metrics_ns(now - stamp);
+    histogram_add(&startup, ns);
+    return ns;
+}
+
+void metrics_written(struct frame_track *track, enum metrics_dir dir, size_t bytes) {
+    uint64_t now = metrics_now();
+
+    track->done += bytes;
+
+    while (track->count > 0 && track->done >= track->frames[track->first].size) {
+        metrics_sample(dir, track->frames[track->first].opcode, track->frames[track->first].stamp, now);
+
+        track->done -= track->frames[track->first].size;
+        track->first = (track->first + 1) % METRICS_TRACKED;
+        track->count--;
+    }
+}
+
+void metrics_dump(void) {
+    if (startup.count > 0) {
+        bridge_log(LL_INFO, "Time to first frame: %lu clients, p50 %.1f us, max %.1f us.\n",
+                   (unsigned long)startup.count, percentile(&startup, 500) / 1000.0, startup.max / 1000.0);
+    }
+
+    for (int dir = 0; dir < DIR_COUNT; dir++) {
+        for (int opcode = 0; opcode < OPCODES; opcode++) {
+            const struct histogram *histogram = &histograms[dir][opcode];
+            if (histogram->count == 0) continue;
+
+            bridge_log(LL_INFO, "Latency %s, %s: %lu frames, p50 %.1f us, p99 %.1f us, max %.1f us.\n",
+                       dir_names[dir], ipc_opcode_name(opcode), (unsigned long)histogram->count,
+                       percentile(histogram, 500) / 1000.0, percentile(histogram, 990) / 1000.0,
+                       histogram->max / 1000.0);
+        }
+    }
+}
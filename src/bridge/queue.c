@@ -0,0 +1,128 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bridge/queue.h"
+
+#define SLOT(pos)   ((pos) & (QUEUE_SLOTS - 1))
+
+int queue_init(struct frame_queue *queue) {
+    memset(queue, 0, sizeof(*queue));
+    queue->slab = malloc((size_t)QUEUE_SLOTS * QUEUE_CELL);
+    return queue->slab != NULL ? 0 : -1;
+}
+
+void queue_free(struct frame_queue *queue) {
+    queue_clear(queue);
+    free(queue->slab);
+    queue->slab = NULL;
+}
+
+// Producer side, returns -1 when the queue is full or an oversized frame can't be allocated
+int queue_push(struct frame_queue *queue, const char *data, size_t size, uint32_t opcode, uint64_t stamp) {
+    size_t tail = queue->tail;
+
+    if (tail - queue->head == QUEUE_SLOTS)
+        return -1;
+
+    struct queue_cell *cell = &queue->cells[SLOT(tail)];
+    char *buf = size <= QUEUE_CELL ? queue->slab + SLOT(tail) * QUEUE_CELL : malloc(size);
+    if (buf == NULL) return -1;
+
+    memcpy(buf, data, size);
+    cell->data = buf;
+    cell->size = (uint32_t)size;
+    cell->opcode = opcode;
+    cell->stamp = stamp;
+
+    queue->tail = tail + 1;
+    return 0;
+}
+
+size_t queue_count(const struct frame_queue *queue) {
+    return queue->tail - queue->head;
+}
+
+int queue_full(const struct frame_queue *queue) {
+    return queue_count(queue) == QUEUE_SLOTS;
+}
+
+// Consumer side, index counts from the head and has to be below queue_count()
+struct queue_cell *queue_at(struct frame_queue *queue, size_t index) {
+    return &queue->cells[SLOT(queue->head + index)];
+}
+
+// Consumer side, hands the head cell back to the producer
+void queue_pop(struct frame_queue *queue) {
+    struct queue_cell *cell = &queue->cells[SLOT(queue->head)];
+
+    if (cell->data != queue->slab + SLOT(queue->head) * QUEUE_CELL)
+        free(cell->data);
+
+    queue->off = 0;
+    queue->head++;
+}
+
+// Consumer side
+void queue_clear(struct frame_queue *queue) {
+    while (queue_count(queue) > 0)
+        queue_pop(queue);
+}
+
+// Both sides: keeps the frames keep() accepts, in order, and starts the head one over from its first byte
+// Walks from the tail so every kept frame moves into a slot already let go of.
+void queue_retain(struct frame_queue *queue, int (*keep)(const struct queue_cell *cell)) {
+    size_t pos = queue->tail, to = queue->tail;
+
+    while (pos != queue->head) {
+        struct queue_cell *cell = &queue->cells[SLOT(--pos)];
+        int inline_data = cell->data == queue->slab + SLOT(pos) * QUEUE_CELL;
+
+        if (!keep(cell)) {
+            if (!inline_data) free(cell->data);
+            continue;
+        }
+
+        struct queue_cell *dest = &queue->cells[SLOT(--to)];
+        if (dest == cell) continue;
+
+        *dest = *cell;
+        if (inline_data) {
+            dest->data = queue->slab + SLOT(to) * QUEUE_CELL;
+            memcpy(dest->data, cell->data, cell->size);
+        }
+    }
+
+    queue->off = 0;
+    queue->head = to;
+}
+
+// Not yet written, for gauges
+size_t queue_bytes(const struct frame_queue *queue) {
+    size_t bytes = 0;
+
+    for (size_t pos = queue->head; pos != queue->tail; pos++)
+        bytes += queue->cells[SLOT(pos)].size;
+
+    return bytes - (queue->head != queue->tail ? queue->off : 0);
+}
@@ -0,0 +1,1039 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// Frame relaying between an RPC client and Discord, independent of how either side is reached
+// Everything here runs on the backend's event loop, see struct transport for what it provides
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "bridge/relay.h"
+#include "bridge/utils/linux.h"
+#include "bridge/stats.h"
+#include "bridge/trace.h"
+#include "bridge/log.h"
+
+static int relay_pipe_read(struct relay *relay);
+static void relay_wait(struct relay *relay);
+static void relay_detach(struct relay *relay);
+static void relay_end(struct relay *relay);
+static int relay_resend(const struct queue_cell *cell);
+static void relay_drop_session(struct relay *relay);
+static int relay_unpark(struct relay *relay, const struct ipc_frame *frame);
+static void relay_remember(struct relay *relay, const struct ipc_frame *frame, const struct ipc_class *cls);
+static uint64_t activity_due(const struct relay *relay);
+static uint64_t activity_kept_hash(const struct relay *relay);
+static void activity_record(struct relay *relay, uint64_t hash);
+static int activity_admit(struct relay *relay, const struct ipc_frame *frame, const struct ipc_class *cls);
+static void activity_flush(struct relay *relay);
+static int activity_nonce(const struct relay *relay, char *nonce, size_t size);
+static size_t activity_clear_frame(const struct relay *relay, char *buf, size_t size, const char *nonce);
+static int activity_clear(struct relay *relay);
+static void activity_hush(struct relay *relay, const struct ipc_span *nonce);
+static int relay_ping(struct relay *relay, const struct ipc_frame *frame);
+static uint64_t relay_keepalive(struct relay *relay, uint64_t now);
+static void pipe_to_queue(struct relay *relay);
+static void queue_to_sock(struct relay *relay);
+static void sock_to_queue(struct relay *relay);
+static void queue_to_pipe(struct relay *relay);
+
+void relay_init(struct relay *relay, const struct transport *transport, void *ctx, int id) {
+    memset(relay, 0, sizeof(*relay));
+    relay->transport = transport;
+    relay->ctx = ctx;
+    relay->id = id;
+
+    ipc_reader_init(&relay->from_pipe);
+    ipc_reader_init(&relay->from_sock);
+    metrics_track_reset(&relay->to_pipe_track);
+}
+
+// The backend cancels its pipe operations first, buffers handed to them are freed here
+void relay_free(struct relay *relay) {
+    if (relay->active)
+        trace_gone(relay->id);
+    relay->active = 0;
+
+    ipc_reader_free(&relay->from_pipe);
+    ipc_reader_free(&relay->from_sock);
+    queue_free(&relay->to_sock);
+    queue_free(&relay->to_pipe);
+    free(relay->run);
+    free(relay->preamble);
+    free(relay->handshake);
+    free(relay->activity);
+    free(relay->ready);
+    relay->preamble = relay->handshake = relay->activity = relay->ready = relay->run = NULL;
+    relay->run_size = 0;
+}
+
+// The RPC client is connected, reads start either way and frames queue up until Discord shows up
+void relay_start(struct relay *relay) {
+    relay->active = 1;
+    relay->start_stamp = metrics_now();
+
+    // The only allocations for either direction's frames, however long the session; recycled relays kept theirs
+    if ((relay->to_sock.slab == NULL && queue_init(&relay->to_sock) < 0) ||
+        (relay->to_pipe.slab == NULL && queue_init(&relay->to_pipe) < 0)) {
+        bridge_log(LL_ERROR, "Failed to allocate frame queues for client %d.\n", relay->id);
+        relay->transport->close(relay, 1);
+        return;
+    }
+
+    // A parked session is already attached, the client's handshake decides whether it's kept
+    if (!relay->parked && !relay->on_demand && relay_attach(relay) < 0)
+        relay_wait(relay);
+
+    if (relay->active && !relay->read_pending)
+        (void)relay_pipe_read(relay);
+}
+
+// Returns the transport's error when Discord can't be reached yet, leaving the relay as it was
+int relay_attach(struct relay *relay) {
+    // Ended, relay_end() closes the client once the pipe took the rest
+    if (relay->closed) return 0;
+
+    int error = relay->transport->sock_open(relay);
+
+    // Under way, the backend calls relay_attach() again once it has the answer
+    if (error == -LINUX_EINPROGRESS) return 0;
+
+    // Retrying wouldn't help
+    if (error == -LINUX_EIO) {
+        relay->transport->close(relay, 1);
+        return 0;
+    }
+
+    if (error < 0) return error;
+
+    relay->attached = 1;
+    relay->sock_at = metrics_ms();
+    relay->keepalive_len = 0;
+    bridge_log(LL_INFO, "Successfully connected client %d to Discord client.\n", relay->id);
+
+    // A new Discord session starts over from the handshake and the latest activity, ahead of whatever queued up
+    // Copied rather than sent in place, relay_remember() may replace the originals before they are sent
+    size_t activity_len = relay->activity != NULL && !relay->muted ? relay->activity_len : 0;
+
+    if (relay->replay) {
+        char *buf = malloc(relay->handshake_len + activity_len);
+
+        if (buf == NULL) {
+            bridge_log(LL_ERROR, "Failed to allocate replay for client %d.\n", relay->id);
+            relay->transport->close(relay, 1);
+            return 0;
+        }
+
+        memcpy(buf, relay->handshake, relay->handshake_len);
+        if (activity_len > 0)
+            memcpy(buf + relay->handshake_len, relay->activity, activity_len);
+
+        free(relay->preamble);
+        relay->preamble = buf;
+        relay->preamble_len = relay->handshake_len + activity_len;
+        relay->preamble_off = 0;
+        relay->swallow = activity_len > 0 ? 2 : 1;
+
+        bridge_log(LL_INFO, "Replaying session of client %d to Discord client.\n", relay->id);
+        STATS_ADD(reconnects, 1);
+    }
+
+    // Rate limits are per session, this one starts with the update just queued
+    memset(relay->activity_sent, 0, sizeof(relay->activity_sent));
+    relay->activity_next = 0;
+    relay->activity_hash = 0;
+
+    // Without a replay, the activity follows the queued handshake and gets answered as usual
+    if (activity_len > 0 && !relay->replay) {
+        relay->activity_pending = 1;
+        activity_flush(relay);
+    } else if (activity_len > 0) {
+        activity_record(relay, activity_kept_hash(relay));
+    } else if (relay->activity != NULL) {
+        relay->activity_pending = 1;    // Muted, relay_mute() sends it
+    }
+
+    // Whatever the client sent while waiting goes out right away
+    queue_to_sock(relay);
+    return 0;
+}
+
+static void relay_wait(struct relay *relay) {
+    bridge_log(LL_WARNING, "Discord is not running, client %d waits for it.\n", relay->id);
+    relay->transport->wait(relay);
+}
+
+// Discord went away, possibly to restart or update; the pipe stays up and frames pile up in the queue
+static void relay_detach(struct relay *relay) {
+    if (relay->closed) {
+        relay_end(relay);
+        return;
+    }
+
+    bridge_log(LL_WARNING, "Lost Discord client for client %d, reconnecting.\n", relay->id);
+
+    relay->transport->sock_close(relay);
+    relay->attached = 0;
+
+    // The replay restores the handshake and the activity, commands the game still waits on go out after it
+    queue_retain(&relay->to_sock, relay_resend);
+    free(relay->preamble);
+    relay->preamble         = NULL;
+    relay->preamble_len     = 0;
+    relay->swallow          = 0;
+    relay->replay           = relay->handshake != NULL;
+    relay->activity_pending = 0;    // Goes out with the replay
+    relay->fence_len        = 0;    // Replies of the old session don't come anymore
+    relay->hush_count       = 0;
+    relay->keepalive_len    = 0;
+
+    // A partial frame from the old session would corrupt the new stream, queued ones still go to the client
+    ipc_reader_drop(&relay->from_sock);
+
+    // Left to the backend rather than retried here, a socket that keeps failing would recurse
+    relay_wait(relay);
+}
+
+// Either side sent CLOSE, for instance Discord over an invalid client_id: the session is over rather than
+// interrupted, so nothing gets replayed and the RPC client is let go the way Discord let go of the bridge, once
+// queue_to_pipe() handed it what Discord sent last
+static void relay_end(struct relay *relay) {
+    bridge_log(LL_INFO, "Discord session of client %d was closed, closing the client too.\n", relay->id);
+
+    if (relay->attached)
+        relay->transport->sock_close(relay);
+
+    relay->attached = 0;
+    relay->replay = 0;
+    ipc_reader_drop(&relay->from_sock);
+
+    queue_to_pipe(relay);
+}
+
+// Whether a frame queued for the old session goes to the new one, see relay_detach()
+static int relay_resend(const struct queue_cell *cell) {
+    if (cell->opcode != IPC_FRAME) return 0;
+
+    struct ipc_frame frame = {IPC_FRAME, cell->size - IPC_HEADER_SIZE, cell->data};
+    struct ipc_class cls;
+
+    ipc_frame_classify(&frame, &cls);
+    return cls.command != IPC_CMD_SET_ACTIVITY;
+}
+
+// The RPC client hung up and the backend keeps the relay for the next one on the same pipe
+// The Discord session stays open for it if the client left nothing behind but its activity: that gets
+// cleared, and whatever Discord still sends the old client is swallowed up to the reply to clearing it.
+// Either way the relay is ready for relay_start() again and keeps its buffers. Returns whether the session was kept.
+int relay_park(struct relay *relay) {
+    int keep = relay->attached && !relay->stateful && !relay->closed && relay->handshake != NULL && relay->ready != NULL &&
+               relay->preamble_len == 0 && relay->swallow == 0 && queue_count(&relay->to_sock) == 0;
+
+    if (keep && relay->activity_hash != 0)
+        keep = activity_clear(relay) == 0;
+
+    trace_gone(relay->id);
+
+    relay->active           = 0;
+    relay->read_pending     = 0;
+    relay->write_pending    = 0;
+    relay->stateful         = 0;
+    relay->sock_out_len     = 0;    // Whatever the old client didn't get yet
+    relay->sock_off         = 0;
+    relay->sock_out_cells   = 0;
+    relay->pong_len         = 0;
+    relay->activity_pending = 0;
+
+    ipc_reader_free(&relay->from_pipe);
+    queue_clear(&relay->to_sock);
+    queue_clear(&relay->to_pipe);
+    metrics_track_reset(&relay->to_pipe_track);
+    free(relay->activity);
+    relay->activity = NULL;
+    relay->activity_len = 0;
+
+    if (!keep) {
+        relay_drop_session(relay);
+        return 0;
+    }
+
+    relay->parked = 1;
+    return 1;
+}
+
+// Forgets the Discord session and what was kept to replay it, the next client starts over
+static void relay_drop_session(struct relay *relay) {
+    if (relay->attached)
+        relay->transport->sock_close(relay);
+
+    free(relay->preamble);
+    free(relay->handshake);
+    free(relay->ready);
+    relay->preamble = relay->handshake = relay->ready = NULL;
+    relay->preamble_len = relay->preamble_off = relay->handshake_len = relay->ready_len = 0;
+
+    relay->attached      = 0;
+    relay->parked        = 0;
+    relay->replay        = 0;
+    relay->closed        = 0;
+    relay->swallow       = 0;
+    relay->fence_len     = 0;
+    relay->hush_count    = 0;
+    relay->activity_hash = 0;
+    relay->keepalive_len = 0;
+
+    ipc_reader_free(&relay->from_sock);
+}
+
+// First frame of the client after relay_park(): the parked session is picked up if the handshake is the one
+// Discord already answered, and dropped for a new one otherwise. Returns whether the frame was dealt with.
+static int relay_unpark(struct relay *relay, const struct ipc_frame *frame) {
+    relay->parked = 0;
+
+    if (frame->opcode != IPC_HANDSHAKE || IPC_FRAME_SIZE(frame) != relay->handshake_len ||
+        memcmp(frame->data, relay->handshake, relay->handshake_len) != 0) {
+        bridge_log(LL_INFO, "Client %d is a different application, dropping the kept Discord session.\n", relay->id);
+        relay_drop_session(relay);
+
+        if (relay_attach(relay) < 0)
+            relay_wait(relay);
+        return 0;
+    }
+
+    bridge_log(LL_INFO, "Client %d resumes the kept Discord session.\n", relay->id);
+    STATS_ADD(resumes, 1);
+    STATS_ADD(frames[STATS_TO_CLIENT], 1);
+    STATS_SET(first_frame_us, metrics_startup(relay->start_stamp, metrics_now()) / 1000);
+    relay->start_stamp = 0;
+
+    // Discord's answer to the same handshake, relay_remember() only replaces it once this write completes
+    (void)metrics_track(&relay->to_pipe_track, IPC_FRAME, relay->ready_len, relay->pipe_stamp);
+    relay->sock_out = relay->ready;
+    relay->sock_out_len = relay->ready_len;
+    relay->sock_off = 0;
+    relay->sock_out_cells = 0;
+
+    if (relay->transport->pipe_write(relay, relay->sock_out, relay->sock_out_len) == 0)
+        relay->write_pending = 1;
+    return 1;
+}
+
+// Keeps what a new Discord session, or the next client on a parked one, needs to pick up where the last left off
+// Frames from Discord only get here for READY
+static void relay_remember(struct relay *relay, const struct ipc_frame *frame, const struct ipc_class *cls) {
+    char **copy;
+    size_t *copy_len;
+
+    if (frame->opcode == IPC_HANDSHAKE) {
+        copy = &relay->handshake;
+        copy_len = &relay->handshake_len;
+    } else if (cls->command == IPC_CMD_DISPATCH) {
+        copy = &relay->ready;
+        copy_len = &relay->ready_len;
+    } else if (cls->command == IPC_CMD_SET_ACTIVITY) {
+        const char *activity = ipc_frame_value(frame, "activity");
+        relay->activity_at = activity != NULL && *activity == '{' ? metrics_ms() : 0;
+        relay->activity_answered = 0;
+        copy = &relay->activity;
+        copy_len = &relay->activity_len;
+    } else {
+        return;
+    }
+
+    char *buf = realloc(*copy, IPC_FRAME_SIZE(frame));
+
+    // Only costs the replay, relaying goes on
+    if (buf == NULL) {
+        bridge_log(LL_WARNING, "Failed to keep %s frame of client %d for replay.\n",
+                   ipc_opcode_name(frame->opcode), relay->id);
+        return;
+    }
+
+    memcpy(buf, frame->data, IPC_FRAME_SIZE(frame));
+    *copy = buf;
+    *copy_len = IPC_FRAME_SIZE(frame);
+}
+
+// When the oldest of the last RELAY_ACTIVITY_BURST updates leaves the window, 0 if there weren't that many
+static uint64_t activity_due(const struct relay *relay) {
+    uint64_t sent = relay->activity_sent[relay->activity_next];
+    return sent != 0 ? sent + RELAY_ACTIVITY_WINDOW : 0;
+}
+
+// Same as what activity_admit() computes for the frame kept in relay->activity
+static uint64_t activity_kept_hash(const struct relay *relay) {
+    struct ipc_frame frame = {IPC_FRAME, (uint32_t)(relay->activity_len - IPC_HEADER_SIZE), relay->activity};
+    struct ipc_class cls;
+
+    ipc_frame_classify(&frame, &cls);
+    return ipc_frame_hash(&frame, &cls);
+}
+
+static void activity_record(struct relay *relay, uint64_t hash) {
+    relay->activity_sent[relay->activity_next] = metrics_ms();
+    relay->activity_next = (relay->activity_next + 1) % RELAY_ACTIVITY_BURST;
+    relay->activity_hash = hash;
+    relay->activity_pending = 0;
+}
+
+// Whether an update read from the pipe goes out right away
+// Otherwise it's either what Discord already shows or it waits in relay->activity for activity_flush()
+// Superseded updates never get a reply, which the RPC libraries don't wait for
+static int activity_admit(struct relay *relay, const struct ipc_frame *frame, const struct ipc_class *cls) {
+    uint64_t hash = ipc_frame_hash(frame, cls);
+
+    if (hash == relay->activity_hash) {
+        bridge_log(LL_DEBUG, "Dropping unchanged activity from client %d.\n", relay->id);
+        STATS_ADD(activity_drops, 1);
+        relay->activity_pending = 0;
+        return 0;
+    }
+
+    if (relay->muted || relay->activity_pending || activity_due(relay) > metrics_ms() || queue_full(&relay->to_sock)) {
+        bridge_log(LL_DEBUG, "Holding back activity from client %d until it can be sent.\n", relay->id);
+        if (relay->activity_pending)
+            STATS_ADD(activity_drops, 1);
+        relay->activity_pending = 1;
+        return 0;
+    }
+
+    activity_record(relay, hash);
+    return 1;
+}
+
+// Queues the held back update once both the rate limit and the queue have room for it
+static void activity_flush(struct relay *relay) {
+    if (!relay->activity_pending || relay->muted || activity_due(relay) > metrics_ms() || queue_full(&relay->to_sock))
+        return;
+
+    // Not timed, it sat in relay->activity for reasons of its own
+    if (queue_push(&relay->to_sock, relay->activity, relay->activity_len, IPC_FRAME, 0) < 0) {
+        bridge_log(LL_WARNING, "Failed to queue activity for client %d, dropping it.\n", relay->id);
+        relay->activity_pending = 0;
+        return;
+    }
+
+    STATS_ADD(frames[STATS_TO_DISCORD], 1);
+    activity_record(relay, activity_kept_hash(relay));
+
+    bridge_log(LL_DEBUG, "Sending held back activity of client %d.\n", relay->id);
+}
+
+// For frames the relay sends on its own, distinct from anything an RPC library would use
+static int activity_nonce(const struct relay *relay, char *nonce, size_t size) {
+    static unsigned sequence;
+    return snprintf(nonce, size, "winerpc-%d-%u", relay->id, ++sequence);
+}
+
+// SET_ACTIVITY without an activity for the pid of the kept update, what Discord does itself when a client's
+// socket closes. Returns its size, header included, or 0 when the kept update has no pid.
+static size_t activity_clear_frame(const struct relay *relay, char *buf, size_t size, const char *nonce) {
+    long pid = -1;
+
+    if (relay->activity != NULL) {
+        struct ipc_frame frame = {IPC_FRAME, (uint32_t)(relay->activity_len - IPC_HEADER_SIZE), relay->activity};
+        pid = ipc_frame_pid(&frame);
+    }
+
+    if (pid < 0) return 0;
+
+    int length = snprintf(buf + IPC_HEADER_SIZE, size - IPC_HEADER_SIZE,
+                          "{\"cmd\":\"SET_ACTIVITY\",\"args\":{\"pid\":%ld},\"nonce\":\"%s\"}", pid, nonce);
+    uint32_t header[2] = {IPC_FRAME, (uint32_t)length};
+    memcpy(buf, header, IPC_HEADER_SIZE);
+    return IPC_HEADER_SIZE + (size_t)length;
+}
+
+// Clears the activity of a client that left
+// Sent right away on an idle socket and fenced by its nonce, see relay_park()
+static int activity_clear(struct relay *relay) {
+    char buf[RELAY_CLEAR_SIZE];
+
+    relay->fence_len = activity_nonce(relay, relay->fence, sizeof(relay->fence));
+
+    // Anything short of the whole frame would tear the stream, the session is dropped then
+    struct relay_iov iov = {buf, activity_clear_frame(relay, buf, sizeof(buf), relay->fence)};
+    if (iov.len == 0 || relay->transport->sock_send(relay, &iov, 1) != (ssize_t)iov.len) {
+        relay->fence_len = 0;
+        return -1;
+    }
+
+    STATS_ADD(frames[STATS_TO_DISCORD], 1);
+    STATS_ADD(bytes[STATS_TO_DISCORD], iov.len);
+    activity_record(relay, 0);
+    return 0;
+}
+
+// For backends that arbitrate between clients sharing Discord, see src/native/hub.c
+// A muted relay holds its updates back in relay->activity and has whatever Discord shows for it cleared, as
+// if the client had. Unmuting sends the held back update within the usual rate limit.
+void relay_mute(struct relay *relay, int muted) {
+    if (relay->muted == muted) return;
+    relay->muted = muted;
+
+    // Detached, relay_attach() sends only what the new state allows
+    if (!relay->attached) return;
+
+    if (muted && relay->activity_hash != 0) {
+        char buf[RELAY_CLEAR_SIZE], nonce[RELAY_NONCE_SIZE];
+
+        // Sent again on unmuting, the client already has its reply unless it sends a newer one meanwhile
+        relay->activity_answered = relay->activity != NULL && relay->activity_hash == activity_kept_hash(relay);
+
+        // Its reply is for no one, the client never asked
+        int nonce_len = activity_nonce(relay, nonce, sizeof(nonce));
+        size_t length = activity_clear_frame(relay, buf, sizeof(buf), nonce);
+
+        if (length == 0 || queue_push(&relay->to_sock, buf, length, IPC_FRAME, 0) < 0) {
+            bridge_log(LL_WARNING, "Failed to clear activity of client %d, it stays up.\n", relay->id);
+        } else {
+            STATS_ADD(frames[STATS_TO_DISCORD], 1);
+            activity_hush(relay, &(struct ipc_span){nonce, (uint32_t)nonce_len});
+            activity_record(relay, 0);
+        }
+    }
+
+    bridge_log(LL_DEBUG, "Activity of client %d %s.\n", relay->id, muted ? "muted" : "unmuted");
+    relay->activity_pending = relay->activity != NULL;
+
+    if (!muted && relay->activity_pending && relay->activity_answered) {
+        struct ipc_frame frame = {IPC_FRAME, (uint32_t)(relay->activity_len - IPC_HEADER_SIZE), relay->activity};
+        struct ipc_class cls;
+
+        ipc_frame_classify(&frame, &cls);
+        activity_hush(relay, &cls.nonce);
+        relay->activity_answered = 0;
+    }
+
+    activity_flush(relay);
+    queue_to_sock(relay);
+}
+
+// Swallows the reply with this nonce, Discord answers in order so it's always the oldest one hushed
+static void activity_hush(struct relay *relay, const struct ipc_span *nonce) {
+    if (nonce->data == NULL || nonce->length >= RELAY_NONCE_SIZE || relay->hush_count == RELAY_HUSH) {
+        bridge_log(LL_DEBUG, "Client %d will see a reply it didn't ask for.\n", relay->id);
+        return;
+    }
+
+    memcpy(relay->hush[relay->hush_count], nonce->data, nonce->length);
+    relay->hush[relay->hush_count][nonce->length] = '\0';
+    relay->hush_count++;
+}
+
+// Runs the relay's timers: sends a held back update whose window opened, and keeps a quiet session alive
+// Returns how many ms until the next one is due
+uint64_t relay_schedule(struct relay *relay, uint64_t now) {
+    if (!relay->active || !relay->attached)
+        return RELAY_NO_DEADLINE;
+
+    uint64_t wait = relay_keepalive(relay, now);
+    if (!relay->attached || !relay->activity_pending || relay->muted)
+        return wait;
+
+    uint64_t due = activity_due(relay);
+
+    // A full queue gets to it by itself once the writer makes room
+    if (due > now)
+        return due - now < wait ? due - now : wait;
+
+    activity_flush(relay);
+    queue_to_sock(relay);
+    return wait;
+}
+
+// Whether the socket writer has anything left, for backends that have to ask for writability
+int relay_sock_pending(const struct relay *relay) {
+    return relay->attached && (relay->preamble_off < relay->preamble_len || queue_count(&relay->to_sock) > 0);
+}
+
+// Whether the socket reader has room for more, for backends whose readiness is level-triggered
+int relay_sock_wanted(const struct relay *relay) {
+    return relay->attached && !queue_full(&relay->to_pipe);
+}
+
+void relay_pipe_read_done(struct relay *relay, size_t count) {
+    relay->read_pending = 0;
+    ipc_reader_commit(&relay->from_pipe, count);
+    relay->pipe_stamp = metrics_now();
+
+    pipe_to_queue(relay);
+}
+
+void relay_pipe_write_done(struct relay *relay, size_t count) {
+    relay->write_pending = 0;
+    relay->sock_off += count;
+    metrics_written(&relay->to_pipe_track, DIR_TO_CLIENT, count);
+    STATS_ADD(bytes[STATS_TO_CLIENT], count);
+
+    if (relay->sock_off == relay->sock_out_len) {
+        relay->sock_out_len = 0;
+        for (; relay->sock_out_cells > 0; relay->sock_out_cells--)
+            queue_pop(&relay->to_pipe);
+    }
+
+    // The reader may have stopped on a full queue
+    sock_to_queue(relay);
+    if (relay->active)
+        queue_to_pipe(relay);
+}
+
+void relay_sock_ready(struct relay *relay) {
+    queue_to_sock(relay);
+    if (relay->active)
+        sock_to_queue(relay);
+    if (relay->active)
+        queue_to_pipe(relay);
+}
+
+static void log_frame(const struct ipc_frame *frame, const struct ipc_class *cls, const char *source, int id) {
+    const struct ipc_span *cmd = &cls->cmd, *evt = &cls->evt;
+
+    if (cmd->data == NULL) {
+        bridge_log(LL_INFO, "%s frame of %lu bytes received from %s %d.\n",
+                   ipc_opcode_name(frame->opcode), (unsigned long)frame->length, source, id);
+    } else {
+        bridge_log(LL_INFO, "%s frame (%.*s%s%.*s) of %lu bytes received from %s %d.\n",
+                   ipc_opcode_name(frame->opcode), (int)cmd->length, cmd->data, evt->data != NULL ? " " : "",
+                   (int)evt->length, evt->data != NULL ? evt->data : "", (unsigned long)frame->length, source, id);
+    }
+
+    bridge_log(LL_DEBUG, "%.*s\n", (int)frame->length, IPC_PAYLOAD(frame));
+}
+
+static int relay_pipe_read(struct relay *relay) {
+    size_t avail;
+    char *space = ipc_reader_space(&relay->from_pipe, &avail);
+
+    if (space == NULL) {
+        bridge_log(LL_ERROR, "Failed to allocate frame buffer for RPC client %d.\n", relay->id);
+        relay->transport->close(relay, 1);
+        return -1;
+    }
+
+    if (relay->transport->pipe_read(relay, space, avail) < 0)
+        return -1;
+
+    relay->read_pending = 1;
+    return 0;
+}
+
+// Reader stage: every complete frame is copied into the queue and the pipe is read again right away,
+// so the RPC client's writes never wait on Discord.
+// Backpressure policy once the queue is full: SET_ACTIVITY is held back and coalesced, and since only the
+// latest one matters, nothing is lost. Any other frame is dropped and counted, because blocking the pipe
+// would stall whichever thread of the game is writing to it.
+static void pipe_to_queue(struct relay *relay) {
+    struct ipc_frame frame;
+    enum ipc_status status;
+
+    while ((status = ipc_reader_next(&relay->from_pipe, &frame)) == IPC_OK) {
+        struct ipc_class cls;
+        ipc_frame_classify(&frame, &cls);
+
+        log_frame(&frame, &cls, "RPC client", relay->id);
+        trace_frame(DIR_TO_DISCORD, relay->id, &frame);
+
+        // A client that never says anything never costs a Discord connection
+        if (relay->on_demand) {
+            relay->on_demand = 0;
+            if (relay_attach(relay) < 0)
+                relay_wait(relay);
+            if (!relay->active) return;
+        }
+
+        if (relay->parked) {
+            int resumed = relay_unpark(relay, &frame);
+            if (!relay->active) return;
+            if (resumed) continue;
+        }
+
+        if (frame.opcode == IPC_PING && relay_ping(relay, &frame))
+            continue;
+
+        // Discord hangs up once it has it; without a session there's nothing to end but the client's
+        if (frame.opcode == IPC_CLOSE) {
+            relay->closed = 1;
+
+            if (!relay->attached) {
+                relay_end(relay);
+                return;
+            }
+        }
+
+        // Presence is all a parked session can carry over to the next client
+        if (frame.opcode != IPC_HANDSHAKE && cls.command != IPC_CMD_SET_ACTIVITY)
+            relay->stateful = 1;
+
+        relay_remember(relay, &frame, &cls);
+
+        if (cls.command == IPC_CMD_SET_ACTIVITY) {
+            STATS_ADD(activity_updates, 1);
+
+            // Coalesced, relay_attach() sends only the latest activity
+            if (!relay->attached && relay->activity != NULL) {
+                STATS_ADD(activity_drops, 1);
+                continue;
+            }
+
+            if (relay->attached && !activity_admit(relay, &frame, &cls))
+                continue;
+        }
+
+        if (queue_push(&relay->to_sock, frame.data, IPC_FRAME_SIZE(&frame), frame.opcode, relay->pipe_stamp) < 0) {
+            bridge_log(LL_WARNING, "Queue of client %d is full, dropping %s frame.\n",
+                       relay->id, ipc_opcode_name(frame.opcode));
+            STATS_ADD(backlog_drops, 1);
+            continue;
+        }
+
+        STATS_ADD(frames[STATS_TO_DISCORD], 1);
+    }
+
+    if (status == IPC_INVALID) {
+        bridge_log(LL_ERROR, "Oversized frame of %lu bytes from RPC client %d.\n",
+                   (unsigned long)frame.length, relay->id);
+        relay->transport->close(relay, 1);
+        return;
+    }
+
+    if (!relay->read_pending && relay_pipe_read(relay) < 0)
+        return;
+
+    queue_to_sock(relay);
+    if (relay->active && relay->pong_len > 0)
+        queue_to_pipe(relay);
+}
+
+// Answers a PING with the PONG Discord would send, the same payload, without a round trip through the socket
+// The Discord side gets keepalives of its own, see relay_keepalive(). A PING that doesn't fit, or that comes
+// while the last PONG is still being written, goes to Discord as before.
+// PONGs that didn't make it to the pipe yet are replaced, RPC libraries only ever wait on the last one.
+static int relay_ping(struct relay *relay, const struct ipc_frame *frame) {
+    if (IPC_FRAME_SIZE(frame) > sizeof(relay->pong) || (relay->sock_out == relay->pong && relay->sock_out_len > 0))
+        return 0;
+
+    uint32_t header[2] = {IPC_PONG, frame->length};
+    memcpy(relay->pong, header, IPC_HEADER_SIZE);
+    memcpy(relay->pong + IPC_HEADER_SIZE, IPC_PAYLOAD(frame), frame->length);
+    relay->pong_len = IPC_FRAME_SIZE(frame);
+
+    STATS_ADD(pongs, 1);
+    return 1;
+}
+
+// Sends Discord a PING once nothing went either way on the socket for RELAY_KEEPALIVE, on the bridge's schedule
+// rather than the client's, and swallows the PONG. One at a time, and only after a handshake, which Discord
+// wants first. Returns how many ms until the next one is due.
+static uint64_t relay_keepalive(struct relay *relay, uint64_t now) {
+    if (relay->handshake == NULL || relay->keepalive_len > 0)
+        return RELAY_NO_DEADLINE;
+
+    uint64_t due = relay->sock_at + RELAY_KEEPALIVE;
+    if (due > now)
+        return due - now;
+
+    char nonce[RELAY_NONCE_SIZE];
+    (void)activity_nonce(relay, nonce, sizeof(nonce));
+
+    int length = snprintf(relay->keepalive + IPC_HEADER_SIZE, sizeof(relay->keepalive) - IPC_HEADER_SIZE,
+                          "{\"nonce\":\"%s\"}", nonce);
+    uint32_t header[2] = {IPC_PING, (uint32_t)length};
+    memcpy(relay->keepalive, header, IPC_HEADER_SIZE);
+
+    // Not timed, and dropped rather than resent if the session goes, see relay_resend()
+    if (queue_push(&relay->to_sock, relay->keepalive, IPC_HEADER_SIZE + (size_t)length, IPC_PING, 0) < 0) {
+        relay->sock_at = now;   // A full queue isn't quiet, the writer is only waiting on Discord
+        return RELAY_KEEPALIVE;
+    }
+
+    relay->keepalive_len = IPC_HEADER_SIZE + (size_t)length;
+    STATS_ADD(keepalives, 1);
+    bridge_log(LL_DEBUG, "Sending keepalive to Discord client for client %d.\n", relay->id);
+
+    queue_to_sock(relay);
+    return RELAY_NO_DEADLINE;
+}
+
+// Writer stage: hands the preamble and as many queued frames as fit one batch to the socket
+static void queue_to_sock(struct relay *relay) {
+    struct frame_queue *queue = &relay->to_sock;
+
+    while (relay->attached) {
+        struct relay_iov iov[RELAY_IOV_BATCH];
+        int count = 0;
+
+        activity_flush(relay);
+
+        if (relay->preamble_off < relay->preamble_len)
+            iov[count++] = (struct relay_iov){relay->preamble + relay->preamble_off, relay->preamble_len - relay->preamble_off};
+
+        size_t queued = queue_count(queue);
+
+        for (size_t i = 0; i < queued && count < RELAY_IOV_BATCH; i++) {
+            struct queue_cell *cell = queue_at(queue, i);
+            size_t skip = i == 0 ? queue->off : 0;
+            iov[count++] = (struct relay_iov){cell->data + skip, cell->size - skip};
+        }
+
+        if (count == 0) return;
+
+        // One call for the whole batch
+        ssize_t written = relay->transport->sock_send(relay, iov, count);
+
+        // Resumed by the next relay_sock_ready(), the reader stage keeps going meanwhile
+        if (written == -LINUX_EAGAIN) return;
+
+        if (written < 0) {
+            bridge_log(LL_WARNING, "Failed to write to socket: %s.\n", strerror(-written));
+            STATS_SET(last_sock_error, (int32_t)written);
+            relay_detach(relay);
+            return;
+        }
+
+        STATS_ADD(bytes[STATS_TO_DISCORD], (uint64_t)written);
+        relay->sock_at = metrics_ms();
+
+        size_t left = (size_t)written;
+
+        if (relay->preamble_off < relay->preamble_len) {
+            size_t part = left < relay->preamble_len - relay->preamble_off ? left : relay->preamble_len - relay->preamble_off;
+            relay->preamble_off += part;
+            left -= part;
+
+            if (relay->preamble_off == relay->preamble_len) {
+                free(relay->preamble);
+                relay->preamble = NULL;
+                relay->preamble_len = relay->preamble_off = 0;
+            }
+        }
+
+        uint64_t now = metrics_now();
+
+        while (left > 0) {
+            struct queue_cell *cell = queue_at(queue, 0);
+            size_t rest = cell->size - queue->off;
+
+            if (left < rest) {
+                queue->off += left;
+                break;
+            }
+
+            if (cell->stamp != 0)
+                metrics_sample(DIR_TO_DISCORD, cell->opcode, cell->stamp, now);
+
+            // The handshake as a rule, which is what the game waits on at startup, and never a frame of the relay's own
+            if (relay->start_stamp != 0 && cell->stamp != 0) {
+                STATS_SET(first_frame_us, metrics_startup(relay->start_stamp, now) / 1000);
+                relay->start_stamp = 0;
+            }
+
+            left -= rest;
+            queue_pop(queue);
+        }
+    }
+}
+
+
+// Reader stage: Discord's frames are sorted out and copied into the queue as they come, so the socket is read on
+// while a pipe write waits on the RPC client.
+// Backpressure policy once the queue is full: the socket is left unread until the writer makes room. Nothing from
+// Discord is dropped, since the client waits on its replies, and the socket buffer holds the rest meanwhile.
+static void sock_to_queue(struct relay *relay) {
+    int drained = 0;
+
+    while (!queue_full(&relay->to_pipe)) {
+        struct ipc_frame frame;
+        enum ipc_status status;
+
+        while ((status = ipc_reader_next(&relay->from_sock, &frame)) == IPC_OK) {
+            struct ipc_class cls;
+            ipc_frame_classify(&frame, &cls);
+            log_frame(&frame, &cls, "Discord client for client", relay->id);
+            trace_frame(DIR_TO_CLIENT, relay->id, &frame);
+
+            // The answer to relay_keepalive(), the client never asked
+            if (frame.opcode == IPC_PONG && IPC_FRAME_SIZE(&frame) == relay->keepalive_len &&
+                memcmp(IPC_PAYLOAD(&frame), relay->keepalive + IPC_HEADER_SIZE, frame.length) == 0) {
+                relay->keepalive_len = 0;
+                continue;
+            }
+
+            // Ends the session whoever it was meant for, so it always gets through
+            if (frame.opcode == IPC_CLOSE) {
+                relay->closed = 1;
+                relay->fence_len = 0;
+                relay->hush_count = 0;
+                relay->swallow = 0;
+            }
+
+            // Meant for the client before this one, up to the reply to clearing its activity
+            if (relay->fence_len > 0) {
+                if (ipc_span_is(&cls.nonce, relay->fence))
+                    relay->fence_len = 0;
+                continue;
+            }
+
+            // Replies to what relay_mute() sent on the client's behalf
+            if (relay->hush_count > 0 && ipc_span_is(&cls.nonce, relay->hush[0])) {
+                memmove(relay->hush[0], relay->hush[1], --relay->hush_count * sizeof(relay->hush[0]));
+                continue;
+            }
+
+            if (cls.command == IPC_CMD_DISPATCH && ipc_span_is(&cls.evt, "READY"))
+                relay_remember(relay, &frame, &cls);
+
+            // READY and the activity reply, Discord answers the replay before anything else
+            if (relay->swallow > 0 && (cls.command == IPC_CMD_SET_ACTIVITY ||
+                (cls.command == IPC_CMD_DISPATCH && ipc_span_is(&cls.evt, "READY")))) {
+                relay->swallow--;
+                continue;
+            }
+
+            relay->swallow = 0;
+
+            if (queue_push(&relay->to_pipe, frame.data, IPC_FRAME_SIZE(&frame), frame.opcode, relay->sock_stamp) < 0) {
+                bridge_log(LL_ERROR, "Failed to queue %s frame for client %d.\n", ipc_opcode_name(frame.opcode), relay->id);
+                relay->transport->close(relay, 1);
+                return;
+            }
+
+            if (cls.command == IPC_CMD_DISPATCH)
+                STATS_ADD(events, 1);
+            STATS_ADD(frames[STATS_TO_CLIENT], 1);
+
+            if (queue_full(&relay->to_pipe)) return;
+        }
+
+        if (status == IPC_INVALID) {
+            bridge_log(LL_ERROR, "Oversized frame of %lu bytes from Discord client for client %d.\n",
+                       (unsigned long)frame.length, relay->id);
+            relay->transport->close(relay, 1);
+            return;
+        }
+
+        // Detached, what was read above was the last of the old session
+        if (!relay->attached || drained) return;
+
+        size_t avail;
+        char *space = ipc_reader_space(&relay->from_sock, &avail);
+
+        if (space == NULL) {
+            bridge_log(LL_ERROR, "Failed to allocate frame buffer for client %d.\n", relay->id);
+            relay->transport->close(relay, 1);
+            return;
+        }
+
+        ssize_t bytes_read = relay->transport->sock_recv(relay, space, avail);
+
+        // The transport calls relay_sock_ready() again once more data arrives
+        if (bytes_read == -LINUX_EAGAIN) return;
+
+        if (bytes_read < 0) {
+            bridge_log(LL_WARNING, "Failed to read from socket: %s.\n", strerror(-bytes_read));
+            STATS_SET(last_sock_error, (int32_t)bytes_read);
+            relay_detach(relay);
+            return;
+        } else if (bytes_read == 0) {
+            bridge_log(LL_WARNING, "Connection closed by Discord client for client %d.\n", relay->id);
+            relay_detach(relay);
+            return;
+        }
+
+        bridge_log(LL_TRACE, "%ld bytes received from Discord client for client %d.\n", (long int)bytes_read, relay->id);
+        ipc_reader_commit(&relay->from_sock, bytes_read);
+        relay->sock_stamp = metrics_now();
+        relay->sock_at = metrics_ms();
+
+        // A short read emptied the socket, asking again would only cost an EAGAIN
+        drained = (size_t)bytes_read < avail;
+    }
+}
+
+// Points sock_out at the queued frames from the head on, up to RELAY_RUN of them
+// A pipe write takes a single buffer, so a lone frame goes out in place and a run of them is copied together.
+// Oversized frames only ever go alone, which bounds the copy to RELAY_RUN cells.
+static void pipe_run(struct relay *relay) {
+    struct frame_queue *queue = &relay->to_pipe;
+    size_t queued = queue_count(queue), count = 1, size = queue_at(queue, 0)->size;
+
+    while (count < queued && count < RELAY_RUN && size <= QUEUE_CELL && queue_at(queue, count)->size <= QUEUE_CELL)
+        size += queue_at(queue, count++)->size;
+
+    if (count > 1 && size > relay->run_size) {
+        char *run = realloc(relay->run, size);
+
+        // Costs a write per frame until memory frees up
+        if (run == NULL) {
+            count = 1;
+            size = queue_at(queue, 0)->size;
+        } else {
+            relay->run = run;
+            relay->run_size = size;
+        }
+    }
+
+    relay->sock_out = count > 1 ? relay->run : queue_at(queue, 0)->data;
+    relay->sock_out_len = size;
+    relay->sock_out_cells = count;
+    relay->sock_off = 0;
+
+    for (size_t i = 0, off = 0; i < count; i++) {
+        struct queue_cell *cell = queue_at(queue, i);
+
+        if (count > 1)
+            memcpy(relay->run + off, cell->data, cell->size);
+        off += cell->size;
+
+        (void)metrics_track(&relay->to_pipe_track, cell->opcode, cell->size, cell->stamp);
+    }
+}
+
+// Writer stage: one pipe write in flight, of a PONG or of queued frames, the reader goes on meanwhile
+static void queue_to_pipe(struct relay *relay) {
+    if (relay->write_pending) return;
+
+    if (relay->sock_out_len == 0) {
+        if (relay->pong_len > 0) {
+            (void)metrics_track(&relay->to_pipe_track, IPC_PONG, relay->pong_len, relay->pipe_stamp);
+            STATS_ADD(frames[STATS_TO_CLIENT], 1);
+            relay->sock_out = relay->pong;
+            relay->sock_out_len = relay->pong_len;
+            relay->sock_off = 0;
+            relay->sock_out_cells = 0;
+            relay->pong_len = 0;
+        } else if (queue_count(&relay->to_pipe) > 0) {
+            pipe_run(relay);
+        } else {
+            // Ended, and the client has everything Discord sent
+            if (!relay->attached && relay->closed)
+                relay->transport->close(relay, 0);
+            return;
+        }
+    }
+
+    if (relay->transport->pipe_write(relay, relay->sock_out + relay->sock_off, relay->sock_out_len - relay->sock_off) < 0)
+        return;
+
+    relay->write_pending = 1;
+}
@@ -0,0 +1,266 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bridge/ring.h"
+#include "bridge/discovery.h"
+#include "bridge/metrics.h"
+#include "bridge/utils/linux.h"
+#include "bridge/log.h"
+
+#define ANSWER_MS   1000    // A companion that takes longer to act on a request is taken for gone
+
+// Channel states are written by both sides, each transition by one of them only: the bridge moves channels
+// out of RING_IDLE, RING_FAILED, RING_OPEN and RING_HANGUP, the companion out of RING_CONNECT and RING_CLOSE,
+// and from RING_OPEN to RING_HANGUP with a compare-and-swap so it never undoes a close
+static struct ring_block *block;
+static char ring_path[256];
+static int lost;                    // The companion stopped answering, connections go direct from then on
+static uint64_t asked[RING_CHANNELS];   // metrics_ms() a connect started waiting on the companion, 0 when none does
+
+static void wake_companion(void) {
+    (void)__atomic_add_fetch(&block->companion_wake, 1, __ATOMIC_SEQ_CST);
+    (void)linux_futex(&block->companion_wake, LINUX_FUTEX_WAKE, 1, NULL);
+}
+
+int ring_init(uint32_t pid) {
+    int error;
+
+    snprintf(ring_path, sizeof(ring_path), "%s/" RING_PREFIX "%u", get_sock_parent_path(), pid);
+
+    int fd = linux_open(ring_path, LINUX_O_RDWR | LINUX_O_CREAT | LINUX_O_TRUNC | LINUX_O_CLOEXEC, 0600);
+    if (fd < 0) {
+        bridge_log(LL_WARNING, "Failed to create \"%s\": %s.\n", ring_path, strerror(-fd));
+        return fd;
+    }
+
+    if ((error = linux_ftruncate(fd, sizeof(struct ring_block))) < 0)
+        goto fail;
+
+    void *map = linux_mmap2(NULL, sizeof(struct ring_block), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    // Errors come back as the last page of the address space
+    if ((uintptr_t)map >= (uintptr_t)-4095) {
+        error = (int)(intptr_t)map;
+        goto fail;
+    }
+
+    block = map;
+    block->version = RING_VERSION;
+    block->size = sizeof(struct ring_block);
+    block->bridge_pid = pid;
+    __atomic_store_n(&block->magic, RING_MAGIC, __ATOMIC_RELEASE);
+
+    // A companion picks the file up once it's closed for writing, header complete
+    linux_close(fd);
+    bridge_log(LL_INFO, "Split mode, Discord is reached through the companion serving \"%s\".\n", ring_path);
+    return 0;
+
+fail:
+    bridge_log(LL_WARNING, "Failed to map \"%s\": %s.\n", ring_path, strerror(-error));
+    linux_close(fd);
+    (void)linux_unlink(ring_path);
+    return error;
+}
+
+// Stays mapped, ring_wait() may still be blocked on it and the companion wakes it once more on the way out
+void ring_shutdown(void) {
+    if (block == NULL || block->closing) return;
+
+    lost = 1;
+    __atomic_store_n(&block->closing, 1, __ATOMIC_RELEASE);
+    wake_companion();
+    (void)linux_unlink(ring_path);
+}
+
+int ring_served(void) {
+    return block != NULL && !lost && __atomic_load_n(&block->companion_pid, __ATOMIC_ACQUIRE) != 0;
+}
+
+int ring_connect(int id) {
+    struct ring_channel *channel;
+
+    if (!ring_served()) {
+        asked[id] = 0;
+        return -LINUX_ENODEV;
+    }
+
+    channel = &block->channels[id];
+    uint64_t now = metrics_ms();
+
+    switch (__atomic_load_n(&channel->state, __ATOMIC_ACQUIRE)) {
+        case RING_OPEN:
+            asked[id] = 0;
+            return 0;
+        case RING_FAILED: {
+            int error = channel->error;
+            asked[id] = 0;
+            __atomic_store_n(&channel->state, RING_IDLE, __ATOMIC_RELEASE);
+            return error < 0 ? error : -LINUX_ECONNREFUSED;
+        }
+        case RING_IDLE:
+            asked[id] = now;
+            __atomic_store_n(&channel->state, RING_CONNECT, __ATOMIC_RELEASE);
+            wake_companion();
+            return -LINUX_EINPROGRESS;
+        default:
+            // Still connecting, or the previous connection is still on its way out
+            if (asked[id] == 0) asked[id] = now;
+            if (now < asked[id] + ANSWER_MS) return -LINUX_EINPROGRESS;
+            break;
+    }
+
+    bridge_log(LL_WARNING, "Companion stopped answering, connecting to Discord directly from now on.\n");
+    lost = 1;
+    asked[id] = 0;
+    return -LINUX_ENODEV;
+}
+
+void ring_close(int id) {
+    if (block == NULL) return;
+
+    asked[id] = 0;
+    __atomic_store_n(&block->channels[id].state, RING_CLOSE, __ATOMIC_RELEASE);
+    wake_companion();
+}
+
+uint64_t ring_schedule(uint64_t now) {
+    uint64_t wait = RELAY_NO_DEADLINE;
+
+    // Connects still asked for go direct the next time they're tried, whenever that is
+    if (!ring_served()) return wait;
+
+    for (int id = 0; id < RING_CHANNELS; id++) {
+        if (asked[id] == 0) continue;
+        uint64_t due = asked[id] + ANSWER_MS;
+        if (due <= now) return 0;
+        if (due - now < wait) wait = due - now;
+    }
+
+    return wait;
+}
+
+ssize_t ring_send(int id, const struct relay_iov *iov, int count) {
+    struct ring_channel *channel = &block->channels[id];
+    struct ring *ring = &channel->to_discord;
+    uint32_t state = __atomic_load_n(&channel->state, __ATOMIC_ACQUIRE);
+
+    if (state == RING_HANGUP)
+        return channel->error < 0 ? channel->error : -LINUX_EPIPE;
+
+    uint32_t head = ring->head;
+    uint32_t room = RING_BYTES - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+
+    // Asks to be woken before looking again, so room made in between isn't missed
+    if (room == 0) {
+        __atomic_store_n(&ring->full, 1, __ATOMIC_SEQ_CST);
+        room = RING_BYTES - (head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST));
+        if (room == 0) return -LINUX_EAGAIN;
+    }
+
+    uint32_t written = 0;
+
+    for (int i = 0; i < count && written < room; i++) {
+        uint32_t length = iov[i].len < room - written ? (uint32_t)iov[i].len : room - written;
+        uint32_t off = (head + written) & (RING_BYTES - 1);
+        uint32_t first = length < RING_BYTES - off ? length : RING_BYTES - off;
+
+        memcpy(ring->data + off, iov[i].base, first);
+        memcpy(ring->data, (const char*)iov[i].base + first, length - first);
+        written += length;
+    }
+
+    __atomic_store_n(&ring->head, head + written, __ATOMIC_SEQ_CST);
+
+    // The companion had caught up, so nothing is on its way to the socket; unless it's asleep it looks again
+    // before it is, see companion_asleep
+    if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head &&
+        __atomic_load_n(&block->companion_asleep, __ATOMIC_SEQ_CST))
+        wake_companion();
+
+    return written;
+}
+
+ssize_t ring_recv(int id, char *buf, size_t len) {
+    struct ring_channel *channel = &block->channels[id];
+    struct ring *ring = &channel->to_client;
+
+    // State before head: a hangup is only reported once everything sent ahead of it was read
+    uint32_t state = __atomic_load_n(&channel->state, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t copied = 0;
+
+    if (head == tail) {
+        if (state == RING_HANGUP) return channel->error;
+        return -LINUX_EAGAIN;
+    }
+
+    // A short read has to mean empty, so the ring is looked at again after each move of tail: the companion
+    // either published before that and gets copied too, or sees the ring empty and says so, see struct transport
+    do {
+        uint32_t length = head - tail;
+        if (length > len - copied) length = (uint32_t)(len - copied);
+
+        uint32_t off = tail & (RING_BYTES - 1);
+        uint32_t first = length < RING_BYTES - off ? length : RING_BYTES - off;
+
+        memcpy(buf + copied, ring->data + off, first);
+        memcpy(buf + copied + first, ring->data, length - first);
+        copied += length;
+        tail += length;
+
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+    } while (copied < len && (head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)) != tail);
+
+    // The companion stopped receiving for lack of room
+    if (__atomic_load_n(&ring->full, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&ring->full, 0, __ATOMIC_SEQ_CST) &&
+        __atomic_load_n(&block->companion_asleep, __ATOMIC_SEQ_CST))
+        wake_companion();
+
+    return (ssize_t)copied;
+}
+
+uint32_t ring_wait(void) {
+    while (1) {
+        uint32_t wake = __atomic_load_n(&block->bridge_wake, __ATOMIC_SEQ_CST);
+        uint32_t ready;
+
+        // Announced before looking, so the companion either sees it and wakes us or left its news in time
+        __atomic_store_n(&block->bridge_asleep, 1, __ATOMIC_SEQ_CST);
+
+        if ((ready = __atomic_exchange_n(&block->ready, 0, __ATOMIC_SEQ_CST)) == 0) {
+            // Returns at once if the companion bumped the word since it was read
+            (void)linux_futex(&block->bridge_wake, LINUX_FUTEX_WAIT, wake, NULL);
+            ready = __atomic_exchange_n(&block->ready, 0, __ATOMIC_SEQ_CST);
+        }
+
+        __atomic_store_n(&block->bridge_asleep, 0, __ATOMIC_SEQ_CST);
+        if (ready != 0) return ready;
+    }
+}
+
+uint32_t ring_poll(void) {
+    if (block == NULL || __atomic_load_n(&block->ready, __ATOMIC_RELAXED) == 0) return 0;
+    return __atomic_exchange_n(&block->ready, 0, __ATOMIC_SEQ_CST);
+}
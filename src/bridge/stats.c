@@ -0,0 +1,100 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "bridge/stats.h"
+#include "bridge/discovery.h"
+#include "bridge/utils/linux.h"
+#include "bridge/log.h"
+
+#define STATS_MAP_SIZE  4096    // One page, the block is far smaller
+
+// Counters always have somewhere to go, so updating them never needs a check
+static struct stats_block fallback;
+struct stats_block *g_stats = &fallback;
+
+static char stats_path[256];
+
+void stats_init(void) {
+    char pid[16];
+    ssize_t length;
+
+    // Wine's own pid would mean nothing to a Linux reader, /proc/self resolves to the real one
+    if ((length = linux_readlink("/proc/self", pid, sizeof(pid) - 1)) < 0) {
+        bridge_log(LL_WARNING, "Failed to get process id, stats won't be published: %s.\n", strerror(-length));
+        return;
+    }
+
+    pid[length] = '\0';
+    snprintf(stats_path, sizeof(stats_path), "%s/" STATS_PREFIX "%s", get_sock_parent_path(), pid);
+
+    int fd = linux_open(stats_path, LINUX_O_RDWR | LINUX_O_CREAT | LINUX_O_TRUNC | LINUX_O_CLOEXEC, 0644);
+    if (fd < 0) {
+        bridge_log(LL_WARNING, "Failed to create stats file \"%s\": %s.\n", stats_path, strerror(-fd));
+        return;
+    }
+
+    int error;
+    void *map;
+
+    if ((error = linux_ftruncate(fd, STATS_MAP_SIZE)) < 0) {
+        bridge_log(LL_WARNING, "Failed to size stats file: %s.\n", strerror(-error));
+        goto failed;
+    }
+
+    map = linux_mmap2(NULL, STATS_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    // Errors come back as the last page of the address space
+    if ((uintptr_t)map >= (uintptr_t)-4095) {
+        bridge_log(LL_WARNING, "Failed to map stats file: %s.\n", strerror((int)-(intptr_t)map));
+        goto failed;
+    }
+
+    // The mapping keeps the file alive by itself
+    linux_close(fd);
+
+    g_stats = map;
+    g_stats->version = STATS_VERSION;
+    g_stats->size = sizeof(struct stats_block);
+    g_stats->pid = (uint32_t)strtoul(pid, NULL, 10);
+
+    // Last, so a reader never trusts a half-written header
+    __atomic_store_n(&g_stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+    bridge_log(LL_INFO, "Publishing stats at \"%s\".\n", stats_path);
+    return;
+
+failed:
+    linux_close(fd);
+    (void)linux_unlink(stats_path);
+    stats_path[0] = '\0';
+}
+
+void stats_shutdown(void) {
+    if (g_stats == &fallback) return;
+
+    (void)linux_unlink(stats_path);
+    (void)linux_munmap(g_stats, STATS_MAP_SIZE);
+    g_stats = &fallback;
+}
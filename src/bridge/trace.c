@@ -0,0 +1,143 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bridge/trace.h"
+#include "bridge/discovery.h"
+#include "bridge/stats.h"
+#include "bridge/utils/linux.h"
+#include "bridge/log.h"
+
+// Appended through a window mapped over the end of the file, moved along as it fills up, so recording a frame
+// is a copy and never a syscall of its own
+static char *window;
+static uint64_t window_base;        // File offset of the window
+static size_t window_pos;
+static int trace_fd = -1;
+static uint64_t start;
+static char trace_path[256];
+
+static int window_map(void) {
+    int error;
+
+    if ((error = linux_ftruncate(trace_fd, window_base + TRACE_WINDOW)) < 0) {
+        bridge_log(LL_WARNING, "Failed to extend trace file: %s.\n", strerror(-error));
+        return error;
+    }
+
+    void *map = linux_mmap2(NULL, TRACE_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, trace_fd,
+                            window_base / LINUX_PAGE_SIZE);
+
+    // Errors come back as the last page of the address space
+    if ((uintptr_t)map >= (uintptr_t)-4095) {
+        bridge_log(LL_WARNING, "Failed to map trace file: %s.\n", strerror((int)-(intptr_t)map));
+        return (int)(intptr_t)map;
+    }
+
+    window = map;
+    window_pos = 0;
+    return 0;
+}
+
+void trace_open(const char *path) {
+    if (path != NULL)
+        snprintf(trace_path, sizeof(trace_path), "%s", path);
+    else
+        snprintf(trace_path, sizeof(trace_path), "%s/" TRACE_PREFIX "%u", get_sock_parent_path(), g_stats->pid);
+
+    trace_fd = linux_open(trace_path, LINUX_O_RDWR | LINUX_O_CREAT | LINUX_O_TRUNC | LINUX_O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        bridge_log(LL_WARNING, "Failed to create trace file \"%s\": %s.\n", trace_path, strerror(-trace_fd));
+        return;
+    }
+
+    window_base = 0;
+    if (window_map() < 0) {
+        trace_close();
+        return;
+    }
+
+    struct trace_header *header = (struct trace_header*)window;
+    header->magic = TRACE_MAGIC;
+    header->version = TRACE_VERSION;
+    header->window = TRACE_WINDOW;
+    window_pos = sizeof(*header);
+
+    start = metrics_now();
+    bridge_log(LL_INFO, "Recording trace at \"%s\".\n", trace_path);
+}
+
+static struct trace_record *record_reserve(size_t size) {
+    size_t length = TRACE_RECORD_SIZE(size);
+
+    if (window == NULL) return NULL;
+
+    // The rest of the window stays zeroed, which ends it for readers
+    if (window_pos + length > TRACE_WINDOW) {
+        (void)linux_munmap(window, TRACE_WINDOW);
+        window = NULL;
+        window_base += TRACE_WINDOW;
+
+        if (window_map() < 0) {
+            trace_close();
+            return NULL;
+        }
+    }
+
+    struct trace_record *record = (struct trace_record*)(window + window_pos);
+    record->stamp = metrics_ns(metrics_now() - start);
+    record->size = (uint32_t)size;
+    window_pos += length;
+    return record;
+}
+
+void trace_frame(enum metrics_dir dir, int client, const struct ipc_frame *frame) {
+    struct trace_record *record = record_reserve(IPC_FRAME_SIZE(frame));
+    if (record == NULL) return;
+
+    record->client = (uint16_t)client;
+    record->dir = (uint8_t)dir;
+    memcpy(record + 1, frame->data, IPC_FRAME_SIZE(frame));
+}
+
+void trace_gone(int client) {
+    struct trace_record *record = record_reserve(0);
+    if (record == NULL) return;
+
+    record->client = (uint16_t)client;
+    record->dir = TRACE_GONE;
+}
+
+void trace_close(void) {
+    if (trace_fd < 0) return;
+
+    // Down to the last record, a trace cut short by a crash only has zeroes past it
+    if (window != NULL) {
+        (void)linux_munmap(window, TRACE_WINDOW);
+        (void)linux_ftruncate(trace_fd, window_base + window_pos);
+        window = NULL;
+    }
+
+    linux_close(trace_fd);
+    trace_fd = -1;
+}
@@ -23,6 +23,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "bridge/utils/arg_parser.h"
@@ -35,17 +36,26 @@
     }
 
 static const struct option long_options[] = {
-    { "log-level", required_argument, NULL,  'l' },
-    { "help",      no_argument,       NULL,  'h' },
-    { 0,           0,                 0,      0  }
+    { "log-level",  required_argument, NULL,  'l' },
+    { "log-sample", required_argument, NULL,  'L' },
+    { "persistent", no_argument,       NULL,  'p' },
+    { "split",      no_argument,       NULL,  's' },
+    { "trace",      optional_argument, NULL,  't' },
+    { "help",       no_argument,       NULL,  'h' },
+    { 0,            0,                 0,      0  }
 };
 
+int g_persistent = 0;
+int g_split = 0;
+int g_trace = 0;
+char *g_trace_path = NULL;
+
 void parse_args(int argc, char *argv[]) {
     int c;
     while (1) {
         int option_index = 0;
 
-        c = getopt_long(argc, argv, "hcw", long_options, &option_index);
+        c = getopt_long(argc, argv, "hcwpst::", long_options, &option_index);
 
         if (c == -1) break;
 
@@ -65,9 +75,23 @@ void parse_args(int argc, char *argv[]) {
                     "                             none, error, warning, info, debug, trace\n"
                     "                             An unspecified log level will assume that\n"
                     "                             \"none\" was selected.\n"
+                    "      --log-sample=N         Keep one in every N trace level messages, so\n"
+                    "                             tracing can stay on under load.\n"
+                    "  -p, --persistent           Keep running after the last RPC client leaves,\n"
+                    "                             ready for the next one on the same pipe.\n"
+                    "  -s, --split                Experimental, in builds made with SPLIT=1:\n"
+                    "                             hand Discord's sockets to winerpc-companion\n"
+                    "                             when it is running, connecting directly\n"
+                    "                             otherwise.\n"
+                    "  -t, --trace[=FILE]         Record every relayed frame to FILE, a Linux path,\n"
+                    "                             or to winerpc-trace-PID next to the Discord\n"
+                    "                             sockets. Replay it with relay-replay.\n"
                     "  -w, --warranty             Display warranty info and exit.\n"
                     "  -c  --copyright            Display copyright info and exit.\n\n"
 
+                    "Relay latency percentiles are logged at the info level on exit,\n"
+                    "and on demand by pressing Ctrl+Break.\n\n"
+
                     "Report bugs to <https://github.com/fl4tisjustice/WineRPC/issues>\n\n",
                     
                     VERSION
@@ -99,6 +123,16 @@ void parse_args(int argc, char *argv[]) {
 
                 );
                 exit(EXIT_SUCCESS);
+            case 'p':
+                g_persistent = 1;
+                break;
+            case 's':
+                g_split = 1;
+                break;
+            case 't':
+                g_trace = 1;
+                g_trace_path = optarg;
+                break;
             case 'l': {
                 CMP_ARG_ASSIGN("none",    g_log_level, LL_NONE);
                 CMP_ARG_ASSIGN("error",   g_log_level, LL_ERROR);
@@ -111,6 +145,18 @@ void parse_args(int argc, char *argv[]) {
                 printf("Invalid log level. Please supply either no log value to silence the program or a valid one.\n");
                 exit(EXIT_FAILURE);
             }
+            case 'L': {
+                char *end;
+                unsigned long sample = strtoul(optarg, &end, 10);
+
+                if (*optarg == '\0' || *end != '\0' || sample == 0 || sample > UINT32_MAX) {
+                    printf("Invalid log sample. Please supply a positive number of trace messages to keep one of.\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                g_log_sample = (unsigned)sample;
+                break;
+            }
             case '?': // Unknown option
                 printf("Try 'winerpcbridge.exe --help' for more information.");
                 exit(EXIT_FAILURE);
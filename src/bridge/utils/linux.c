@@ -20,7 +20,6 @@
  ====================================================================== */
 
 #include <stdio.h>
-#include <stdarg.h>
 #include <assert.h>
 #include <stdint.h>
 
@@ -30,118 +29,270 @@
 #define __ARG_COUNT(_10, _9, _8, _7, _6, _5, _4, _3, _2, _1, N, ...) N
 #define _ARG_COUNT(...) __ARG_COUNT(__VA_ARGS__, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
 
-#define _REVERSE_1(arg1) arg1
-#define _REVERSE_2(arg1, arg2) arg2, arg1
-#define _REVERSE_3(arg1, ...) _REVERSE_2(__VA_ARGS__), arg1
-#define _REVERSE_4(arg1, ...) _REVERSE_3(__VA_ARGS__), arg1
-#define _REVERSE_5(arg1, ...) _REVERSE_4(__VA_ARGS__), arg1
-#define _REVERSE_6(arg1, ...) _REVERSE_5(__VA_ARGS__), arg1
-
-#define __REVERSE(N, ...) _REVERSE_ ## N(__VA_ARGS__)
-#define _REVERSE(N, ...) __REVERSE(N, __VA_ARGS__)
-
-#define linux_syscall(nr, ...) _linux_syscall(nr, _REVERSE(_ARG_COUNT(__VA_ARGS__), __VA_ARGS__))
-
-enum syscall_nr {
-    NR_READ        = 0x03,
-    NR_WRITE       = 0x04,
-    NR_OPEN        = 0x05,
-    NR_CLOSE       = 0x06,
-    NR_SOCKETCALL  = 0x66,
-    NR_MMAP2       = 0xC0,
-    NR_MUNMAP      = 0x5B
-};
-
-enum socketcall_type{
-    SC_SOCKET  = 0x01,
-    SC_CONNECT = 0x03
-};
-
-inline uint32_t __linux_syscall(enum syscall_nr nr, uint32_t arg1, uint32_t arg2,
-                                     uint32_t arg3, uint32_t arg4, uint32_t arg5) {
-    uint32_t ret;
+#define _ARG_CAST_1(arg1) (intptr_t)(arg1)
+#define _ARG_CAST_2(arg1, ...) (intptr_t)(arg1), _ARG_CAST_1(__VA_ARGS__)
+#define _ARG_CAST_3(arg1, ...) (intptr_t)(arg1), _ARG_CAST_2(__VA_ARGS__)
+#define _ARG_CAST_4(arg1, ...) (intptr_t)(arg1), _ARG_CAST_3(__VA_ARGS__)
+#define _ARG_CAST_5(arg1, ...) (intptr_t)(arg1), _ARG_CAST_4(__VA_ARGS__)
+#define _ARG_CAST_6(arg1, ...) (intptr_t)(arg1), _ARG_CAST_5(__VA_ARGS__)
 
+#define __SYSCALL(N, nr, ...) __linux_syscall ## N(nr, _ARG_CAST_ ## N(__VA_ARGS__))
+#define _SYSCALL(N, nr, ...) __SYSCALL(N, nr, __VA_ARGS__)
+
+// Arity is checked against SYSCALL_TABLE and picks the matching __linux_syscallN at compile time
+#define linux_syscall(name, ...)                                                                \
+    ((void)sizeof(char[ARITY_ ## name == _ARG_COUNT(__VA_ARGS__) ? 1 : -1]),                    \
+     _SYSCALL(_ARG_COUNT(__VA_ARGS__), NR_ ## name, __VA_ARGS__))
+
+#if defined(__x86_64__)
+    #define SYSCALL_NR(i386, x86_64) x86_64
+#elif defined(__i386__)
+    #define SYSCALL_NR(i386, x86_64) i386
+#else
+    #error "Only i686 and x86_64 builds are supported"
+#endif
+
+// name, i386 number, x86_64 number, arity
+// i386 has had direct socket calls since Linux 4.3, so socketcall is left alone
+#define SYSCALL_TABLE(X)                    \
+    X(READ,           0x03,  0x00, 3)       \
+    X(WRITE,          0x04,  0x01, 3)       \
+    X(OPEN,           0x05,  0x02, 3)       \
+    X(CLOSE,          0x06,  0x03, 1)       \
+    X(READV,          0x91,  0x13, 3)       \
+    X(WRITEV,         0x92,  0x14, 3)       \
+    X(MMAP,           0xC0,  0x09, 6)       \
+    X(MUNMAP,         0x5B,  0x0B, 2)       \
+    X(EPOLL_CTL,      0xFF,  0xE9, 4)       \
+    X(EPOLL_WAIT,     0x100, 0xE8, 4)       \
+    X(EPOLL_CREATE1,  0x149, 0x123, 1)      \
+    X(SOCKET,         0x167, 0x29, 3)       \
+    X(CONNECT,        0x16A, 0x2A, 3)       \
+    X(SENDMSG,        0x172, 0x2E, 3)       \
+    X(RECVMSG,        0x174, 0x2F, 3)       \
+    X(GETDENTS64,     0xDC,  0xD9, 3)       \
+    X(INOTIFY_INIT1,  0x14C, 0x126, 1)      \
+    X(INOTIFY_ADD_WATCH, 0x124, 0xFE, 3)   \
+    X(FTRUNCATE,      0x5D,  0x4D, 2)       \
+    X(UNLINK,         0x0A,  0x57, 1)       \
+    X(READLINK,       0x55,  0x59, 3)       \
+    X(FUTEX,          0xF0,  0xCA, 4)
+
+#define X_NR(name, i386, x86_64, arity) NR_ ## name = SYSCALL_NR(i386, x86_64),
+#define X_ARITY(name, i386, x86_64, arity) ARITY_ ## name = arity,
+
+enum syscall_nr { SYSCALL_TABLE(X_NR) };
+enum syscall_arity { SYSCALL_TABLE(X_ARITY) };
+
+#if defined(__x86_64__)
+
+// https://man7.org/linux/man-pages/man2/syscall.2.html
+// rcx and r11 are clobbered by the syscall instruction itself
+
+static inline intptr_t __linux_syscall1(intptr_t nr, intptr_t arg1) {
+    intptr_t ret;
+    __asm__ __volatile__ ("syscall" : "=a"(ret) : "a"(nr), "D"(arg1) : "rcx", "r11", "memory");
+    return ret;
+}
+
+static inline intptr_t __linux_syscall2(intptr_t nr, intptr_t arg1, intptr_t arg2) {
+    intptr_t ret;
+    __asm__ __volatile__ ("syscall" : "=a"(ret) : "a"(nr), "D"(arg1), "S"(arg2) : "rcx", "r11", "memory");
+    return ret;
+}
+
+static inline intptr_t __linux_syscall3(intptr_t nr, intptr_t arg1, intptr_t arg2, intptr_t arg3) {
+    intptr_t ret;
+    __asm__ __volatile__ ("syscall" : "=a"(ret) : "a"(nr), "D"(arg1), "S"(arg2), "d"(arg3) : "rcx", "r11", "memory");
+    return ret;
+}
+
+static inline intptr_t __linux_syscall4(intptr_t nr, intptr_t arg1, intptr_t arg2, intptr_t arg3, intptr_t arg4) {
+    intptr_t ret;
+    register intptr_t r10 __asm__("r10") = arg4;
+    __asm__ __volatile__ ("syscall" : "=a"(ret) : "a"(nr), "D"(arg1), "S"(arg2), "d"(arg3), "r"(r10) : "rcx", "r11", "memory");
+    return ret;
+}
+
+static inline intptr_t __linux_syscall6(intptr_t nr, intptr_t arg1, intptr_t arg2, intptr_t arg3,
+                                        intptr_t arg4, intptr_t arg5, intptr_t arg6) {
+    intptr_t ret;
+    register intptr_t r10 __asm__("r10") = arg4;
+    register intptr_t r8 __asm__("r8") = arg5;
+    register intptr_t r9 __asm__("r9") = arg6;
     __asm__ __volatile__ (
-        "int 0x80\n\t"
-        : "=a" (ret) 
-        : "a" (nr),  "b"(arg1), "c"(arg2),
-          "d"(arg3), "S"(arg4), "D"(arg5)
-        : "memory", "cc"
+        "syscall"
+        : "=a"(ret)
+        : "a"(nr), "D"(arg1), "S"(arg2), "d"(arg3), "r"(r10), "r"(r8), "r"(r9)
+        : "rcx", "r11", "memory"
     );
-    
     return ret;
 }
 
-uint32_t _linux_syscall(enum syscall_nr nr, ...) {
-    uint32_t arg1, arg2, arg3, arg4, arg5;
-    arg1 = arg2 = arg3 = arg4 = arg5 = 0;
+#else
+
+// https://man7.org/linux/man-pages/man2/syscall.2.html
+// The vDSO entry point can't be located reliably from a PE image, so stick to int 0x80
 
-    va_list args;
-    va_start(args, nr);
+static inline intptr_t __linux_syscall1(intptr_t nr, intptr_t arg1) {
+    intptr_t ret;
+    __asm__ __volatile__ ("int 0x80" : "=a"(ret) : "a"(nr), "b"(arg1) : "memory", "cc");
+    return ret;
+}
 
-    switch (nr) {
-        case NR_MMAP2:
-            arg5 = va_arg(args, uint32_t);
-            arg4 = va_arg(args, uint32_t);
-            // Fall through
-        case NR_READ:
-        case NR_WRITE:
-        case NR_OPEN:
-            arg3 = va_arg(args, uint32_t);
-            // Fall through
-        case NR_SOCKETCALL:
-        case NR_MUNMAP:
-            arg2 = va_arg(args, uint32_t);
-            // Fall through
-        case NR_CLOSE:
-            arg1 = va_arg(args, uint32_t);
-            break;
-    }
+static inline intptr_t __linux_syscall2(intptr_t nr, intptr_t arg1, intptr_t arg2) {
+    intptr_t ret;
+    __asm__ __volatile__ ("int 0x80" : "=a"(ret) : "a"(nr), "b"(arg1), "c"(arg2) : "memory", "cc");
+    return ret;
+}
 
-    va_end(args);
+static inline intptr_t __linux_syscall3(intptr_t nr, intptr_t arg1, intptr_t arg2, intptr_t arg3) {
+    intptr_t ret;
+    __asm__ __volatile__ ("int 0x80" : "=a"(ret) : "a"(nr), "b"(arg1), "c"(arg2), "d"(arg3) : "memory", "cc");
+    return ret;
+}
 
-    return __linux_syscall(nr, arg1, arg2, arg3, arg4, arg5);
+static inline intptr_t __linux_syscall4(intptr_t nr, intptr_t arg1, intptr_t arg2, intptr_t arg3, intptr_t arg4) {
+    intptr_t ret;
+    __asm__ __volatile__ ("int 0x80" : "=a"(ret) : "a"(nr), "b"(arg1), "c"(arg2), "d"(arg3), "S"(arg4) : "memory", "cc");
+    return ret;
 }
 
+// The sixth argument goes in ebp, which can't be named as an operand, so swap it in around the call
+static inline intptr_t __linux_syscall6(intptr_t nr, intptr_t arg1, intptr_t arg2, intptr_t arg3,
+                                        intptr_t arg4, intptr_t arg5, intptr_t arg6) {
+    intptr_t ret;
+    intptr_t args[] = { arg1, arg6 };
+    __asm__ __volatile__ (
+        "push ebp\n\t"
+        "push ebx\n\t"
+        "mov ebp, [ebx + 4]\n\t"
+        "mov ebx, [ebx]\n\t"
+        "int 0x80\n\t"
+        "pop ebx\n\t"
+        "pop ebp\n\t"
+        : "=a"(ret)
+        : "a"(nr), "b"(args), "c"(arg2), "d"(arg3), "S"(arg4), "D"(arg5)
+        : "memory", "cc"
+    );
+    return ret;
+}
+
+#endif
+
 ssize_t linux_read(int fd, void *buf, size_t count) {
-    bridge_log(LL_TRACE, "%s(%d, 0x%08X, %lu)\n", __func__, fd, (uint32_t)(uintptr_t)buf, (unsigned long)count);
-    return linux_syscall(NR_READ, fd, buf, count);
+    bridge_log(LL_TRACE, "%s(%d, %p, %lu)\n", __func__, fd, buf, (unsigned long)count);
+    return linux_syscall(READ, fd, buf, count);
 }
 
 ssize_t linux_write(int fd, const void *buf, size_t count) {
-    bridge_log(LL_TRACE, "%s(%d, 0x%08X, %lu)\n", __func__, fd, (uint32_t)(uintptr_t)buf, (unsigned long)count);
-    return linux_syscall(NR_WRITE, fd, buf, count);
+    bridge_log(LL_TRACE, "%s(%d, %p, %lu)\n", __func__, fd, buf, (unsigned long)count);
+    return linux_syscall(WRITE, fd, buf, count);
 }
 
 int linux_open(const char *path, int flags, int mode) {
     bridge_log(LL_TRACE, "%s(%s, %d, %d)\n", __func__, path, flags, mode);
-    return linux_syscall(NR_OPEN, path, flags, mode);
+    return linux_syscall(OPEN, path, flags, mode);
 }
 
 int linux_close(int fd) {
     bridge_log(LL_TRACE, "%s(%d)\n", __func__, fd);
-    return linux_syscall(NR_CLOSE, fd);
+    return linux_syscall(CLOSE, fd);
 }
 
 int linux_socket(int domain, int type, int protocol) {
     bridge_log(LL_TRACE, "%s(%d, %d, %d)\n", __func__, domain, type, protocol);
-    uint32_t args[] = { domain, type, protocol };
-    return linux_syscall(NR_SOCKETCALL, SC_SOCKET, args);
+    return linux_syscall(SOCKET, domain, type, protocol);
 }
 
 int linux_connect(int socket, sockaddr *address, size_t address_len) {
-    bridge_log(LL_TRACE, "%s(%d, 0x%08X, %lu)\n", __func__, socket, (uint32_t)(uintptr_t)address, (unsigned long)address_len);
-    uint32_t args[] = { socket, (uintptr_t)address, address_len };
-    return linux_syscall(NR_SOCKETCALL, SC_CONNECT, args);
+    bridge_log(LL_TRACE, "%s(%d, %p, %lu)\n", __func__, socket, (void*)address, (unsigned long)address_len);
+    return linux_syscall(CONNECT, socket, address, address_len);
+}
+
+ssize_t linux_readv(int fd, const iovec *iov, int iovcnt) {
+    bridge_log(LL_TRACE, "%s(%d, %p, %d)\n", __func__, fd, (void*)iov, iovcnt);
+    return linux_syscall(READV, fd, iov, iovcnt);
+}
+
+ssize_t linux_writev(int fd, const iovec *iov, int iovcnt) {
+    bridge_log(LL_TRACE, "%s(%d, %p, %d)\n", __func__, fd, (void*)iov, iovcnt);
+    return linux_syscall(WRITEV, fd, iov, iovcnt);
+}
+
+ssize_t linux_sendmsg(int socket, const msghdr *msg, int flags) {
+    bridge_log(LL_TRACE, "%s(%d, %p, %d)\n", __func__, socket, (void*)msg, flags);
+    return linux_syscall(SENDMSG, socket, msg, flags);
+}
+
+ssize_t linux_recvmsg(int socket, msghdr *msg, int flags) {
+    bridge_log(LL_TRACE, "%s(%d, %p, %d)\n", __func__, socket, (void*)msg, flags);
+    return linux_syscall(RECVMSG, socket, msg, flags);
 }
 
-void *linux_mmap2(void *addr, size_t len, int prot, int flags, int fd) {
-    bridge_log(LL_TRACE, "%s(0x%08X, %lu, %d, %d, %d)\n", __func__, (uint32_t)(uintptr_t)addr, (unsigned long)len, prot, flags, fd);
-    return (void*)(uintptr_t)linux_syscall(NR_MMAP2, addr, len, prot, flags, fd);
+// mmap2 on i386 and mmap on x86_64 only differ in the unit of the offset, taken here in pages as mmap2 does
+void *linux_mmap2(void *addr, size_t len, int prot, int flags, int fd, size_t pgoff) {
+    bridge_log(LL_TRACE, "%s(%p, %lu, %d, %d, %d, %lu)\n", __func__, addr, (unsigned long)len, prot, flags, fd,
+               (unsigned long)pgoff);
+#if defined(__x86_64__)
+    return (void*)linux_syscall(MMAP, addr, len, prot, flags, fd, pgoff * LINUX_PAGE_SIZE);
+#else
+    return (void*)linux_syscall(MMAP, addr, len, prot, flags, fd, pgoff);
+#endif
 }
 
 int linux_munmap(void *addr, size_t len) {
-    bridge_log(LL_TRACE, "%s(0x%08X, %lu)\n", __func__, (uint32_t)(uintptr_t)addr, (unsigned long)len);
-    return linux_syscall(NR_MUNMAP, addr, len);
+    bridge_log(LL_TRACE, "%s(%p, %lu)\n", __func__, addr, (unsigned long)len);
+    return linux_syscall(MUNMAP, addr, len);
+}
+
+int linux_epoll_create1(int flags) {
+    bridge_log(LL_TRACE, "%s(%d)\n", __func__, flags);
+    return linux_syscall(EPOLL_CREATE1, flags);
+}
+
+int linux_epoll_ctl(int epfd, int op, int fd, epoll_event *event) {
+    bridge_log(LL_TRACE, "%s(%d, %d, %d, %p)\n", __func__, epfd, op, fd, (void*)event);
+    return linux_syscall(EPOLL_CTL, epfd, op, fd, event);
+}
+
+int linux_epoll_wait(int epfd, epoll_event *events, int maxevents, int timeout) {
+    bridge_log(LL_TRACE, "%s(%d, %p, %d, %d)\n", __func__, epfd, (void*)events, maxevents, timeout);
+    return linux_syscall(EPOLL_WAIT, epfd, events, maxevents, timeout);
+}
+
+int linux_getdents64(int fd, void *dirp, size_t count) {
+    bridge_log(LL_TRACE, "%s(%d, %p, %lu)\n", __func__, fd, dirp, (unsigned long)count);
+    return linux_syscall(GETDENTS64, fd, dirp, count);
+}
+
+int linux_inotify_init1(int flags) {
+    bridge_log(LL_TRACE, "%s(%d)\n", __func__, flags);
+    return linux_syscall(INOTIFY_INIT1, flags);
+}
+
+int linux_inotify_add_watch(int fd, const char *path, uint32_t mask) {
+    bridge_log(LL_TRACE, "%s(%d, %s, 0x%08X)\n", __func__, fd, path, mask);
+    return linux_syscall(INOTIFY_ADD_WATCH, fd, path, mask);
+}
+
+int linux_ftruncate(int fd, size_t length) {
+    bridge_log(LL_TRACE, "%s(%d, %lu)\n", __func__, fd, (unsigned long)length);
+    return linux_syscall(FTRUNCATE, fd, length);
+}
+
+int linux_unlink(const char *path) {
+    bridge_log(LL_TRACE, "%s(%s)\n", __func__, path);
+    return linux_syscall(UNLINK, path);
+}
+
+ssize_t linux_readlink(const char *path, char *buf, size_t size) {
+    bridge_log(LL_TRACE, "%s(%s, %p, %lu)\n", __func__, path, (void*)buf, (unsigned long)size);
+    return linux_syscall(READLINK, path, buf, size);
 }
 
+// i386's futex takes the 32-bit timespec, which is what linux_timespec is there
+int linux_futex(uint32_t *uaddr, int op, uint32_t val, const linux_timespec *timeout) {
+    bridge_log(LL_TRACE, "%s(%p, %d, %u, %p)\n", __func__, (void*)uaddr, op, val, (void*)timeout);
+    return linux_syscall(FUTEX, uaddr, op, val, timeout);
+}
@@ -0,0 +1,693 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// Native side of split mode, see bridge/ring.h
+// Serves the ring files bridges create next to the Discord sockets: connects a channel to Discord when the
+// bridge asks, then moves bytes between the socket and the channel's rings. Everything it waits on is an
+// io_uring operation, futex waits on the bridges' wake words included, so one thread serves every bridge on
+// the host and a round of work costs a single io_uring_enter() however many channels it touched.
+// Needs Linux 6.7 for IORING_OP_FUTEX_WAIT. Bridges without a companion connect to Discord directly.
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "bridge/ring.h"
+#include "bridge/discovery.h"
+#include "bridge/log.h"
+
+#define MAX_BRIDGES     16
+#define QUEUE_DEPTH     256
+#define SWEEP_SEC       2           // How often bridges are checked for having died without closing their file
+
+// Linux 6.7, older uapi headers don't have them
+#define OP_FUTEX_WAIT   51
+#define OP_FUTEX_WAKE   52
+#define FUTEX2_SIZE_U32 0x02
+
+// What a completion is about, with the bridge and channel in the bits above
+enum op {
+    OP_WAIT,            // On the bridge's companion_wake
+    OP_WOKE,            // Wakeup of the bridge's ring_wait()
+    OP_CANCEL,
+    OP_SEND,
+    OP_RECV,
+    OP_CONNECT,
+    OP_NOTIFY,          // inotify read on the runtime directory
+    OP_SWEEP            // Timeout
+};
+
+#define USER_DATA(op, bridge, channel)  ((uint64_t)(op) | (uint64_t)(channel) << 8 | (uint64_t)(bridge) << 16)
+
+struct channel {
+    int     fd;                         // Discord socket, -1 without one
+    int     connecting;                 // Operations in flight on it
+    int     sending;
+    int     receiving;
+    int     shut;                       // Shut down or cancelled to flush them out, closed once they're done
+    int     candidate;                  // Index of the Discord socket being connected to, see discovery_path()
+    int     error;                      // Of the last candidate that failed
+    struct sockaddr_un address;         // Read by the connect in flight
+};
+
+struct bridge {
+    struct ring_block  *block;          // NULL when the entry is free
+    char                name[64];       // Of the file, under the runtime directory
+    int                 inflight;       // Operations referring to the mapping, it outlives them
+    int                 releasing;
+    int                 wake_bridge;    // The bridge has news, woken once at the end of the round
+    struct channel      channels[RING_CHANNELS];
+};
+
+static struct {
+    int                     fd;
+    unsigned                entries;
+    unsigned               *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned               *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe    *sqes;
+    struct io_uring_cqe    *cqes;
+    unsigned                pending;    // Queued since the last io_uring_enter()
+} uring;
+
+static struct bridge bridges[MAX_BRIDGES];
+static int notify_fd = -1;
+static char notify_buf[4096] __attribute__((aligned(8)));
+static struct __kernel_timespec sweep_interval = { .tv_sec = SWEEP_SEC };
+static volatile sig_atomic_t quit;
+
+enum log_level g_log_level = LL_ERROR;
+
+static void on_signal(int signum) {
+    (void)signum;
+    quit = 1;
+}
+
+static int uring_enter(unsigned wait) {
+    int ret = (int)syscall(SYS_io_uring_enter, uring.fd, uring.pending, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret >= 0) uring.pending = 0;
+    return ret < 0 ? -errno : ret;
+}
+
+static int uring_init(void) {
+    struct io_uring_params params;
+
+    // Completions are only ever reaped by this thread, which lets the kernel defer its work until then
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+
+    if ((uring.fd = (int)syscall(SYS_io_uring_setup, QUEUE_DEPTH, &params)) < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        uring.fd = (int)syscall(SYS_io_uring_setup, QUEUE_DEPTH, &params);
+    }
+
+    if (uring.fd < 0) return -errno;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t size = sq_size > cq_size ? sq_size : cq_size;
+
+    // Every kernel with the futex operations maps both rings at once, IORING_FEAT_SINGLE_MMAP
+    char *rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    uring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+
+    if (rings == MAP_FAILED || uring.sqes == MAP_FAILED) return -errno;
+
+    uring.entries  = params.sq_entries;
+    uring.sq_head  = (unsigned*)(rings + params.sq_off.head);
+    uring.sq_tail  = (unsigned*)(rings + params.sq_off.tail);
+    uring.sq_mask  = (unsigned*)(rings + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned*)(rings + params.sq_off.array);
+    uring.cq_head  = (unsigned*)(rings + params.cq_off.head);
+    uring.cq_tail  = (unsigned*)(rings + params.cq_off.tail);
+    uring.cq_mask  = (unsigned*)(rings + params.cq_off.ring_mask);
+    uring.cqes     = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+    return 0;
+}
+
+// Next free submission, handing the queued ones to the kernel first when they fill the ring
+static struct io_uring_sqe *sqe_get(uint64_t user_data) {
+    unsigned tail = *uring.sq_tail;
+
+    if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) == uring.entries) {
+        (void)uring_enter(0);
+        tail = *uring.sq_tail;
+    }
+
+    unsigned index = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    uring.sq_array[index] = index;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring.pending++;
+    return sqe;
+}
+
+static void futex_op(struct bridge *bridge, enum op op, uint32_t *word, uint64_t value) {
+    int id = (int)(bridge - bridges);
+    struct io_uring_sqe *sqe = sqe_get(USER_DATA(op, id, 0));
+
+    // Not FUTEX2_PRIVATE, the bridge is another process mapping the same file
+    sqe->opcode = op == OP_WAIT ? OP_FUTEX_WAIT : OP_FUTEX_WAKE;
+    sqe->addr   = (uintptr_t)word;
+    sqe->off    = value;                // addr2: expected value to wait, how many to wake
+    sqe->addr3  = FUTEX_BITSET_MATCH_ANY;
+    sqe->fd     = FUTEX2_SIZE_U32;
+    bridge->inflight++;
+}
+
+static void notify_bridge(struct bridge *bridge, int id) {
+    (void)__atomic_or_fetch(&bridge->block->ready, 1u << id, __ATOMIC_SEQ_CST);
+    (void)__atomic_add_fetch(&bridge->block->bridge_wake, 1, __ATOMIC_SEQ_CST);
+    bridge->wake_bridge = 1;
+}
+
+// Answers ring_connect() and ring_close(), the bridge calls ring_connect() again once it sees the channel
+// From RING_CONNECT only if the bridge didn't close the channel meanwhile, which then comes next
+static int state_set(struct bridge *bridge, int id, uint32_t from, uint32_t state) {
+    if (!__atomic_compare_exchange_n(&bridge->block->channels[id].state, &from, state, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return 0;
+
+    notify_bridge(bridge, id);
+    return 1;
+}
+
+// Channels go straight to Discord, never to the hub, which would only hand them on to Discord itself
+// Connects to the channel's next candidate on the ring, or reports the channel failed once there are none left
+static void channel_connect(struct bridge *bridge, int id) {
+    struct ring_channel *ring_channel = &bridge->block->channels[id];
+    struct channel *channel = &bridge->channels[id];
+    int fd = -ENOENT;
+
+    memset(&channel->address, 0, sizeof(channel->address));
+    channel->address.sun_family = AF_UNIX;
+
+    // io_uring waits for readiness itself on a blocking socket, a non-blocking one would complete with EAGAIN
+    if (discovery_path(channel->candidate, channel->address.sun_path, sizeof(channel->address.sun_path)) == 0 &&
+        (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        fd = -errno;
+
+    if (fd < 0) {
+        ring_channel->error = channel->error < 0 ? channel->error : fd;
+        (void)state_set(bridge, id, RING_CONNECT, RING_FAILED);
+        return;
+    }
+
+    struct io_uring_sqe *sqe = sqe_get(USER_DATA(OP_CONNECT, bridge - bridges, id));
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd     = fd;
+    sqe->addr   = (uintptr_t)&channel->address;
+    sqe->off    = sizeof(channel->address);     // addr2: the address length
+    channel->fd = fd;
+    channel->connecting = 1;
+    bridge->inflight++;
+}
+
+static void channel_connected(struct bridge *bridge, int id, int error) {
+    struct ring_channel *ring_channel = &bridge->block->channels[id];
+    struct channel *channel = &bridge->channels[id];
+
+    channel->connecting = 0;
+
+    // Closed meanwhile, what comes next deals with the socket
+    if (__atomic_load_n(&ring_channel->state, __ATOMIC_ACQUIRE) != RING_CONNECT || bridge->releasing) return;
+
+    if (error < 0) {
+        bridge_log(LL_DEBUG, "Failed to connect to \"%s\": %s.\n", channel->address.sun_path, strerror(-error));
+        close(channel->fd);
+        channel->fd = -1;
+        channel->error = error;
+        channel->candidate++;
+        channel_connect(bridge, id);
+        return;
+    }
+
+    if (channel->candidate > 0) discovery_found(channel->address.sun_path);
+
+    // Whatever the last connection left behind is gone with it, the bridge isn't touching the rings meanwhile
+    memset(&ring_channel->to_discord, 0, offsetof(struct ring, data));
+    memset(&ring_channel->to_client, 0, offsetof(struct ring, data));
+    ring_channel->error = 0;
+
+    if (state_set(bridge, id, RING_CONNECT, RING_OPEN))
+        bridge_log(LL_DEBUG, "Connected channel %d of bridge %u to Discord.\n", id, bridge->block->bridge_pid);
+}
+
+static void channel_hangup(struct bridge *bridge, int id, int error) {
+    struct ring_channel *ring_channel = &bridge->block->channels[id];
+    uint32_t open = RING_OPEN;
+
+    if (__atomic_load_n(&ring_channel->state, __ATOMIC_ACQUIRE) != RING_OPEN) return;
+
+    // A close from the bridge wins over the hangup
+    ring_channel->error = error;
+    if (__atomic_compare_exchange_n(&ring_channel->state, &open, RING_HANGUP, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        notify_bridge(bridge, id);
+}
+
+// Does whatever the channel's state and rings call for
+static void channel_serve(struct bridge *bridge, int id) {
+    struct ring_channel *ring_channel = &bridge->block->channels[id];
+    struct channel *channel = &bridge->channels[id];
+    uint32_t state = __atomic_load_n(&ring_channel->state, __ATOMIC_ACQUIRE);
+
+    if (bridge->releasing && channel->fd >= 0) state = RING_CLOSE;
+
+    switch (state) {
+        case RING_CONNECT:
+            // Answered once the connect completes
+            if (channel->fd < 0) {
+                channel->candidate = 0;
+                channel->error = 0;
+                channel_connect(bridge, id);
+            }
+            return;
+        case RING_OPEN:
+            // Connected by a companion before this one
+            if (channel->fd < 0) {
+                channel_hangup(bridge, id, -EPIPE);
+                return;
+            }
+            break;
+        case RING_HANGUP:
+        case RING_CLOSE:
+            // Operations in flight hold the socket, shutting it down makes them finish, a connect is cancelled
+            if (channel->fd >= 0 && (channel->connecting || channel->sending || channel->receiving)) {
+                if (!channel->shut && channel->connecting) {
+                    struct io_uring_sqe *sqe = sqe_get(USER_DATA(OP_CANCEL, bridge - bridges, id));
+                    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                    sqe->addr   = USER_DATA(OP_CONNECT, bridge - bridges, id);
+                    bridge->inflight++;
+                } else if (!channel->shut) {
+                    (void)shutdown(channel->fd, SHUT_RDWR);
+                }
+                channel->shut = 1;
+                return;
+            }
+
+            if (channel->fd >= 0) close(channel->fd);
+            channel->fd = -1;
+            channel->shut = 0;
+
+            if (state == RING_CLOSE && !bridge->releasing) (void)state_set(bridge, id, RING_CLOSE, RING_IDLE);
+            return;
+        default:
+            return;
+    }
+
+    struct ring *out = &ring_channel->to_discord, *in = &ring_channel->to_client;
+
+    if (!channel->sending) {
+        uint32_t tail = out->tail;
+        uint32_t length = __atomic_load_n(&out->head, __ATOMIC_SEQ_CST) - tail;
+        uint32_t off = tail & (RING_BYTES - 1);
+
+        // Up to where the ring wraps, the rest goes next time
+        if (length > 0) {
+            struct io_uring_sqe *sqe = sqe_get(USER_DATA(OP_SEND, bridge - bridges, id));
+            sqe->opcode    = IORING_OP_SEND;
+            sqe->fd        = channel->fd;
+            sqe->addr      = (uintptr_t)(out->data + off);
+            sqe->len       = length < RING_BYTES - off ? length : RING_BYTES - off;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            channel->sending = 1;
+            bridge->inflight++;
+        }
+    }
+
+    if (!channel->receiving) {
+        uint32_t head = in->head;
+        uint32_t room = RING_BYTES - (head - __atomic_load_n(&in->tail, __ATOMIC_SEQ_CST));
+        uint32_t off = head & (RING_BYTES - 1);
+
+        // Asks to be woken before looking again, so room the bridge makes in between isn't missed
+        if (room == 0) {
+            __atomic_store_n(&in->full, 1, __ATOMIC_SEQ_CST);
+            room = RING_BYTES - (head - __atomic_load_n(&in->tail, __ATOMIC_SEQ_CST));
+        }
+
+        if (room > 0) {
+            struct io_uring_sqe *sqe = sqe_get(USER_DATA(OP_RECV, bridge - bridges, id));
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd     = channel->fd;
+            sqe->addr   = (uintptr_t)(in->data + off);
+            sqe->len    = room < RING_BYTES - off ? room : RING_BYTES - off;
+            channel->receiving = 1;
+            bridge->inflight++;
+        }
+    }
+}
+
+// The bridge woke us, or the last wait was cut short; look at every channel and wait again
+static void bridge_serve(struct bridge *bridge) {
+    struct ring_block *block = bridge->block;
+
+    // Read ahead of looking, a wakeup after this makes the next wait return at once
+    uint32_t wake = __atomic_load_n(&block->companion_wake, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&block->closing, __ATOMIC_ACQUIRE))
+        bridge->releasing = 1;
+
+    for (int id = 0; id < RING_CHANNELS; id++)
+        if (bridge->channels[id].fd >= 0 || block->channels[id].state != RING_IDLE)
+            channel_serve(bridge, id);
+
+    if (!bridge->releasing)
+        futex_op(bridge, OP_WAIT, &block->companion_wake, wake);
+}
+
+// Announces the wait ahead, then looks at the rings once more: the bridge either sees the announcement and wakes
+// us, or published early enough to be seen here
+static void bridge_doze(struct bridge *bridge) {
+    __atomic_store_n(&bridge->block->companion_asleep, 1, __ATOMIC_SEQ_CST);
+
+    for (int id = 0; id < RING_CHANNELS; id++) {
+        struct channel *channel = &bridge->channels[id];
+        if (channel->fd >= 0 && !channel->connecting && !(channel->sending && channel->receiving))
+            channel_serve(bridge, id);
+    }
+}
+
+static void bridge_adopt(const char *name) {
+    struct bridge *bridge = NULL;
+    char path[PATH_MAX];
+    struct stat st;
+
+    for (int i = 0; i < MAX_BRIDGES; i++) {
+        if (bridges[i].block != NULL && strcmp(bridges[i].name, name) == 0) return;
+        if (bridges[i].block == NULL && bridge == NULL) bridge = &bridges[i];
+    }
+
+    if (bridge == NULL) {
+        bridge_log(LL_WARNING, "Already serving %d bridges, leaving \"%s\" alone.\n", MAX_BRIDGES, name);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", get_sock_parent_path(), name);
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return;
+
+    struct ring_block *block = fstat(fd, &st) == 0 && (size_t)st.st_size == sizeof(*block) ?
+        mmap(NULL, sizeof(*block), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if (block == MAP_FAILED) return;
+
+    uint32_t companion_pid = __atomic_load_n(&block->companion_pid, __ATOMIC_ACQUIRE);
+
+    // Unfinished, from another build, or in good hands already
+    if (__atomic_load_n(&block->magic, __ATOMIC_ACQUIRE) != RING_MAGIC || block->version != RING_VERSION ||
+        block->size != sizeof(*block) || block->closing || (companion_pid != 0 && kill((pid_t)companion_pid, 0) == 0)) {
+        munmap(block, sizeof(*block));
+        return;
+    }
+
+    memset(bridge, 0, sizeof(*bridge));
+    snprintf(bridge->name, sizeof(bridge->name), "%s", name);
+    bridge->block = block;
+
+    for (int id = 0; id < RING_CHANNELS; id++)
+        bridge->channels[id].fd = -1;
+
+    __atomic_store_n(&block->companion_pid, (uint32_t)getpid(), __ATOMIC_RELEASE);
+    bridge_log(LL_INFO, "Serving bridge %u.\n", block->bridge_pid);
+    bridge_serve(bridge);
+}
+
+// Closes everything and waits for what's in flight before letting go of the mapping
+static void bridge_release(struct bridge *bridge) {
+    int id = (int)(bridge - bridges);
+
+    if (!bridge->releasing) {
+        bridge->releasing = 1;
+        struct io_uring_sqe *sqe = sqe_get(USER_DATA(OP_CANCEL, id, 0));
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr   = USER_DATA(OP_WAIT, id, 0);
+        bridge->inflight++;
+    }
+
+    for (int channel = 0; channel < RING_CHANNELS; channel++)
+        if (bridge->channels[channel].fd >= 0)
+            channel_serve(bridge, channel);
+
+    if (bridge->inflight > 0) return;
+
+    bridge_log(LL_INFO, "Done serving bridge %u.\n", bridge->block->bridge_pid);
+    munmap(bridge->block, sizeof(*bridge->block));
+    bridge->block = NULL;
+}
+
+static void notify_arm(void) {
+    struct io_uring_sqe *sqe = sqe_get(USER_DATA(OP_NOTIFY, 0, 0));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd     = notify_fd;
+    sqe->addr   = (uintptr_t)notify_buf;
+    sqe->len    = sizeof(notify_buf);
+}
+
+static void sweep_arm(void) {
+    struct io_uring_sqe *sqe = sqe_get(USER_DATA(OP_SWEEP, 0, 0));
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr   = (uintptr_t)&sweep_interval;
+    sqe->len    = 1;
+}
+
+static void complete(const struct io_uring_cqe *cqe) {
+    enum op op = (enum op)(cqe->user_data & 0xFF);
+    int id = (int)(cqe->user_data >> 8 & 0xFF);
+    struct bridge *bridge = &bridges[cqe->user_data >> 16];
+    struct channel *channel = &bridge->channels[id];
+    int res = cqe->res;
+
+    switch (op) {
+        case OP_NOTIFY:
+            for (int off = 0; res > 0 && off < res; ) {
+                const struct inotify_event *event = (const struct inotify_event*)(notify_buf + off);
+                if (event->len > 0 && strncmp(event->name, RING_PREFIX, strlen(RING_PREFIX)) == 0)
+                    bridge_adopt(event->name);
+                off += sizeof(*event) + event->len;
+            }
+            notify_arm();
+            return;
+        case OP_SWEEP:
+            for (int i = 0; i < MAX_BRIDGES; i++)
+                if (bridges[i].block != NULL && !bridges[i].releasing &&
+                    kill((pid_t)bridges[i].block->bridge_pid, 0) < 0 && errno == ESRCH)
+                    bridge_release(&bridges[i]);
+            sweep_arm();
+            return;
+        default:
+            break;
+    }
+
+    bridge->inflight--;
+
+    switch (op) {
+        case OP_CONNECT:
+            channel_connected(bridge, id, res);
+            break;
+        case OP_WAIT:
+            // Woken, or the word had moved on already; cancelled ones belong to a release
+            if (res != -ECANCELED && !bridge->releasing) bridge_serve(bridge);
+            break;
+        case OP_SEND:
+            channel->sending = 0;
+
+            if (res < 0) {
+                channel_hangup(bridge, id, res);
+                break;
+            }
+
+            struct ring *out = &bridge->block->channels[id].to_discord;
+            __atomic_store_n(&out->tail, out->tail + res, __ATOMIC_SEQ_CST);
+
+            // The bridge ran out of room and waits to be told there's some again
+            if (__atomic_load_n(&out->full, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&out->full, 0, __ATOMIC_SEQ_CST))
+                notify_bridge(bridge, id);
+            break;
+        case OP_RECV: {
+            struct ring *in = &bridge->block->channels[id].to_client;
+            channel->receiving = 0;
+
+            if (res <= 0) {
+                channel_hangup(bridge, id, res);
+                break;
+            }
+
+            uint32_t head = in->head;
+            __atomic_store_n(&in->head, head + res, __ATOMIC_SEQ_CST);
+
+            // The bridge had read everything, so it's waiting for this
+            if (__atomic_load_n(&in->tail, __ATOMIC_SEQ_CST) == head)
+                notify_bridge(bridge, id);
+            break;
+        }
+        default:
+            break;
+    }
+
+    if (op == OP_CONNECT || op == OP_SEND || op == OP_RECV)
+        channel_serve(bridge, id);
+
+    if (bridge->releasing)
+        bridge_release(bridge);
+}
+
+// Checks the kernel has IORING_OP_FUTEX_WAIT: a wait on a word that doesn't match fails with EAGAIN
+static int futex_probe(void) {
+    static uint32_t word = 1;
+    struct io_uring_sqe *sqe = sqe_get(USER_DATA(OP_WAIT, 0, 0));
+
+    sqe->opcode = OP_FUTEX_WAIT;
+    sqe->addr   = (uintptr_t)&word;
+    sqe->off    = 0;
+    sqe->addr3  = FUTEX_BITSET_MATCH_ANY;
+    sqe->fd     = FUTEX2_SIZE_U32;
+
+    if (uring_enter(1) < 0) return 0;
+
+    unsigned head = *uring.cq_head;
+    int res = uring.cqes[head & *uring.cq_mask].res;
+    __atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
+    return res == -EAGAIN;
+}
+
+int main(int argc, char *argv[]) {
+    int opt, error;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+            case 'v': g_log_level = g_log_level < LL_TRACE ? g_log_level + 1 : LL_TRACE; break;
+            default:
+                fprintf(stderr, "Usage: winerpc-companion [-v...]\n");
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ((error = uring_init()) < 0) {
+        fprintf(stderr, "Failed to set up io_uring: %s.\n", strerror(-error));
+        return EXIT_FAILURE;
+    }
+
+    if (!futex_probe()) {
+        fprintf(stderr, "This kernel can't wait on futexes through io_uring, Linux 6.7 or later is needed.\n");
+        return EXIT_FAILURE;
+    }
+
+    const char *dir = get_sock_parent_path();
+
+    if ((notify_fd = inotify_init1(IN_CLOEXEC)) < 0 || inotify_add_watch(notify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "Failed to watch \"%s\": %s.\n", dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction action = { .sa_handler = on_signal };
+    (void)sigaction(SIGINT, &action, NULL);
+    (void)sigaction(SIGTERM, &action, NULL);
+
+    notify_arm();
+    sweep_arm();
+
+    // Bridges that were there first
+    DIR *listing = opendir(dir);
+    struct dirent *entry;
+
+    while (listing != NULL && (entry = readdir(listing)) != NULL)
+        if (strncmp(entry->d_name, RING_PREFIX, strlen(RING_PREFIX)) == 0)
+            bridge_adopt(entry->d_name);
+    if (listing != NULL) closedir(listing);
+
+    bridge_log(LL_INFO, "Waiting for bridges in \"%s\".\n", dir);
+
+    while (!quit) {
+        for (int i = 0; i < MAX_BRIDGES; i++)
+            if (bridges[i].block != NULL && !bridges[i].releasing)
+                bridge_doze(&bridges[i]);
+
+        // A bridge that isn't blocked in ring_wait() picks the news up on its own
+        for (int i = 0; i < MAX_BRIDGES; i++) {
+            if (bridges[i].block == NULL || !bridges[i].wake_bridge) continue;
+            if (__atomic_load_n(&bridges[i].block->bridge_asleep, __ATOMIC_SEQ_CST))
+                futex_op(&bridges[i], OP_WOKE, &bridges[i].block->bridge_wake, 1);
+            bridges[i].wake_bridge = 0;
+        }
+
+        if ((error = uring_enter(1)) < 0 && error != -EINTR) {
+            bridge_log(LL_ERROR, "Failed to wait for completions: %s.\n", strerror(-error));
+            break;
+        }
+
+        // Busy until the next doze, the bridges needn't wake us meanwhile
+        for (int i = 0; i < MAX_BRIDGES; i++)
+            if (bridges[i].block != NULL)
+                __atomic_store_n(&bridges[i].block->companion_asleep, 0, __ATOMIC_SEQ_CST);
+
+        unsigned head = *uring.cq_head;
+        unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe cqe = uring.cqes[head & *uring.cq_mask];
+            __atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
+            complete(&cqe);
+        }
+    }
+
+    // Bridges see their connections hang up and go on directly, the kernel cleans up the rest
+    for (int i = 0; i < MAX_BRIDGES; i++) {
+        struct ring_block *block = bridges[i].block;
+        if (block == NULL) continue;
+
+        __atomic_store_n(&block->companion_pid, 0, __ATOMIC_RELEASE);
+
+        // Connects that are still asked for get their answer from ring_connect() once it sees the channel
+        for (int id = 0; id < RING_CHANNELS; id++) {
+            if (bridges[i].channels[id].fd >= 0 && !bridges[i].channels[id].connecting)
+                channel_hangup(&bridges[i], id, -EPIPE);
+            else if (__atomic_load_n(&block->channels[id].state, __ATOMIC_ACQUIRE) == RING_CONNECT)
+                notify_bridge(&bridges[i], id);
+        }
+
+        (void)syscall(SYS_futex, &block->bridge_wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+
+    return EXIT_SUCCESS;
+}
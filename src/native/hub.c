@@ -0,0 +1,311 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// Presence hub for hosts running many Wine prefixes at once, see README
+// Bridges that find <runtime dir>/winerpc-hub hand their RPC clients to it instead of finding Discord themselves,
+// so discovery and its watches happen once per host. Discord still needs a connection per client, since that
+// is what an activity belongs to, but it only ever shows one: when several games set one at once, the hub
+// lets through the one from the prefix with the highest priority, then the one that updated last, and holds
+// back the others until it clears. Priorities are given per prefix, read from the bridge's WINEPREFIX.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "native/posix.h"
+#include "bridge/relay.h"
+#include "bridge/discovery.h"
+#include "bridge/stats.h"
+#include "bridge/trace.h"
+#include "bridge/log.h"
+
+#define MAX_PREFIXES    16
+#define ENVIRON_SIZE    32768   // Of a bridge process, WINEPREFIX is set by whoever started it and comes early
+
+struct prefix {
+    char    path[256];
+    int     priority;
+};
+
+static struct prefix prefixes[MAX_PREFIXES];
+static int prefix_count;
+static int priorities[POSIX_MAX_CLIENTS];
+static struct relay *shown;
+static int volatile stop_requested;
+
+enum log_level g_log_level = LL_ERROR;
+
+static void on_signal(int signum) {
+    (void)signum;
+    stop_requested = 1;
+}
+
+// Trailing slashes don't make a different prefix
+static void trim_path(char *path) {
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/')
+        path[--length] = '\0';
+}
+
+static int add_prefix(const char *arg) {
+    const char *separator = strrchr(arg, '=');
+    if (separator == NULL || separator == arg || prefix_count == MAX_PREFIXES) return -1;
+
+    struct prefix *prefix = &prefixes[prefix_count];
+    if ((size_t)(separator - arg) >= sizeof(prefix->path)) return -1;
+
+    memcpy(prefix->path, arg, separator - arg);
+    prefix->path[separator - arg] = '\0';
+    trim_path(prefix->path);
+    prefix->priority = atoi(separator + 1);
+    prefix_count++;
+    return 0;
+}
+
+// The Wine prefix of the process on the other end, Wine's default when it was started without WINEPREFIX
+static int peer_prefix(int fd, char *path, size_t size) {
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    char env_path[64], *env = NULL;
+    int ret = -1;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) return -1;
+
+    snprintf(env_path, sizeof(env_path), "/proc/%d/environ", (int)cred.pid);
+    int env_fd = open(env_path, O_RDONLY | O_CLOEXEC);
+    if (env_fd < 0) return -1;
+
+    if ((env = malloc(ENVIRON_SIZE)) == NULL) goto done;
+
+    ssize_t length = read(env_fd, env, ENVIRON_SIZE - 1);
+    if (length < 0) goto done;
+    env[length] = '\0';
+
+    const char *home = NULL;
+
+    // NUL separated, the last entry is terminated by the one added above
+    for (const char *entry = env; entry < env + length; entry += strlen(entry) + 1) {
+        if (strncmp(entry, "WINEPREFIX=", 11) == 0) {
+            snprintf(path, size, "%s", entry + 11);
+            ret = 0;
+            goto done;
+        }
+
+        if (strncmp(entry, "HOME=", 5) == 0)
+            home = entry + 5;
+    }
+
+    if (home != NULL) {
+        snprintf(path, size, "%s/.wine", home);
+        ret = 0;
+    }
+
+done:
+    if (ret == 0) trim_path(path);
+    free(env);
+    close(env_fd);
+    return ret;
+}
+
+static int peer_priority(int fd) {
+    char path[256];
+
+    if (peer_prefix(fd, path, sizeof(path)) < 0) {
+        bridge_log(LL_WARNING, "Failed to find the prefix of a bridge, it gets the default priority.\n");
+        return 0;
+    }
+
+    for (int i = 0; i < prefix_count; i++) {
+        if (strcmp(prefixes[i].path, path) == 0) {
+            bridge_log(LL_INFO, "Bridge from \"%s\" has priority %d.\n", path, prefixes[i].priority);
+            return prefixes[i].priority;
+        }
+    }
+
+    bridge_log(LL_INFO, "Bridge from \"%s\" has the default priority.\n", path);
+    return 0;
+}
+
+static void accept_bridges(int listen_fd) {
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int priority = peer_priority(fd);
+        int id = posix_relay_add(fd);
+
+        if (id < 0) {
+            close(fd);
+            continue;
+        }
+
+        // Nothing was read from it yet, so nothing got through before arbitrate() had its say
+        struct relay *relay = posix_relay_get(id);
+        if (relay != NULL)
+            relay_mute(relay, 1);
+        priorities[id] = priority;
+    }
+
+    if (errno != EAGAIN && errno != EINTR)
+        bridge_log(LL_ERROR, "Failed to accept bridge: %s.\n", strerror(errno));
+}
+
+// Unmutes the client whose activity Discord should show and mutes every other one
+static void arbitrate(void) {
+    struct relay *best = NULL;
+    int best_priority = 0;
+
+    for (int id = 0; id < POSIX_MAX_CLIENTS; id++) {
+        struct relay *relay = posix_relay_get(id);
+        if (relay == NULL || relay->activity_at == 0) continue;
+
+        if (best == NULL || priorities[id] > best_priority ||
+            (priorities[id] == best_priority && relay->activity_at > best->activity_at)) {
+            best = relay;
+            best_priority = priorities[id];
+        }
+    }
+
+    if (best == shown) return;
+
+    // Muting first, so Discord never has two activities at once
+    for (int id = 0; id < POSIX_MAX_CLIENTS; id++) {
+        struct relay *relay = posix_relay_get(id);
+        if (relay != NULL && relay != best)
+            relay_mute(relay, 1);
+    }
+
+    if (best != NULL) {
+        bridge_log(LL_INFO, "Showing the activity of client %d.\n", best->id);
+        relay_mute(best, 0);
+    }
+
+    shown = best;
+}
+
+static int listen_hub(char *path, size_t size) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/" HUB_NAME, get_sock_parent_path());
+    snprintf(path, size, "%s", addr.sun_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    // A socket nobody answers on is left over from a hub that didn't exit cleanly
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        close(fd);
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    (void)unlink(addr.sun_path);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, POSIX_MAX_CLIENTS) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "priority", required_argument, NULL, 'P' },
+        { "trace",    required_argument, NULL, 't' },
+        { "sample",   required_argument, NULL, 'S' },
+        { "verbose",  no_argument,       NULL, 'v' },
+        { 0,          0,                 0,     0  }
+    };
+    char path[128];
+    const char *trace_path = NULL;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "P:t:S:v", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'P':
+                if (add_prefix(optarg) < 0) {
+                    fprintf(stderr, "Expected PREFIX=PRIORITY, at most %d of them.\n", MAX_PREFIXES);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't': trace_path = optarg; break;
+            case 'S': g_log_sample = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'v': g_log_level = g_log_level < LL_TRACE ? g_log_level + 1 : LL_TRACE; break;
+            default:
+                fprintf(stderr, "Usage: winerpc-hub [-P PREFIX=PRIORITY]... [-t TRACE] [-S N] [-v...]\n");
+                return EXIT_FAILURE;
+        }
+    }
+
+    // Its own connections go to Discord, and only for bridges whose game actually talks to it
+    discovery_prefer_hub(0);
+    posix_relay_on_demand();
+
+    int listen_fd = listen_hub(path, sizeof(path));
+    if (listen_fd < 0) {
+        fprintf(stderr, "Failed to listen on \"%s\": %s.\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction action = { .sa_handler = on_signal };
+    (void)sigaction(SIGINT, &action, NULL);
+    (void)sigaction(SIGTERM, &action, NULL);
+    (void)signal(SIGPIPE, SIG_IGN);
+
+    stats_init();
+    if (trace_path != NULL)
+        trace_open(trace_path);
+
+    posix_relay_watch(listen_fd);
+    bridge_log(LL_INFO, "Serving bridges at \"%s\".\n", path);
+
+    int exit_code = EXIT_SUCCESS;
+
+    while (!stop_requested) {
+        if (posix_relay_poll(-1) < 0) {
+            exit_code = EXIT_FAILURE;
+            break;
+        }
+
+        if (posix_relay_watched())
+            accept_bridges(listen_fd);
+
+        // The shown client may have left, its relay entry freed or taken by a new one
+        if (shown != NULL && (shown->activity_at == 0 || !shown->active))
+            shown = NULL;
+
+        arbitrate();
+    }
+
+    close(listen_fd);
+    (void)unlink(path);
+    trace_close();
+    stats_shutdown();
+    return exit_code;
+}
@@ -0,0 +1,463 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// Native transport for relay.c, see include/native/posix.h
+// The pipe side emulates overlapped I/O: relay.c hands over a buffer, the next poll() round that finds
+// the fd ready does the read or write and reports it back. The socket side is what relay.c expects already.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "native/posix.h"
+#include "bridge/relay.h"
+#include "bridge/ring.h"
+#include "bridge/discovery.h"
+#include "bridge/log.h"
+
+#define RETRY_MS    50      // Discord binds its socket a moment before it listens on it
+#define RETRY_COUNT 20
+
+struct posix_client {
+    int             pipe_fd;            // -1 when the entry is free
+    int             sock_fd;
+    int             waiting;            // For Discord, retried on the discovery watch
+    int             split;              // Connected through the companion, sock_fd stays -1
+    int             connecting;         // Asked the companion for the channel, relay_attach() again once it answers
+    char           *read_buf;           // Handed over by relay.c, valid while relay.read_pending
+    size_t          read_len;
+    const char     *write_buf;          // Same, while relay.write_pending
+    size_t          write_len;
+    struct relay    relay;
+};
+
+static struct posix_client clients[POSIX_MAX_CLIENTS];
+static int active_clients;
+static int failures;
+static int initialized;
+static uint64_t retry_at;
+static int attach_retries;              // Left before waiting clients only wake up on the watch again
+static int discovery_fd = -1;           // See discovery_watch(), set up by the first client that waits
+static int on_demand;                   // See posix_relay_on_demand()
+static int warm_pending;                // A client took the socket connected ahead of time, see discovery_warm()
+static int watch_fd = -1;
+static int watch_ready;
+static int split;                       // See posix_relay_split()
+static int ring_pipe[2] = { -1, -1 };   // ring_thread() pokes the loop through it
+static uint32_t ring_ready;             // Channels ring_wait() reported and the loop hasn't seen yet
+static int loop_idle;                   // In poll(), the only time ring_thread() has to poke it
+
+static int posix_pipe_read(struct relay *relay, char *buf, size_t len);
+static int posix_pipe_write(struct relay *relay, const char *buf, size_t len);
+static int posix_sock_open(struct relay *relay);
+static void posix_sock_close(struct relay *relay);
+static ssize_t posix_sock_send(struct relay *relay, const struct relay_iov *iov, int count);
+static ssize_t posix_sock_recv(struct relay *relay, char *buf, size_t len);
+static void posix_wait(struct relay *relay);
+static void posix_close(struct relay *relay, int failed);
+
+static const struct transport posix_transport = {
+    .pipe_read  = posix_pipe_read,
+    .pipe_write = posix_pipe_write,
+    .sock_open  = posix_sock_open,
+    .sock_close = posix_sock_close,
+    .sock_send  = posix_sock_send,
+    .sock_recv  = posix_sock_recv,
+    .wait       = posix_wait,
+    .close      = posix_close
+};
+
+static void posix_init(void) {
+    if (initialized) return;
+
+    for (int i = 0; i < POSIX_MAX_CLIENTS; i++)
+        clients[i].pipe_fd = -1;
+    metrics_init();
+    initialized = 1;
+}
+
+// Stands in for the bridge's own ring thread: blocks in ring_wait() and hands the news to poll()
+static void *ring_thread(void *unused) {
+    (void)unused;
+
+    while (1) {
+        char poke = 0;
+        (void)__atomic_or_fetch(&ring_ready, ring_wait(), __ATOMIC_SEQ_CST);
+
+        // A busy loop picks the bits up before it polls again
+        if (__atomic_load_n(&loop_idle, __ATOMIC_SEQ_CST) && write(ring_pipe[1], &poke, 1) < 0 && errno != EAGAIN)
+            return NULL;
+    }
+}
+
+int posix_relay_split(void) {
+    pthread_t thread;
+
+    posix_init();
+
+    if (ring_init((uint32_t)getpid()) < 0) return -1;
+
+    if (pipe2(ring_pipe, O_NONBLOCK | O_CLOEXEC) < 0 || pthread_create(&thread, NULL, ring_thread, NULL) != 0) {
+        bridge_log(LL_ERROR, "Failed to start ring thread: %s.\n", strerror(errno));
+        ring_shutdown();
+        return -1;
+    }
+
+    pthread_detach(thread);
+    split = 1;
+    return 0;
+}
+
+void posix_relay_on_demand(void) {
+    posix_init();
+    on_demand = 1;
+    warm_pending = 1;
+}
+
+int posix_relay_add(int pipe_fd) {
+    struct posix_client *client = NULL;
+
+    posix_init();
+
+    for (int i = 0; i < POSIX_MAX_CLIENTS && client == NULL; i++)
+        if (clients[i].pipe_fd < 0)
+            client = &clients[i];
+
+    if (client == NULL) {
+        bridge_log(LL_WARNING, "Client limit reached, refusing RPC client.\n");
+        return -1;
+    }
+
+    int id = (int)(client - clients);
+
+    client->pipe_fd = pipe_fd;
+    client->sock_fd = -1;
+    client->waiting = 0;
+    client->split = 0;
+    client->connecting = 0;
+    active_clients++;
+
+    relay_init(&client->relay, &posix_transport, client, id);
+    client->relay.on_demand = on_demand;
+    relay_start(&client->relay);
+    return id;
+}
+
+static void client_close(struct posix_client *client, int failed) {
+    if (client->sock_fd >= 0)
+        close(client->sock_fd);
+    if (client->split || client->connecting)
+        ring_close(client->relay.id);
+    close(client->pipe_fd);
+
+    relay_free(&client->relay);
+    client->pipe_fd = -1;
+    client->sock_fd = -1;
+    client->split = 0;
+    client->connecting = 0;
+    active_clients--;
+    failures += failed;
+}
+
+// Does what the last round found the pipe ready for, like a completion port would have
+static void pipe_complete(struct posix_client *client, short revents) {
+    if (client->relay.read_pending && (revents & (POLLIN | POLLHUP | POLLERR))) {
+        ssize_t bytes_read = read(client->pipe_fd, client->read_buf, client->read_len);
+
+        if (bytes_read == 0) {
+            bridge_log(LL_WARNING, "Connection closed by RPC client %d.\n", client->relay.id);
+            client_close(client, 0);
+            return;
+        }
+
+        if (bytes_read < 0 && errno != EAGAIN && errno != EINTR) {
+            bridge_log(LL_ERROR, "Failed to read from RPC client %d: %s.\n", client->relay.id, strerror(errno));
+            client_close(client, errno != ECONNRESET);
+            return;
+        }
+
+        if (bytes_read > 0) {
+            bridge_log(LL_TRACE, "%ld bytes received from RPC client %d.\n", (long int)bytes_read, client->relay.id);
+            relay_pipe_read_done(&client->relay, bytes_read);
+            if (!client->relay.active) return;
+        }
+    }
+
+    if (client->relay.write_pending && (revents & (POLLOUT | POLLHUP | POLLERR))) {
+        ssize_t written = send(client->pipe_fd, client->write_buf, client->write_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (written < 0 && errno != EAGAIN && errno != EINTR) {
+            bridge_log(LL_ERROR, "Failed to write to RPC client %d: %s.\n", client->relay.id, strerror(errno));
+            client_close(client, 1);
+            return;
+        }
+
+        if (written >= 0)
+            relay_pipe_write_done(&client->relay, written);
+    }
+}
+
+// Whatever stopped one waiting client stops the rest too
+static void clients_attach(void) {
+    retry_at = metrics_ms() + RETRY_MS;
+
+    for (int i = 0; i < POSIX_MAX_CLIENTS; i++) {
+        if (clients[i].pipe_fd < 0 || !clients[i].waiting) continue;
+
+        // Without a watch nothing else wakes them, so they keep retrying
+        if (relay_attach(&clients[i].relay) < 0) {
+            attach_retries -= discovery_fd >= 0;
+            return;
+        }
+    }
+
+    attach_retries = 0;
+}
+
+int posix_relay_poll(int timeout) {
+    struct pollfd fds[2 * POSIX_MAX_CLIENTS + 3];
+    uint64_t now = metrics_ms();
+    int waiting = 0;
+
+    for (int i = 0; i < POSIX_MAX_CLIENTS; i++) {
+        struct posix_client *client = &clients[i];
+        struct pollfd *pipe_pfd = &fds[2 * i], *sock_pfd = &fds[2 * i + 1];
+
+        pipe_pfd->fd = sock_pfd->fd = -1;
+        pipe_pfd->events = sock_pfd->events = 0;
+        pipe_pfd->revents = sock_pfd->revents = 0;
+        if (client->pipe_fd < 0) continue;
+
+        uint64_t wait = relay_schedule(&client->relay, now);
+        if (!client->relay.active) continue;
+
+        if (wait != RELAY_NO_DEADLINE && (timeout < 0 || wait < (uint64_t)timeout))
+            timeout = (int)wait;
+
+        waiting += client->waiting;
+
+        // Level-triggered, so only ask for what relay.c would act on
+        pipe_pfd->events = (client->relay.read_pending ? POLLIN : 0) | (client->relay.write_pending ? POLLOUT : 0);
+        pipe_pfd->fd = pipe_pfd->events != 0 ? client->pipe_fd : -1;
+
+        if (client->relay.attached) {
+            sock_pfd->events = (relay_sock_wanted(&client->relay) ? POLLIN : 0) | (relay_sock_pending(&client->relay) ? POLLOUT : 0);
+            sock_pfd->fd = sock_pfd->events != 0 ? client->sock_fd : -1;
+        }
+    }
+
+    if (waiting > 0 && attach_retries > 0) {
+        int retry = retry_at > now ? (int)(retry_at - now) : 0;
+        if (timeout < 0 || retry < timeout)
+            timeout = retry;
+    }
+
+    // A companion that doesn't answer a connect in time is given up on, see ring_connect()
+    uint64_t answer = ring_schedule(now);
+    if (answer != RELAY_NO_DEADLINE && (timeout < 0 || answer < (uint64_t)timeout))
+        timeout = (int)answer;
+
+    fds[2 * POSIX_MAX_CLIENTS] = (struct pollfd){.fd = watch_fd, .events = POLLIN};
+    fds[2 * POSIX_MAX_CLIENTS + 1] = (struct pollfd){.fd = ring_pipe[0], .events = POLLIN};
+    fds[2 * POSIX_MAX_CLIENTS + 2] = (struct pollfd){.fd = waiting > 0 ? discovery_fd : -1, .events = POLLIN};
+    watch_ready = 0;
+
+    if (active_clients == 0 && watch_fd < 0) return 0;
+
+    // Set before looking, so ring_thread() either sees it or left its news where this finds it
+    __atomic_store_n(&loop_idle, 1, __ATOMIC_SEQ_CST);
+    (void)__atomic_or_fetch(&ring_ready, ring_poll(), __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring_ready, __ATOMIC_SEQ_CST) != 0)
+        timeout = 0;
+
+    int polled = poll(fds, 2 * POSIX_MAX_CLIENTS + 3, timeout);
+    __atomic_store_n(&loop_idle, 0, __ATOMIC_SEQ_CST);
+
+    if (polled < 0 && errno != EINTR) {
+        bridge_log(LL_ERROR, "Failed to poll: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    watch_ready = fds[2 * POSIX_MAX_CLIENTS].revents != 0;
+
+    if (fds[2 * POSIX_MAX_CLIENTS + 2].revents != 0) {
+        discovery_drain();
+        attach_retries = RETRY_COUNT;
+        clients_attach();
+    } else if (waiting > 0 && attach_retries > 0 && metrics_ms() >= retry_at) {
+        clients_attach();
+    }
+
+    // Channels the companion has news for count as sockets that became ready
+    if (fds[2 * POSIX_MAX_CLIENTS + 1].revents != 0) {
+        char pokes[64];
+        while (read(ring_pipe[0], pokes, sizeof(pokes)) > 0)
+            ;
+    }
+
+    uint32_t ring = __atomic_exchange_n(&ring_ready, 0, __ATOMIC_SEQ_CST) | ring_poll();
+    int overdue = ring_schedule(metrics_ms()) == 0;
+
+    for (int i = 0; i < POSIX_MAX_CLIENTS; i++) {
+        struct posix_client *client = &clients[i];
+        int sock_ready = fds[2 * i + 1].revents != 0 || (client->split && (ring & (1u << i)));
+
+        // The companion answered, or the answer is overdue and the client goes direct
+        if (client->connecting && client->relay.active && ((ring & (1u << i)) || overdue)) {
+            if (relay_attach(&client->relay) < 0)
+                posix_wait(&client->relay);
+        }
+
+        // Socket side first, it may free up room for pending pipe completions
+        if (sock_ready && client->relay.active && client->relay.attached)
+            relay_sock_ready(&client->relay);
+
+        if (fds[2 * i].revents != 0 && client->relay.active)
+            pipe_complete(client, fds[2 * i].revents);
+    }
+
+    // Once the current clients were served, never ahead of them
+    if (warm_pending) {
+        warm_pending = 0;
+        (void)discovery_warm();
+    }
+
+    return active_clients;
+}
+
+int posix_relay_failures(void) {
+    return failures;
+}
+
+struct relay *posix_relay_get(int id) {
+    return initialized && clients[id].pipe_fd >= 0 ? &clients[id].relay : NULL;
+}
+
+void posix_relay_watch(int fd) {
+    posix_init();
+    watch_fd = fd;
+}
+
+int posix_relay_watched(void) {
+    return watch_ready;
+}
+
+static int posix_pipe_read(struct relay *relay, char *buf, size_t len) {
+    struct posix_client *client = relay->ctx;
+    client->read_buf = buf;
+    client->read_len = len;
+    return 0;
+}
+
+static int posix_pipe_write(struct relay *relay, const char *buf, size_t len) {
+    struct posix_client *client = relay->ctx;
+    client->write_buf = buf;
+    client->write_len = len;
+    return 0;
+}
+
+static int posix_sock_open(struct relay *relay) {
+    struct posix_client *client = relay->ctx;
+
+    // Channels are numbered like the clients, and without a companion to ask the socket is ours
+    int error = split ? ring_connect(relay->id) : -ENODEV;
+    client->connecting = error == -EINPROGRESS;
+
+    if (error != -ENODEV) {
+        if (error < 0) return error;
+        client->split = 1;
+        client->waiting = 0;
+        return 0;
+    }
+
+    int sock_fd = discovery_connect();
+    if (sock_fd < 0) return sock_fd;
+
+    client->sock_fd = sock_fd;
+    client->waiting = 0;
+    warm_pending = on_demand;
+    return 0;
+}
+
+static void posix_sock_close(struct relay *relay) {
+    struct posix_client *client = relay->ctx;
+
+    if (client->split) {
+        ring_close(relay->id);
+        client->split = 0;
+        return;
+    }
+
+    close(client->sock_fd);
+    client->sock_fd = -1;
+}
+
+static ssize_t posix_sock_send(struct relay *relay, const struct relay_iov *iov, int count) {
+    struct posix_client *client = relay->ctx;
+
+    if (client->split) return ring_send(relay->id, iov, count);
+
+    // struct relay_iov is laid out like struct iovec
+    struct msghdr msg = {
+        .msg_iov    = (struct iovec*)iov,
+        .msg_iovlen = count
+    };
+
+    ssize_t written = sendmsg(client->sock_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    return written < 0 ? -errno : written;
+}
+
+static ssize_t posix_sock_recv(struct relay *relay, char *buf, size_t len) {
+    struct posix_client *client = relay->ctx;
+
+    if (client->split) return ring_recv(relay->id, buf, len);
+
+    ssize_t bytes_read = recv(client->sock_fd, buf, len, MSG_DONTWAIT);
+    return bytes_read < 0 ? -errno : bytes_read;
+}
+
+static void posix_wait(struct relay *relay) {
+    struct posix_client *client = relay->ctx;
+    client->waiting = 1;
+
+    // Not fatal here, the clients just keep retrying every RETRY_MS
+    if (discovery_fd < 0)
+        discovery_fd = discovery_watch();
+
+    // The socket may have appeared before the watch existed, or Discord only dropped the connection
+    if (attach_retries == 0) {
+        attach_retries = 1;
+        retry_at = metrics_ms() + RETRY_MS;
+    }
+}
+
+static void posix_close(struct relay *relay, int failed) {
+    client_close(relay->ctx, failed);
+}
@@ -0,0 +1,454 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// Microbenchmark of the relay engine without Wine, built against the native backend
+// Serves an echoing stand-in for Discord from a private runtime directory, connects the requested number of
+// clients through socketpairs and has each send commands of a fixed size back to back, timing every round trip.
+// The relay runs on the main thread only, so its CPU time is what the engine costs. Prints a single JSON object,
+// in the same shape as bench/load-client.c, so perf, valgrind and sanitizers can be pointed at the real hot path.
+// With -S the relay reaches the echo server through bin/winerpc-companion as the bridge does in split mode, and
+// the companion's CPU time is reported along with the relay's.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "native/posix.h"
+#include "bridge/ipc.h"
+#include "bridge/ring.h"
+#include "bridge/log.h"
+
+#define REQUEST_HEAD        "{\"cmd\":\"BENCH\",\"nonce\":\""
+#define REQUEST_PAD         "\",\"args\":{\"pad\":\""
+#define REQUEST_TAIL        "\"}}"
+#define NONCE_DIGITS        8
+#define CACHE_NAME          "winerpc-last-socket"
+#define COMPANION_WAIT_MS   2000
+
+struct worker {
+    int         id;
+    pthread_t   thread;
+    int         fd;             // Our end of the socketpair, the relay has the other
+    char       *request;        // Whole frame, header included
+    size_t      request_len;
+    char       *reply;
+    uint64_t   *samples;        // Round trips in ns
+    size_t      count;
+    size_t      cap;
+    int         failed;
+};
+
+static struct worker workers[POSIX_MAX_CLIENTS];
+static size_t payload_size = 256;
+static int listen_fd = -1;
+static int volatile stop_requested;
+
+enum log_level g_log_level = LL_ERROR;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec now;
+    (void)clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static int write_all(int fd, const char *buf, size_t length) {
+    while (length > 0) {
+        ssize_t written = send(fd, buf, length, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return -1;
+        buf += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+static int read_all(int fd, char *buf, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_read = read(fd, buf, length);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read <= 0) return -1;
+        buf += bytes_read;
+        length -= bytes_read;
+    }
+
+    return 0;
+}
+
+static int read_frame(int fd, char *buf) {
+    uint32_t length;
+
+    if (read_all(fd, buf, IPC_HEADER_SIZE) < 0) return -1;
+    memcpy(&length, buf + sizeof(uint32_t), sizeof(length));
+
+    return length <= IPC_MAX_FRAME - IPC_HEADER_SIZE ? read_all(fd, buf + IPC_HEADER_SIZE, length) : -1;
+}
+
+static size_t build_frame(char *buf, uint32_t opcode, const char *payload, size_t length) {
+    uint32_t length32 = (uint32_t)length;
+    memcpy(buf, &opcode, sizeof(opcode));
+    memcpy(buf + sizeof(opcode), &length32, sizeof(length32));
+    memcpy(buf + IPC_HEADER_SIZE, payload, length);
+    return IPC_HEADER_SIZE + length;
+}
+
+// A BENCH command padded out to payload_size, the nonce right after REQUEST_HEAD gets rewritten per request
+static int build_request(struct worker *worker) {
+    size_t fixed = strlen(REQUEST_HEAD) + NONCE_DIGITS + strlen(REQUEST_PAD) + strlen(REQUEST_TAIL);
+    size_t pad = payload_size > fixed ? payload_size - fixed : 0;
+    size_t length = fixed + pad;
+
+    char *payload = malloc(length);
+    if (payload == NULL || (worker->request = malloc(IPC_HEADER_SIZE + length)) == NULL) {
+        free(payload);
+        return -1;
+    }
+
+    char *p = payload;
+    p += sprintf(p, REQUEST_HEAD "%0*d" REQUEST_PAD, NONCE_DIGITS, 0);
+    memset(p, 'x', pad);
+    memcpy(p + pad, REQUEST_TAIL, strlen(REQUEST_TAIL));
+
+    worker->request_len = build_frame(worker->request, IPC_FRAME, payload, length);
+    free(payload);
+    return 0;
+}
+
+static int record(struct worker *worker, uint64_t ns) {
+    if (worker->count == worker->cap) {
+        size_t cap = worker->cap > 0 ? worker->cap * 2 : 4096;
+        uint64_t *samples = realloc(worker->samples, cap * sizeof(*samples));
+        if (samples == NULL) return -1;
+        worker->samples = samples;
+        worker->cap = cap;
+    }
+
+    worker->samples[worker->count++] = ns;
+    return 0;
+}
+
+static void *worker_thread(void *param) {
+    struct worker *worker = param;
+    char *nonce = worker->request + IPC_HEADER_SIZE + strlen(REQUEST_HEAD);
+
+    for (unsigned n = 1; !stop_requested; n++) {
+        char digits[NONCE_DIGITS + 1];
+        snprintf(digits, sizeof(digits), "%0*u", NONCE_DIGITS, n % 100000000u);
+        memcpy(nonce, digits, NONCE_DIGITS);
+
+        uint64_t before = clock_ns(CLOCK_MONOTONIC);
+
+        if (write_all(worker->fd, worker->request, worker->request_len) < 0 || read_frame(worker->fd, worker->reply) < 0) {
+            fprintf(stderr, "Client %d lost the relay.\n", worker->id);
+            worker->failed = 1;
+            break;
+        }
+
+        if (record(worker, clock_ns(CLOCK_MONOTONIC) - before) < 0) {
+            fprintf(stderr, "Client %d ran out of memory for samples.\n", worker->id);
+            worker->failed = 1;
+            break;
+        }
+    }
+
+    // The relay sees the RPC client leave and hangs up on the echo server in turn
+    shutdown(worker->fd, SHUT_WR);
+    return NULL;
+}
+
+// Discord's side of one relay connection, echoes every byte back as it comes
+static void *echo_thread(void *param) {
+    int fd = (int)(intptr_t)param;
+    char buf[16 * 1024];
+    ssize_t bytes_read;
+
+    while ((bytes_read = read(fd, buf, sizeof(buf))) > 0 || (bytes_read < 0 && errno == EINTR))
+        if (bytes_read > 0 && write_all(fd, buf, bytes_read) < 0)
+            break;
+
+    close(fd);
+    return NULL;
+}
+
+static void *accept_thread(void *param) {
+    int expected = (int)(intptr_t)param;
+
+    for (int i = 0; i < expected; i++) {
+        pthread_t thread;
+        int fd = accept(listen_fd, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno == EINTR) { i--; continue; }
+            return NULL;
+        }
+
+        if (pthread_create(&thread, NULL, echo_thread, (void*)(intptr_t)fd) != 0) {
+            close(fd);
+            return NULL;
+        }
+
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank over sorted samples
+static double percentile_us(const uint64_t *samples, size_t count, int percent) {
+    return count > 0 ? samples[(count - 1) * percent / 100] / 1000.0 : 0.0;
+}
+
+// Runs bin/winerpc-companion from next to this binary, in the private runtime directory set up already
+static pid_t companion_start(void) {
+    char path[4096];
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 32);
+    if (length < 0) return -1;
+
+    path[length] = '\0';
+    strcpy(strrchr(path, '/') + 1, "winerpc-companion");
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(path, path, (char*)NULL);
+        _exit(127);
+    }
+
+    // Split mode only takes effect once the companion took the ring file
+    for (int waited = 0; pid > 0 && !ring_served(); waited += 10) {
+        if (waited >= COMPANION_WAIT_MS || waitpid(pid, NULL, WNOHANG) == pid) return -1;
+        usleep(10000);
+    }
+
+    return pid;
+}
+
+// utime and stime from /proc/PID/stat, in clock ticks
+static uint64_t companion_cpu_us(pid_t pid) {
+    char path[64], buf[1024];
+    unsigned long utime, stime;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return 0;
+
+    size_t length = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[length] = '\0';
+
+    // The command name may hold spaces, fields are counted from the parenthesis that closes it
+    const char *fields = strrchr(buf, ')');
+    if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return 0;
+
+    return (uint64_t)(utime + stime) * 1000000ULL / (uint64_t)sysconf(_SC_CLK_TCK);
+}
+
+// Both the Discord socket and the discovery cache go to a private directory, away from a real Discord
+static int listen_private(char *dir, char *sock_path, size_t size) {
+    if (mkdtemp(dir) == NULL || setenv("XDG_RUNTIME_DIR", dir, 1) != 0) return -1;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/discord-ipc-0", dir);
+    snprintf(sock_path, size, "%s", addr.sun_path);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, POSIX_MAX_CLIENTS) < 0)
+        return -1;
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int clients = 1, duration = 5, split = 0, opt;
+    pid_t companion = -1;
+    char dir[] = "/tmp/relay-bench-XXXXXX", sock_path[128], cache_path[128];
+
+    while ((opt = getopt(argc, argv, "c:s:d:Sv")) != -1) {
+        switch (opt) {
+            case 'c': clients = atoi(optarg); break;
+            case 's': payload_size = strtoul(optarg, NULL, 10); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'S': split = 1; break;
+            case 'v': g_log_level = g_log_level < LL_TRACE ? g_log_level + 1 : LL_TRACE; break;
+            default:
+                fprintf(stderr, "Usage: relay-bench [-c CLIENTS] [-s PAYLOAD_BYTES] [-d SECONDS] [-S] [-v...]\n");
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (clients < 1 || clients > POSIX_MAX_CLIENTS || duration < 1 || payload_size > IPC_MAX_FRAME - IPC_HEADER_SIZE) {
+        fprintf(stderr, "Between 1 and %d clients, at least a second, and payloads that fit a frame.\n", POSIX_MAX_CLIENTS);
+        return EXIT_FAILURE;
+    }
+
+    if (listen_private(dir, sock_path, sizeof(sock_path)) < 0) {
+        fprintf(stderr, "Failed to set up the echo server in \"%s\": %s.\n", dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    pthread_t acceptor;
+    if (pthread_create(&acceptor, NULL, accept_thread, (void*)(intptr_t)clients) != 0) {
+        fprintf(stderr, "Failed to create thread.\n");
+        return EXIT_FAILURE;
+    }
+
+    int exit_code = EXIT_SUCCESS;
+
+    if (split && (posix_relay_split() < 0 || (companion = companion_start()) < 0)) {
+        fprintf(stderr, "Failed to start winerpc-companion for split mode.\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < clients; i++) {
+        int pair[2];
+        workers[i].id = i;
+
+        if (build_request(&workers[i]) < 0 || (workers[i].reply = malloc(IPC_MAX_FRAME)) == NULL) {
+            fprintf(stderr, "Failed to allocate buffers.\n");
+            return EXIT_FAILURE;
+        }
+
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0 ||
+            fcntl(pair[0], F_SETFL, O_NONBLOCK) < 0 || posix_relay_add(pair[0]) < 0) {
+            fprintf(stderr, "Failed to connect client %d to the relay: %s.\n", i, strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        workers[i].fd = pair[1];
+    }
+
+    // Handshakes go through the relay too, workers only start once every client got its reply
+    for (int i = 0; i < clients; i++) {
+        char handshake[64], frame[IPC_HEADER_SIZE + sizeof(handshake)];
+        int length = snprintf(handshake, sizeof(handshake), "{\"v\":1,\"client_id\":\"bench-%d\"}", i);
+
+        size_t frame_len = build_frame(frame, IPC_HANDSHAKE, handshake, length);
+
+        if (write_all(workers[i].fd, frame, frame_len) < 0) {
+            fprintf(stderr, "Client %d failed to handshake.\n", i);
+            return EXIT_FAILURE;
+        }
+
+        // The echo is as long as the handshake, keep the relay going until all of it is there
+        while (recv(workers[i].fd, workers[i].reply, frame_len, MSG_PEEK | MSG_DONTWAIT) < (ssize_t)frame_len) {
+            if (posix_relay_poll(10) <= 0) {
+                fprintf(stderr, "Client %d failed to handshake.\n", i);
+                return EXIT_FAILURE;
+            }
+        }
+
+        (void)read_frame(workers[i].fd, workers[i].reply);
+    }
+
+    for (int i = 0; i < clients; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to create thread.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    uint64_t deadline = start + (uint64_t)duration * 1000000000ULL;
+    uint64_t cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    int served;
+
+    while ((served = posix_relay_poll(100)) > 0) {
+        if (!stop_requested && clock_ns(CLOCK_MONOTONIC) >= deadline)
+            stop_requested = 1;
+    }
+
+    uint64_t end = clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpu_us = (clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start) / 1000;
+
+    // Counted from its start, which only takes the handshakes ahead of the measured part
+    uint64_t helper_us = 0;
+    if (companion > 0) {
+        helper_us = companion_cpu_us(companion);
+        kill(companion, SIGTERM);
+        waitpid(companion, NULL, 0);
+        ring_shutdown();
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].count;
+        if (workers[i].failed) exit_code = EXIT_FAILURE;
+    }
+
+    if (served < 0 || posix_relay_failures() > 0) exit_code = EXIT_FAILURE;
+
+    uint64_t *samples = malloc((total > 0 ? total : 1) * sizeof(*samples));
+    if (samples == NULL) {
+        fprintf(stderr, "Failed to allocate samples.\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t off = 0;
+    for (int i = 0; i < clients; i++) {
+        memcpy(samples + off, workers[i].samples, workers[i].count * sizeof(*samples));
+        off += workers[i].count;
+        close(workers[i].fd);
+    }
+
+    qsort(samples, total, sizeof(*samples), compare_samples);
+
+    double seconds = (end - start) / 1e9;
+
+    printf("{\"clients\":%d,\"payload\":%lu,\"seconds\":%.3f,\"frames\":%lu,\"frames_per_sec\":%.1f,"
+           "\"rtt_p50_us\":%.1f,\"rtt_p99_us\":%.1f,\"rtt_max_us\":%.1f,\"relay_cpu_us\":%lu,"
+           "\"relay_cpu_us_per_frame\":%.3f",
+           clients, (unsigned long)payload_size, seconds, (unsigned long)total, total / seconds,
+           percentile_us(samples, total, 50), percentile_us(samples, total, 99),
+           percentile_us(samples, total, 100), (unsigned long)cpu_us, total > 0 ? (double)cpu_us / total : 0.0);
+
+    if (split)
+        printf(",\"companion_cpu_us\":%lu,\"companion_cpu_us_per_frame\":%.3f",
+               (unsigned long)helper_us, total > 0 ? (double)helper_us / total : 0.0);
+    printf("}\n");
+
+    free(samples);
+    close(listen_fd);
+    snprintf(cache_path, sizeof(cache_path), "%s/" CACHE_NAME, dir);
+    unlink(sock_path);
+    unlink(cache_path);
+    rmdir(dir);
+    return exit_code;
+}
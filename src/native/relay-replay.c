@@ -0,0 +1,311 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// Feeds a trace recorded with --trace back through the relay engine, built against the native backend
+// Every traced client gets a socketpair standing in for its pipe, and this process plays Discord's side of its
+// relay connection too: what the client sent goes to the pipe and what Discord sent goes to the socket, in trace
+// order and at the recorded pace unless -m asks for full speed. The relay runs on this thread in between, so a
+// run is the same every time. Prints a single JSON object with the bytes that went in and came out of each side
+// and the CPU time it took, which makes any trace a benchmark too.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "native/posix.h"
+#include "bridge/trace.h"
+#include "bridge/log.h"
+
+#define CACHE_NAME      "winerpc-last-socket"
+#define SETTLE_MS       200     // Without any traffic before the relay counts as done with the trace
+
+struct replay_client {
+    int     pipe_fd;            // Our end of the socketpair, -1 while the traced client isn't connected
+    int     sock_fd;            // Discord's end of the relay connection, -1 until the relay made one
+};
+
+static struct replay_client clients[POSIX_MAX_CLIENTS];
+static uint64_t fed[DIR_COUNT], delivered[DIR_COUNT], frames[DIR_COUNT];
+static int listen_fd = -1;
+static int serving;                 // Clients the relay still serves, as of the last pump()
+
+enum log_level g_log_level = LL_ERROR;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec now;
+    (void)clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// Both the Discord socket and the discovery cache go to a private directory, away from a real Discord
+static int listen_private(char *dir, char *sock_path, size_t size) {
+    if (mkdtemp(dir) == NULL || setenv("XDG_RUNTIME_DIR", dir, 1) != 0) return -1;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/discord-ipc-0", dir);
+    snprintf(sock_path, size, "%s", addr.sun_path);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, POSIX_MAX_CLIENTS) < 0)
+        return -1;
+
+    return 0;
+}
+
+// Reads whatever the relay wrote to either side, returns how many bytes that was
+static uint64_t drain(void) {
+    char buf[16 * 1024];
+    uint64_t moved = 0;
+
+    for (int i = 0; i < POSIX_MAX_CLIENTS; i++) {
+        int fds[DIR_COUNT] = { [DIR_TO_DISCORD] = clients[i].sock_fd, [DIR_TO_CLIENT] = clients[i].pipe_fd };
+
+        for (int dir = 0; dir < DIR_COUNT; dir++) {
+            ssize_t bytes_read;
+            if (fds[dir] < 0) continue;
+
+            while ((bytes_read = recv(fds[dir], buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+                delivered[dir] += bytes_read;
+                moved += bytes_read;
+            }
+        }
+    }
+
+    return moved;
+}
+
+// One round of the relay's loop, returns how many bytes came out of it
+static uint64_t pump(int timeout) {
+    serving = posix_relay_poll(timeout);
+
+    // Nothing to poll between clients, only the recorded pace to keep
+    if (serving == 0 && timeout > 0) {
+        struct timespec pause = { .tv_sec = timeout / 1000, .tv_nsec = (long)(timeout % 1000) * 1000000L };
+        (void)nanosleep(&pause, NULL);
+    }
+
+    return drain();
+}
+
+static int write_all(int fd, const char *buf, size_t length) {
+    while (length > 0) {
+        ssize_t written = send(fd, buf, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (written < 0 && (errno == EAGAIN || errno == EINTR)) {
+            (void)pump(1);
+            continue;
+        }
+
+        if (written < 0) return -1;
+        buf += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+static struct replay_client *client_get(int id) {
+    struct replay_client *client = &clients[id];
+    int pair[2];
+
+    if (client->pipe_fd >= 0) return client;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) < 0) return NULL;
+
+    if (posix_relay_add(pair[0]) < 0) {
+        close(pair[0]);
+        close(pair[1]);
+        return NULL;
+    }
+
+    // Unix sockets connect synchronously, so the relay's connection is already waiting
+    client->pipe_fd = pair[1];
+    client->sock_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    return client;
+}
+
+// The relay sees the pipe close and hangs up on Discord in turn
+static void client_gone(struct replay_client *client) {
+    (void)pump(0);
+
+    if (client->pipe_fd >= 0) close(client->pipe_fd);
+    if (client->sock_fd >= 0) close(client->sock_fd);
+    client->pipe_fd = client->sock_fd = -1;
+}
+
+// Next record at or after *off, NULL at the end of the trace
+static const struct trace_record *next_record(const char *map, size_t size, uint32_t window, size_t *off) {
+    while (*off + sizeof(struct trace_record) <= size) {
+        const struct trace_record *record = (const struct trace_record*)(map + *off);
+        size_t in_window = *off % window;
+
+        // A zeroed record or no room for one ends the window
+        if (in_window + sizeof(*record) > window || (record->size == 0 && record->dir == DIR_TO_DISCORD)) {
+            *off += window - in_window;
+            continue;
+        }
+
+        // Cut short while being written
+        if (*off + TRACE_RECORD_SIZE(record->size) > size || (record->dir < DIR_COUNT && record->size < IPC_HEADER_SIZE))
+            return NULL;
+
+        *off += TRACE_RECORD_SIZE(record->size);
+        return record;
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int full_speed = 0, opt;
+    char dir[] = "/tmp/relay-replay-XXXXXX", sock_path[128], cache_path[128];
+
+    while ((opt = getopt(argc, argv, "mv")) != -1) {
+        switch (opt) {
+            case 'm': full_speed = 1; break;
+            case 'v': g_log_level = g_log_level < LL_TRACE ? g_log_level + 1 : LL_TRACE; break;
+            default:
+                fprintf(stderr, "Usage: relay-replay [-m] [-v...] TRACE\n");
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: relay-replay [-m] [-v...] TRACE\n");
+        return EXIT_FAILURE;
+    }
+
+    int trace_fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (trace_fd < 0 || fstat(trace_fd, &st) < 0) {
+        fprintf(stderr, "Failed to open \"%s\": %s.\n", argv[optind], strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    size_t size = (size_t)st.st_size;
+    const char *map = size >= sizeof(struct trace_header) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, trace_fd, 0) : MAP_FAILED;
+    const struct trace_header *header = (const struct trace_header*)map;
+    close(trace_fd);
+
+    if (map == MAP_FAILED || header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ||
+        header->window < sizeof(*header) || header->window % 8 != 0) {
+        fprintf(stderr, "\"%s\" is not a trace this build can read.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    if (listen_private(dir, sock_path, sizeof(sock_path)) < 0) {
+        fprintf(stderr, "Failed to stand in for Discord in \"%s\": %s.\n", dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < POSIX_MAX_CLIENTS; i++)
+        clients[i].pipe_fd = clients[i].sock_fd = -1;
+
+    const struct trace_record *record;
+    size_t off = sizeof(*header), records = 0, skipped = 0;
+    uint64_t first = UINT64_MAX;
+    int exit_code = EXIT_SUCCESS;
+
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+    while ((record = next_record(map, size, header->window, &off)) != NULL) {
+        if (first == UINT64_MAX) first = record->stamp;
+        records++;
+
+        if (!full_speed) {
+            uint64_t due = start + (record->stamp - first), now;
+
+            while ((now = clock_ns(CLOCK_MONOTONIC)) < due)
+                (void)pump((int)((due - now) / 1000000));
+        }
+
+        if (record->client >= POSIX_MAX_CLIENTS) {
+            skipped++;
+            continue;
+        }
+
+        if (record->dir == TRACE_GONE) {
+            client_gone(&clients[record->client]);
+            continue;
+        }
+
+        struct replay_client *client = client_get(record->client);
+        int fd = client == NULL ? -1 : record->dir == DIR_TO_DISCORD ? client->pipe_fd : client->sock_fd;
+
+        // The relay was waiting for Discord when this was recorded, there's no session to play it into
+        if (fd < 0 || write_all(fd, (const char*)(record + 1), record->size) < 0) {
+            skipped++;
+            continue;
+        }
+
+        fed[record->dir] += record->size;
+        frames[record->dir]++;
+        (void)pump(0);
+    }
+
+    // Whatever the relay still holds, paced activity included, has had its chance once it goes quiet
+    for (uint64_t quiet_since = clock_ns(CLOCK_MONOTONIC);
+         serving > 0 && clock_ns(CLOCK_MONOTONIC) - quiet_since < SETTLE_MS * 1000000ULL; )
+        if (pump(SETTLE_MS / 4) > 0)
+            quiet_since = clock_ns(CLOCK_MONOTONIC);
+
+    uint64_t end = clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpu_us = (clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start) / 1000;
+    uint64_t total = frames[DIR_TO_DISCORD] + frames[DIR_TO_CLIENT];
+
+    for (int i = 0; i < POSIX_MAX_CLIENTS; i++)
+        client_gone(&clients[i]);
+    while (posix_relay_poll(10) > 0)
+        ;
+
+    if (posix_relay_failures() > 0) exit_code = EXIT_FAILURE;
+
+    printf("{\"records\":%lu,\"skipped\":%lu,\"seconds\":%.3f,\"frames_to_discord\":%lu,\"frames_to_client\":%lu,"
+           "\"bytes_fed_to_discord\":%lu,\"bytes_out_to_discord\":%lu,\"bytes_fed_to_client\":%lu,"
+           "\"bytes_out_to_client\":%lu,\"relay_cpu_us\":%lu,\"relay_cpu_us_per_frame\":%.3f}\n",
+           (unsigned long)records, (unsigned long)skipped, (end - start) / 1e9,
+           (unsigned long)frames[DIR_TO_DISCORD], (unsigned long)frames[DIR_TO_CLIENT],
+           (unsigned long)fed[DIR_TO_DISCORD], (unsigned long)delivered[DIR_TO_DISCORD],
+           (unsigned long)fed[DIR_TO_CLIENT], (unsigned long)delivered[DIR_TO_CLIENT],
+           (unsigned long)cpu_us, total > 0 ? (double)cpu_us / total : 0.0);
+
+    close(listen_fd);
+    snprintf(cache_path, sizeof(cache_path), "%s/" CACHE_NAME, dir);
+    unlink(sock_path);
+    unlink(cache_path);
+    rmdir(dir);
+    return exit_code;
+}
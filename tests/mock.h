@@ -0,0 +1,203 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// A transport that is only memory, for tests to drive a relay by hand
+// The RPC client and Discord are byte buffers: mock_client() and mock_discord() hand the relay a frame from
+// either, and whatever it sends lands in to_discord or, once mock_flush() completes its pipe writes, to_client.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "bridge/relay.h"
+#include "bridge/metrics.h"
+#include "bridge/utils/linux.h"
+
+#define MOCK_BYTES  (128 * 1024)
+
+struct mock {
+    struct relay    relay;
+    int             discord;            // Whether sock_open() succeeds
+    int             hangup;             // sock_recv() reports Discord gone once from_discord is read
+    int             blocked;            // sock_send() takes nothing, as if Discord stopped reading
+    int             waiting;            // The relay waits for Discord, see struct transport
+    int             closed;
+    char           *read_buf;           // Pipe read in flight
+    size_t          read_len;
+    const char     *write_buf;          // Pipe write in flight
+    size_t          write_len;
+    char            to_discord[MOCK_BYTES];
+    size_t          to_discord_len;
+    char            from_discord[MOCK_BYTES];
+    size_t          from_discord_len;
+    size_t          from_discord_off;
+    char            to_client[MOCK_BYTES];
+    size_t          to_client_len;
+};
+
+static int mock_pipe_read(struct relay *relay, char *buf, size_t len) {
+    struct mock *mock = relay->ctx;
+    mock->read_buf = buf;
+    mock->read_len = len;
+    return 0;
+}
+
+static int mock_pipe_write(struct relay *relay, const char *buf, size_t len) {
+    struct mock *mock = relay->ctx;
+    mock->write_buf = buf;
+    mock->write_len = len;
+    return 0;
+}
+
+static int mock_sock_open(struct relay *relay) {
+    struct mock *mock = relay->ctx;
+
+    if (!mock->discord) return -LINUX_ECONNREFUSED;
+
+    mock->waiting = 0;
+    return 0;
+}
+
+static void mock_sock_close(struct relay *relay) {
+    struct mock *mock = relay->ctx;
+    mock->discord = 0;
+    mock->hangup = 0;
+    mock->blocked = 0;
+    mock->from_discord_len = mock->from_discord_off = 0;
+}
+
+static ssize_t mock_sock_send(struct relay *relay, const struct relay_iov *iov, int count) {
+    struct mock *mock = relay->ctx;
+    ssize_t sent = 0;
+
+    if (mock->blocked) return -LINUX_EAGAIN;
+
+    for (int i = 0; i < count && mock->to_discord_len + iov[i].len <= MOCK_BYTES; i++) {
+        memcpy(mock->to_discord + mock->to_discord_len, iov[i].base, iov[i].len);
+        mock->to_discord_len += iov[i].len;
+        sent += (ssize_t)iov[i].len;
+    }
+
+    return sent;
+}
+
+static ssize_t mock_sock_recv(struct relay *relay, char *buf, size_t len) {
+    struct mock *mock = relay->ctx;
+    size_t left = mock->from_discord_len - mock->from_discord_off;
+
+    if (left == 0) return mock->hangup ? 0 : -LINUX_EAGAIN;
+    if (len > left) len = left;
+
+    memcpy(buf, mock->from_discord + mock->from_discord_off, len);
+    mock->from_discord_off += len;
+    return (ssize_t)len;
+}
+
+static void mock_wait(struct relay *relay) {
+    ((struct mock*)relay->ctx)->waiting = 1;
+}
+
+static void mock_close(struct relay *relay, int failed) {
+    (void)failed;
+    ((struct mock*)relay->ctx)->closed = 1;
+}
+
+static const struct transport mock_transport = {
+    .pipe_read  = mock_pipe_read,
+    .pipe_write = mock_pipe_write,
+    .sock_open  = mock_sock_open,
+    .sock_close = mock_sock_close,
+    .sock_send  = mock_sock_send,
+    .sock_recv  = mock_sock_recv,
+    .wait       = mock_wait,
+    .close      = mock_close
+};
+
+static size_t mock_frame(char *buf, uint32_t opcode, const char *json) {
+    uint32_t header[2] = {opcode, (uint32_t)strlen(json)};
+
+    memcpy(buf, header, IPC_HEADER_SIZE);
+    memcpy(buf + IPC_HEADER_SIZE, json, header[1]);
+    return IPC_HEADER_SIZE + header[1];
+}
+
+// Completes pipe writes for as long as the relay starts new ones
+static void mock_flush(struct mock *mock) {
+    while (mock->relay.active && mock->relay.write_pending) {
+        memcpy(mock->to_client + mock->to_client_len, mock->write_buf, mock->write_len);
+        mock->to_client_len += mock->write_len;
+        relay_pipe_write_done(&mock->relay, mock->write_len);
+    }
+}
+
+static void mock_start(struct mock *mock, int discord) {
+    memset(mock, 0, sizeof(*mock));
+    metrics_init();
+    mock->discord = discord;
+    relay_init(&mock->relay, &mock_transport, mock, 0);
+    relay_start(&mock->relay);
+}
+
+// A frame from the RPC client, in a single read
+static void mock_client(struct mock *mock, uint32_t opcode, const char *json) {
+    size_t length = mock_frame(mock->read_buf, opcode, json);
+    relay_pipe_read_done(&mock->relay, length);
+    mock_flush(mock);
+}
+
+static void mock_discord(struct mock *mock, uint32_t opcode, const char *json) {
+    mock->from_discord_len += mock_frame(mock->from_discord + mock->from_discord_len, opcode, json);
+    relay_sock_ready(&mock->relay);
+    mock_flush(mock);
+}
+
+// Discord goes away, then comes back and the relay attaches again
+static void mock_restart(struct mock *mock) {
+    mock->hangup = 1;
+    relay_sock_ready(&mock->relay);
+    mock->discord = 1;
+    (void)relay_attach(&mock->relay);
+    mock_flush(mock);
+}
+
+// Frames in buf from *off on, one per call, 0 past the last one
+static int mock_next(const char *buf, size_t len, size_t *off, struct ipc_frame *frame) {
+    if (*off + IPC_HEADER_SIZE > len) return 0;
+
+    memcpy(&frame->opcode, buf + *off, sizeof(frame->opcode));
+    memcpy(&frame->length, buf + *off + sizeof(frame->opcode), sizeof(frame->length));
+    frame->data = buf + *off;
+    *off += IPC_FRAME_SIZE(frame);
+    return 1;
+}
+
+// How many frames in buf contain str in their payload
+static int mock_count(const char *buf, size_t len, const char *str) {
+    struct ipc_frame frame;
+    size_t off = 0;
+    int count = 0;
+
+    while (mock_next(buf, len, &off, &frame))
+        count += memmem(IPC_PAYLOAD(&frame), frame.length, str, strlen(str)) != NULL;
+
+    return count;
+}
@@ -0,0 +1,196 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// Frame reassembly, see struct ipc_reader: the same stream fed in every way a pipe or socket could split it
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bridge/ipc.h"
+#include "test.h"
+
+#define MAX_FRAMES  16
+
+struct stream {
+    char       *data;
+    size_t      size;
+    int         count;
+    uint32_t    lengths[MAX_FRAMES];
+};
+
+// Frames of the given payload lengths back to back, opcodes and payload bytes telling them apart
+static void stream_build(struct stream *stream, const uint32_t *lengths, int count) {
+    stream->size = 0;
+    stream->count = count;
+
+    for (int i = 0; i < count; i++)
+        stream->size += IPC_HEADER_SIZE + lengths[i];
+
+    stream->data = malloc(stream->size);
+
+    for (int i = 0, off = 0; i < count; i++) {
+        uint32_t header[2] = {(uint32_t)i % (IPC_PONG + 1), lengths[i]};
+
+        memcpy(stream->data + off, header, IPC_HEADER_SIZE);
+        for (uint32_t j = 0; j < lengths[i]; j++)
+            stream->data[off + IPC_HEADER_SIZE + j] = (char)(i * 31 + j);
+
+        stream->lengths[i] = lengths[i];
+        off += IPC_HEADER_SIZE + lengths[i];
+    }
+}
+
+// Feeds the stream in reads of the sizes given, the last one repeating, each cut short by the room the reader
+// offers, and checks every frame comes out whole and in order
+static void stream_feed(const struct stream *stream, const size_t *reads, int read_count) {
+    struct ipc_reader reader;
+    struct ipc_frame frame;
+    size_t fed = 0, checked = 0;
+    int frames = 0, read = 0;
+    enum ipc_status status = IPC_AGAIN;
+
+    ipc_reader_init(&reader);
+
+    while (fed < stream->size) {
+        size_t avail, length = reads[read < read_count - 1 ? read++ : read_count - 1];
+        char *space = ipc_reader_space(&reader, &avail);
+
+        if (length > avail) length = avail;
+        if (length > stream->size - fed) length = stream->size - fed;
+
+        memcpy(space, stream->data + fed, length);
+        ipc_reader_commit(&reader, length);
+        fed += length;
+
+        while (frames < stream->count && (status = ipc_reader_next(&reader, &frame)) == IPC_OK) {
+            CHECK(frame.opcode == (uint32_t)frames % (IPC_PONG + 1));
+            CHECK(frame.length == stream->lengths[frames]);
+            CHECK(memcmp(frame.data, stream->data + checked, IPC_FRAME_SIZE(&frame)) == 0);
+            checked += IPC_FRAME_SIZE(&frame);
+            frames++;
+        }
+
+        CHECK(status != IPC_INVALID);
+    }
+
+    CHECK(frames == stream->count);
+    CHECK(ipc_reader_next(&reader, &frame) == IPC_AGAIN);
+    ipc_reader_free(&reader);
+}
+
+// Small frames, split at every pair of points
+static void test_every_split(void) {
+    static const uint32_t lengths[] = {0, 1, 17, 100, 3};
+    struct stream stream;
+
+    stream_build(&stream, lengths, sizeof(lengths) / sizeof(lengths[0]));
+
+    for (size_t first = 1; first < stream.size; first++)
+        for (size_t second = 1; first + second <= stream.size; second++) {
+            size_t reads[] = {first, second, stream.size};
+            stream_feed(&stream, reads, 3);
+        }
+
+    free(stream.data);
+}
+
+// Frames around the inline buffer's size and up to the largest allowed, so the reader grows and shrinks back
+static void test_large_frames(void) {
+    static const uint32_t lengths[] = {
+        5, IPC_INLINE_SIZE - IPC_HEADER_SIZE, IPC_INLINE_SIZE, 2, 10000, 0, IPC_MAX_FRAME - IPC_HEADER_SIZE, 40
+    };
+    struct stream stream;
+    uint32_t seed = 1;
+
+    stream_build(&stream, lengths, sizeof(lengths) / sizeof(lengths[0]));
+
+    // Byte by byte, whole, then at random
+    size_t one = 1, all = stream.size;
+    stream_feed(&stream, &one, 1);
+    stream_feed(&stream, &all, 1);
+
+    for (int round = 0; round < 50; round++) {
+        size_t reads[64];
+
+        for (int i = 0; i < 64; i++) {
+            seed = seed * 1103515245u + 12345u;
+            reads[i] = 1 + (seed >> 8) % (round % 2 == 0 ? 64 : 8192);
+        }
+
+        stream_feed(&stream, reads, 64);
+    }
+
+    free(stream.data);
+}
+
+static void test_oversized(void) {
+    struct ipc_reader reader;
+    struct ipc_frame frame;
+    uint32_t header[2] = {IPC_FRAME, IPC_MAX_FRAME - IPC_HEADER_SIZE + 1};
+    size_t avail;
+
+    ipc_reader_init(&reader);
+    char *space = ipc_reader_space(&reader, &avail);
+    memcpy(space, header, IPC_HEADER_SIZE);
+    ipc_reader_commit(&reader, IPC_HEADER_SIZE);
+
+    CHECK(ipc_reader_next(&reader, &frame) == IPC_INVALID);
+    ipc_reader_free(&reader);
+}
+
+static uint64_t hash_of(const char *json) {
+    char buf[256];
+    uint32_t header[2] = {IPC_FRAME, (uint32_t)strlen(json)};
+    struct ipc_frame frame = {IPC_FRAME, header[1], buf};
+    struct ipc_class cls;
+
+    memcpy(buf, header, IPC_HEADER_SIZE);
+    memcpy(buf + IPC_HEADER_SIZE, json, header[1]);
+    ipc_frame_classify(&frame, &cls);
+    return ipc_frame_hash(&frame, &cls);
+}
+
+// FNV-1a, leaving out the value of the top-level nonce only
+static void test_hash(void) {
+    // The published 64-bit FNV-1a of "a", a payload without a nonce is hashed whole
+    CHECK(hash_of("a") == 0xAF63DC4C8601EC8CULL);
+
+    CHECK(hash_of("{\"cmd\":\"SET_ACTIVITY\",\"args\":{\"state\":\"x\"},\"nonce\":\"1\"}") ==
+          hash_of("{\"cmd\":\"SET_ACTIVITY\",\"args\":{\"state\":\"x\"},\"nonce\":\"12345678\"}"));
+    CHECK(hash_of("{\"nonce\":\"1\",\"cmd\":\"SET_ACTIVITY\",\"args\":{\"state\":\"x\"}}") ==
+          hash_of("{\"nonce\":\"2\",\"cmd\":\"SET_ACTIVITY\",\"args\":{\"state\":\"x\"}}"));
+
+    CHECK(hash_of("{\"cmd\":\"SET_ACTIVITY\",\"args\":{\"state\":\"x\"},\"nonce\":\"1\"}") !=
+          hash_of("{\"cmd\":\"SET_ACTIVITY\",\"args\":{\"state\":\"y\"},\"nonce\":\"1\"}"));
+
+    // Nested ones are part of the state
+    CHECK(hash_of("{\"cmd\":\"SET_ACTIVITY\",\"args\":{\"nonce\":\"a\"},\"nonce\":\"1\"}") !=
+          hash_of("{\"cmd\":\"SET_ACTIVITY\",\"args\":{\"nonce\":\"b\"},\"nonce\":\"1\"}"));
+}
+
+int main(void) {
+    test_every_split();
+    test_large_frames();
+    test_oversized();
+    test_hash();
+    return TEST_RESULT;
+}
@@ -0,0 +1,149 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// The frame queue between a relay's reader and writer stages: order, slots wrapping around, and queue_retain()
+// as relay_detach() uses it
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bridge/queue.h"
+#include "test.h"
+
+// Frames are filled with the low byte of their number, every seventh one too large for a cell
+static size_t frame_size(unsigned n) {
+    return n % 7 == 3 ? QUEUE_CELL + 100 + n : 16 + n % 64;
+}
+
+static void push(struct frame_queue *queue, unsigned n) {
+    size_t size = frame_size(n);
+    char *data = malloc(size);
+
+    memset(data, (int)(n & 0xFF), size);
+    CHECK(queue_push(queue, data, size, n, n) == 0);
+    free(data);
+}
+
+static int cell_is(const struct queue_cell *cell, unsigned n) {
+    if (cell->opcode != n || cell->stamp != n || cell->size != frame_size(n)) return 0;
+
+    for (uint32_t i = 0; i < cell->size; i++)
+        if ((unsigned char)cell->data[i] != (n & 0xFF)) return 0;
+
+    return 1;
+}
+
+// Many times round the slots, never more than a full queue at once
+static void test_wraparound(void) {
+    struct frame_queue queue;
+    unsigned pushed = 0, popped = 0;
+
+    CHECK(queue_init(&queue) == 0);
+
+    for (int round = 0; round < 4 * QUEUE_SLOTS; round++) {
+        for (int i = 0; i < round % 5 + 1 && !queue_full(&queue); i++)
+            push(&queue, pushed++);
+
+        for (int i = 0; i < round % 3 + 1 && queue_count(&queue) > 0; i++) {
+            CHECK(cell_is(queue_at(&queue, 0), popped++));
+            queue_pop(&queue);
+        }
+    }
+
+    while (!queue_full(&queue))
+        push(&queue, pushed++);
+
+    CHECK(queue_count(&queue) == QUEUE_SLOTS);
+    CHECK(queue_push(&queue, "x", 1, 0, 0) < 0);
+
+    for (size_t i = 0; i < QUEUE_SLOTS; i++)
+        CHECK(cell_is(queue_at(&queue, i), popped + (unsigned)i));
+
+    queue_free(&queue);
+}
+
+static int keep_odd(const struct queue_cell *cell) {
+    return cell->opcode % 2 == 1;
+}
+
+static int keep_all(const struct queue_cell *cell) {
+    (void)cell;
+    return 1;
+}
+
+static int keep_none(const struct queue_cell *cell) {
+    (void)cell;
+    return 0;
+}
+
+// From every head position, so the kept frames cross the end of the slots
+static void test_retain(void) {
+    for (unsigned start = 0; start < QUEUE_SLOTS; start++) {
+        for (unsigned count = 1; count <= QUEUE_SLOTS; count += 5) {
+            struct frame_queue queue;
+            unsigned n = 0;
+
+            CHECK(queue_init(&queue) == 0);
+
+            for (; n < start; n++) {
+                push(&queue, n);
+                queue_pop(&queue);
+            }
+
+            for (unsigned i = 0; i < count; i++)
+                push(&queue, n + i);
+
+            // Part of the head frame was written to the old session already
+            queue.off = 5;
+            queue_retain(&queue, keep_odd);
+
+            CHECK(queue.off == 0);
+            CHECK(queue_count(&queue) == (count + (n % 2 == 0 ? 0 : 1)) / 2);
+
+            for (unsigned i = 0, kept = 0; i < count; i++)
+                if ((n + i) % 2 == 1)
+                    CHECK(cell_is(queue_at(&queue, kept++), n + i));
+
+            // The freed slots are usable again, and the order holds across them
+            unsigned kept_count = (unsigned)queue_count(&queue), next = n + count;
+            while (!queue_full(&queue))
+                push(&queue, next++);
+
+            CHECK(cell_is(queue_at(&queue, kept_count), n + count));
+            CHECK(cell_is(queue_at(&queue, QUEUE_SLOTS - 1), next - 1));
+
+            queue_retain(&queue, keep_all);
+            CHECK(queue_count(&queue) == QUEUE_SLOTS);
+            CHECK(cell_is(queue_at(&queue, kept_count), n + count));
+
+            queue_retain(&queue, keep_none);
+            CHECK(queue_count(&queue) == 0);
+            queue_free(&queue);
+        }
+    }
+}
+
+int main(void) {
+    test_wraparound();
+    test_retain();
+    return TEST_RESULT;
+}
@@ -0,0 +1,218 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// The relay engine against tests/mock.h, one Discord session after another
+
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include "bridge/ipc.h"
+#include "bridge/relay.h"
+#include "bridge/stats.h"
+#include "mock.h"
+#include "test.h"
+
+#define HANDSHAKE       "{\"v\":1,\"client_id\":\"1\"}"
+#define READY           "{\"cmd\":\"DISPATCH\",\"data\":{\"v\":1},\"evt\":\"READY\",\"nonce\":null}"
+#define ACTIVITY(n)     "{\"cmd\":\"SET_ACTIVITY\",\"args\":{\"pid\":42,\"activity\":{\"state\":\"" #n "\"}},\"nonce\":\"" #n "\"}"
+#define REPLY(cmd, n)   "{\"cmd\":\"" cmd "\",\"data\":null,\"evt\":null,\"nonce\":\"" #n "\"}"
+
+// A session with a handshake and an activity, both answered
+static void session_start(struct mock *mock) {
+    mock_start(mock, 1);
+    mock_client(mock, IPC_HANDSHAKE, HANDSHAKE);
+    mock_client(mock, IPC_FRAME, ACTIVITY(1));
+    mock_discord(mock, IPC_FRAME, READY);
+    mock_discord(mock, IPC_FRAME, REPLY("SET_ACTIVITY", 1));
+
+    CHECK(mock_count(mock->to_client, mock->to_client_len, "READY") == 1);
+    CHECK(mock_count(mock->to_client, mock->to_client_len, "SET_ACTIVITY") == 1);
+}
+
+// Discord answers the replay with READY and the activity's reply, which the client already had
+static void test_replay_swallowed(void) {
+    static struct mock mock;
+    struct ipc_frame frame;
+
+    session_start(&mock);
+
+    size_t off = mock.to_discord_len;
+    mock_restart(&mock);
+
+    CHECK(mock.relay.attached);
+    CHECK(mock_next(mock.to_discord, mock.to_discord_len, &off, &frame) && frame.opcode == IPC_HANDSHAKE);
+    CHECK(mock_next(mock.to_discord, mock.to_discord_len, &off, &frame) && frame.opcode == IPC_FRAME &&
+          memmem(IPC_PAYLOAD(&frame), frame.length, "SET_ACTIVITY", 12) != NULL);
+    CHECK(!mock_next(mock.to_discord, mock.to_discord_len, &off, &frame));
+
+    mock_discord(&mock, IPC_FRAME, READY);
+    mock_discord(&mock, IPC_FRAME, REPLY("SET_ACTIVITY", 1));
+    mock_discord(&mock, IPC_FRAME, REPLY("OTHER", 2));
+
+    CHECK(mock_count(mock.to_client, mock.to_client_len, "READY") == 1);
+    CHECK(mock_count(mock.to_client, mock.to_client_len, "SET_ACTIVITY") == 1);
+    CHECK(mock_count(mock.to_client, mock.to_client_len, "OTHER") == 1);
+    relay_free(&mock.relay);
+}
+
+// Only what answers the replay is swallowed, a reply after something else belongs to the client
+static void test_replay_swallow_ends(void) {
+    static struct mock mock;
+
+    session_start(&mock);
+    mock_restart(&mock);
+
+    mock_discord(&mock, IPC_FRAME, READY);
+    mock_discord(&mock, IPC_FRAME, REPLY("OTHER", 2));
+    mock_discord(&mock, IPC_FRAME, REPLY("SET_ACTIVITY", 3));
+
+    CHECK(mock_count(mock.to_client, mock.to_client_len, "READY") == 1);
+    CHECK(mock_count(mock.to_client, mock.to_client_len, "OTHER") == 1);
+    CHECK(mock_count(mock.to_client, mock.to_client_len, "SET_ACTIVITY") == 2);
+    relay_free(&mock.relay);
+}
+
+// Without an activity to replay, READY is all there is to swallow
+static void test_replay_handshake_only(void) {
+    static struct mock mock;
+
+    mock_start(&mock, 1);
+    mock_client(&mock, IPC_HANDSHAKE, HANDSHAKE);
+    mock_discord(&mock, IPC_FRAME, READY);
+    mock_restart(&mock);
+
+    mock_discord(&mock, IPC_FRAME, READY);
+    mock_discord(&mock, IPC_FRAME, REPLY("SET_ACTIVITY", 1));
+
+    CHECK(mock_count(mock.to_client, mock.to_client_len, "READY") == 1);
+    CHECK(mock_count(mock.to_client, mock.to_client_len, "SET_ACTIVITY") == 1);
+    relay_free(&mock.relay);
+}
+
+// Frames Discord never took go to the next session after the replay, in order, except the activity the replay
+// brings already
+static void test_queue_across_restart(void) {
+    static struct mock mock;
+    struct ipc_frame frame;
+
+    session_start(&mock);
+    mock.blocked = 1;
+
+    mock_client(&mock, IPC_FRAME, REPLY("FIRST", 2));
+    mock_client(&mock, IPC_FRAME, ACTIVITY(3));
+    mock_client(&mock, IPC_FRAME, REPLY("SECOND", 4));
+    CHECK(queue_count(&mock.relay.to_sock) == 3);
+
+    // And while Discord is gone
+    mock.hangup = 1;
+    relay_sock_ready(&mock.relay);
+    CHECK(!mock.relay.attached && mock.waiting);
+    mock_client(&mock, IPC_FRAME, REPLY("THIRD", 5));
+
+    size_t off = mock.to_discord_len;
+    mock.discord = 1;
+    (void)relay_attach(&mock.relay);
+
+    CHECK(mock_next(mock.to_discord, mock.to_discord_len, &off, &frame) && frame.opcode == IPC_HANDSHAKE);
+    CHECK(mock_next(mock.to_discord, mock.to_discord_len, &off, &frame) &&
+          memmem(IPC_PAYLOAD(&frame), frame.length, "\"state\":\"3\"", 11) != NULL);
+    CHECK(mock_next(mock.to_discord, mock.to_discord_len, &off, &frame) &&
+          memmem(IPC_PAYLOAD(&frame), frame.length, "FIRST", 5) != NULL);
+    CHECK(mock_next(mock.to_discord, mock.to_discord_len, &off, &frame) &&
+          memmem(IPC_PAYLOAD(&frame), frame.length, "SECOND", 6) != NULL);
+    CHECK(mock_next(mock.to_discord, mock.to_discord_len, &off, &frame) &&
+          memmem(IPC_PAYLOAD(&frame), frame.length, "THIRD", 5) != NULL);
+    CHECK(!mock_next(mock.to_discord, mock.to_discord_len, &off, &frame));
+    CHECK(queue_count(&mock.relay.to_sock) == 0);
+    relay_free(&mock.relay);
+}
+
+// As if RELAY_ACTIVITY_WINDOW had gone by since every update sent so far
+static void activity_age(struct relay *relay) {
+    for (int i = 0; i < RELAY_ACTIVITY_BURST; i++)
+        if (relay->activity_sent[i] != 0)
+            relay->activity_sent[i] -= RELAY_ACTIVITY_WINDOW;
+}
+
+// RELAY_ACTIVITY_BURST updates go out at once, the rest wait for the window and only the latest of them is sent
+static void test_activity_limit(void) {
+    static struct mock mock;
+    uint64_t drops = g_stats->activity_drops;
+
+    mock_start(&mock, 1);
+    mock_client(&mock, IPC_HANDSHAKE, HANDSHAKE);
+    mock_discord(&mock, IPC_FRAME, READY);
+
+    mock_client(&mock, IPC_FRAME, ACTIVITY(1));
+    mock_client(&mock, IPC_FRAME, ACTIVITY(2));
+    mock_client(&mock, IPC_FRAME, ACTIVITY(3));
+    mock_client(&mock, IPC_FRAME, ACTIVITY(4));
+    mock_client(&mock, IPC_FRAME, ACTIVITY(5));
+    CHECK(mock_count(mock.to_discord, mock.to_discord_len, "SET_ACTIVITY") == RELAY_ACTIVITY_BURST);
+
+    mock_client(&mock, IPC_FRAME, ACTIVITY(6));
+    mock_client(&mock, IPC_FRAME, ACTIVITY(7));
+    CHECK(mock_count(mock.to_discord, mock.to_discord_len, "SET_ACTIVITY") == RELAY_ACTIVITY_BURST);
+    CHECK(g_stats->activity_drops == drops + 1);
+
+    uint64_t wait = relay_schedule(&mock.relay, metrics_ms());
+    CHECK(wait > 0 && wait <= RELAY_ACTIVITY_WINDOW);
+    CHECK(mock_count(mock.to_discord, mock.to_discord_len, "SET_ACTIVITY") == RELAY_ACTIVITY_BURST);
+
+    activity_age(&mock.relay);
+    (void)relay_schedule(&mock.relay, metrics_ms());
+    CHECK(mock_count(mock.to_discord, mock.to_discord_len, "SET_ACTIVITY") == RELAY_ACTIVITY_BURST + 1);
+    CHECK(mock_count(mock.to_discord, mock.to_discord_len, "\"state\":\"6\"") == 0);
+    CHECK(mock_count(mock.to_discord, mock.to_discord_len, "\"state\":\"7\"") == 1);
+
+    // The window holds the latest update only, so there's room for RELAY_ACTIVITY_BURST - 1 more
+    for (int i = 0; i < RELAY_ACTIVITY_BURST; i++)
+        mock_client(&mock, IPC_FRAME, i % 2 == 0 ? ACTIVITY(8) : ACTIVITY(9));
+    CHECK(mock_count(mock.to_discord, mock.to_discord_len, "SET_ACTIVITY") == 2 * RELAY_ACTIVITY_BURST);
+    CHECK(mock.relay.activity_pending);
+    CHECK(g_stats->activity_drops == drops + 1);
+    relay_free(&mock.relay);
+}
+
+// What Discord shows already isn't sent again, whatever its nonce
+static void test_activity_unchanged(void) {
+    static struct mock mock;
+
+    session_start(&mock);
+    mock_client(&mock, IPC_FRAME,
+                "{\"cmd\":\"SET_ACTIVITY\",\"args\":{\"pid\":42,\"activity\":{\"state\":\"1\"}},\"nonce\":\"99\"}");
+    CHECK(mock_count(mock.to_discord, mock.to_discord_len, "SET_ACTIVITY") == 1);
+
+    mock_client(&mock, IPC_FRAME, ACTIVITY(2));
+    CHECK(mock_count(mock.to_discord, mock.to_discord_len, "SET_ACTIVITY") == 2);
+    relay_free(&mock.relay);
+}
+
+int main(void) {
+    test_replay_swallowed();
+    test_replay_swallow_ends();
+    test_replay_handshake_only();
+    test_queue_across_restart();
+    test_activity_limit();
+    test_activity_unchanged();
+    return TEST_RESULT;
+}
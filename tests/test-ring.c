@@ -0,0 +1,215 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// Split mode's byte rings, see bridge/ring.h: the test maps the bridge's file and plays the companion's part,
+// pushing more than RING_BYTES through each way in pieces that straddle the end of the ring
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "bridge/discovery.h"
+#include "bridge/ring.h"
+#include "test.h"
+
+#define CHANNEL     3
+#define TOTAL       (5 * RING_BYTES + 123)
+
+static struct ring_block *companion;
+
+static char byte_at(size_t pos) {
+    return (char)(pos * 7 + pos / 251);
+}
+
+// Takes up to len bytes off the ring, as the companion does sending them to Discord
+static size_t ring_take(struct ring *ring, char *buf, size_t len) {
+    uint32_t tail = ring->tail, length = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+
+    if (length > len) length = (uint32_t)len;
+
+    for (uint32_t i = 0; i < length; i++)
+        buf[i] = ring->data[(tail + i) & (RING_BYTES - 1)];
+
+    __atomic_store_n(&ring->tail, tail + length, __ATOMIC_RELEASE);
+    return length;
+}
+
+// Puts up to len bytes on the ring, as the companion does receiving them from Discord
+static size_t ring_put(struct ring *ring, const char *buf, size_t len) {
+    uint32_t head = ring->head, room = RING_BYTES - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+
+    if (room > len) room = (uint32_t)len;
+
+    for (uint32_t i = 0; i < room; i++)
+        ring->data[(head + i) & (RING_BYTES - 1)] = buf[i];
+
+    __atomic_store_n(&ring->head, head + room, __ATOMIC_RELEASE);
+    return room;
+}
+
+static void test_to_discord(void) {
+    struct ring *ring = &companion->channels[CHANNEL].to_discord;
+    static char out[RING_BYTES], in[RING_BYTES];
+    size_t sent = 0, taken = 0, piece = 1;
+    int filled = 0;
+
+    while (taken < TOTAL) {
+        // Two pieces a send, the second often split by the end of the ring
+        size_t first = piece % 3001 + 1, second = piece % 1777;
+        if (sent + first + second > TOTAL) first = TOTAL - sent, second = 0;
+
+        for (size_t i = 0; i < first + second; i++)
+            out[i] = byte_at(sent + i);
+
+        struct relay_iov iov[2] = {{out, first}, {out + first, second}};
+        ssize_t written = sent < TOTAL ? ring_send(CHANNEL, iov, 2) : 0;
+
+        if (written == -EAGAIN) {
+            CHECK(__atomic_load_n(&ring->full, __ATOMIC_ACQUIRE) == 1);
+            __atomic_store_n(&ring->full, 0, __ATOMIC_RELEASE);
+            filled = 1;
+        } else {
+            CHECK(written >= 0 && (size_t)written <= first + second);
+            sent += (size_t)(written > 0 ? written : 0);
+        }
+
+        // Behind the bridge on purpose, and now and then not there at all, so the ring fills up
+        size_t length = piece % 3 == 0 && sent < TOTAL ? 0 : ring_take(ring, in, piece % 2 == 0 ? piece % 5000 : 700);
+        for (size_t i = 0; i < length; i++)
+            if (in[i] != byte_at(taken + i)) {
+                CHECK(in[i] == byte_at(taken + i));
+                return;
+            }
+
+        taken += length;
+        piece++;
+    }
+
+    CHECK(sent == TOTAL);
+    CHECK(filled);
+}
+
+static void test_to_client(void) {
+    struct ring_channel *channel = &companion->channels[CHANNEL];
+    static char out[RING_BYTES], in[RING_BYTES];
+    size_t put = 0, read = 0, piece = 1;
+
+    CHECK(ring_recv(CHANNEL, in, sizeof(in)) == -EAGAIN);
+
+    while (read < TOTAL) {
+        size_t length = piece % 6007 + 1;
+        if (length > TOTAL - put) length = TOTAL - put;
+
+        for (size_t i = 0; i < length; i++)
+            out[i] = byte_at(put + i);
+        put += ring_put(&channel->to_client, out, length);
+
+        // Reads smaller than what's there and larger, the latter have to come back short
+        size_t want = piece % 2 == 0 ? 1 + piece % 1000 : sizeof(in);
+        ssize_t got = ring_recv(CHANNEL, in, want);
+
+        if (got == -EAGAIN) {
+            CHECK(put == read);
+        } else {
+            CHECK(got > 0 && (size_t)got <= want);
+            CHECK(want == (size_t)got || read + (size_t)got == put);
+
+            for (ssize_t i = 0; i < got; i++)
+                if (in[i] != byte_at(read + (size_t)i)) {
+                    CHECK(in[i] == byte_at(read + (size_t)i));
+                    return;
+                }
+
+            read += (size_t)got;
+        }
+
+        piece++;
+    }
+
+    // A hangup only shows once everything before it was read
+    channel->error = -ECONNRESET;
+    put += ring_put(&channel->to_client, "xy", 2);
+    __atomic_store_n(&channel->state, RING_HANGUP, __ATOMIC_RELEASE);
+
+    CHECK(ring_recv(CHANNEL, in, sizeof(in)) == 2);
+    CHECK(ring_recv(CHANNEL, in, sizeof(in)) == -ECONNRESET);
+    __atomic_store_n(&channel->state, RING_OPEN, __ATOMIC_RELEASE);
+}
+
+// The companion is only woken when it said it's going to sleep, and only by a ring that had been empty
+static void test_wakeups(void) {
+    struct ring *ring = &companion->channels[CHANNEL].to_discord;
+    struct relay_iov iov = {"abc", 3};
+    char buf[16];
+
+    (void)ring_take(ring, buf, sizeof(buf));
+    uint32_t wake = __atomic_load_n(&companion->companion_wake, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&companion->companion_asleep, 0, __ATOMIC_RELEASE);
+    CHECK(ring_send(CHANNEL, &iov, 1) == 3);
+    CHECK(__atomic_load_n(&companion->companion_wake, __ATOMIC_ACQUIRE) == wake);
+    (void)ring_take(ring, buf, sizeof(buf));
+
+    __atomic_store_n(&companion->companion_asleep, 1, __ATOMIC_RELEASE);
+    CHECK(ring_send(CHANNEL, &iov, 1) == 3);
+    CHECK(__atomic_load_n(&companion->companion_wake, __ATOMIC_ACQUIRE) == wake + 1);
+    CHECK(ring_send(CHANNEL, &iov, 1) == 3);
+    CHECK(__atomic_load_n(&companion->companion_wake, __ATOMIC_ACQUIRE) == wake + 1);
+}
+
+int main(void) {
+    char dir[] = "/tmp/winerpc-test-XXXXXX", path[256];
+
+    if (mkdtemp(dir) == NULL || setenv("XDG_RUNTIME_DIR", dir, 1) < 0 || ring_init((uint32_t)getpid()) < 0) {
+        fprintf(stderr, "Failed to set up the ring file.\n");
+        return 1;
+    }
+
+    snprintf(path, sizeof(path), "%s/" RING_PREFIX "%u", get_sock_parent_path(), (unsigned)getpid());
+    int fd = open(path, O_RDWR);
+    companion = fd >= 0 ? mmap(NULL, sizeof(*companion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    CHECK(companion != MAP_FAILED);
+    if (fd >= 0) close(fd);
+    if (companion == MAP_FAILED) return 1;
+
+    CHECK(companion->magic == RING_MAGIC && companion->version == RING_VERSION);
+    CHECK(companion->size == sizeof(*companion));
+
+    // Connected, as far as the bridge can tell
+    __atomic_store_n(&companion->companion_pid, (uint32_t)getpid(), __ATOMIC_RELEASE);
+    __atomic_store_n(&companion->channels[CHANNEL].state, RING_OPEN, __ATOMIC_RELEASE);
+    CHECK(ring_served());
+
+    test_to_discord();
+    test_to_client();
+    test_wakeups();
+
+    ring_shutdown();
+    rmdir(dir);
+    return TEST_RESULT;
+}
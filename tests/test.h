@@ -0,0 +1,43 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// Just enough of a harness for the native unit tests: a failed CHECK reports where and the test goes on,
+// main() returns TEST_RESULT so make test stops at the first binary with a failure
+
+#pragma once
+
+#include <stdio.h>
+
+#include "bridge/log.h"
+
+enum log_level g_log_level = LL_NONE;
+
+static int test_failures;
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond);   \
+            test_failures++;                                                    \
+        }                                                                       \
+    } while (0)
+
+#define TEST_RESULT     (test_failures == 0 ? 0 : 1)
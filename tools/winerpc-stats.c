@@ -0,0 +1,138 @@
+/* =======================================================================
+    This file is part of WineRPC.
+    Copyright (C) 2024  Leah Santos  <leahsantos@proton.me>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    The full license is available in the LICENSE file distributed with
+    the source code in the root of the project.
+ ====================================================================== */
+
+// Native Linux reader for the stats blocks bridges publish, see include/bridge/stats.h
+// Prints one line of key=value pairs per bridge found in the runtime directory
+
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bridge/stats.h"
+
+#define ARR_LEN(arr) (sizeof(arr) / sizeof(arr[0]))
+
+#define LOAD(field) __atomic_load_n(&stats->field, __ATOMIC_RELAXED)
+
+// Same lookup as the bridge, which runs with the same environment
+static const char* get_sock_parent_path(void) {
+    const char *env_tmp_paths[] = {"XDG_RUNTIME_DIR", "TMPDIR", "TMP", "TEMP"};
+    char *path;
+
+    for (size_t i = 0; i < ARR_LEN(env_tmp_paths); i++)
+        if ((path = getenv(env_tmp_paths[i])))
+            return path;
+
+    return "/tmp";
+}
+
+static int print_stats(const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct stats_block)) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+
+    const struct stats_block *stats = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (stats == MAP_FAILED) {
+        fprintf(stderr, "Failed to map \"%s\": %s.\n", path, strerror(errno));
+        return 0;
+    }
+
+    int printed = 0;
+
+    // A bridge that is still starting up has no magic yet
+    if (__atomic_load_n(&stats->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC) goto cleanup;
+
+    // Newer bridges only append fields, so anything from this build's version on is read up to what it knows
+    if (stats->version < STATS_VERSION) {
+        fprintf(stderr, "Skipping \"%s\", stats version %u is older than %u.\n", path, stats->version, STATS_VERSION);
+        goto cleanup;
+    }
+
+    if (stats->size < sizeof(struct stats_block) || stats->size > (size_t)st.st_size) {
+        fprintf(stderr, "Skipping \"%s\", its stats block of %u bytes doesn't fit.\n", path, stats->size);
+        goto cleanup;
+    }
+
+    // Files of bridges that crashed stay behind, flag them rather than guess
+    int alive = kill((pid_t)stats->pid, 0) == 0 || errno == EPERM;
+
+    printf("pid=%u alive=%d clients=%u waiting=%u queued_frames=%u backlog_bytes=%u "
+           "frames_to_discord=%llu bytes_to_discord=%llu frames_to_client=%llu bytes_to_client=%llu "
+           "reconnects=%llu backlog_drops=%llu activity_drops=%llu activity_updates=%llu events=%llu "
+           "first_frame_us=%llu resumes=%llu pongs=%llu keepalives=%llu last_sock_error=%d last_pipe_error=%u\n",
+           stats->pid, alive, LOAD(clients), LOAD(waiting), LOAD(queued_frames), LOAD(backlog_bytes),
+           (unsigned long long)LOAD(frames[STATS_TO_DISCORD]), (unsigned long long)LOAD(bytes[STATS_TO_DISCORD]),
+           (unsigned long long)LOAD(frames[STATS_TO_CLIENT]), (unsigned long long)LOAD(bytes[STATS_TO_CLIENT]),
+           (unsigned long long)LOAD(reconnects), (unsigned long long)LOAD(backlog_drops),
+           (unsigned long long)LOAD(activity_drops), (unsigned long long)LOAD(activity_updates),
+           (unsigned long long)LOAD(events), (unsigned long long)LOAD(first_frame_us),
+           (unsigned long long)LOAD(resumes), (unsigned long long)LOAD(pongs), (unsigned long long)LOAD(keepalives),
+           LOAD(last_sock_error), LOAD(last_pipe_error));
+    printed = 1;
+
+cleanup:
+    munmap((void*)stats, st.st_size);
+    return printed;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        fprintf(stderr, "Usage: %s\nPrints the live stats of every bridge found in %s.\n", argv[0], get_sock_parent_path());
+        return EXIT_FAILURE;
+    }
+
+    const char *dir_path = get_sock_parent_path();
+    DIR *dir = opendir(dir_path);
+
+    if (dir == NULL) {
+        fprintf(stderr, "Failed to open \"%s\": %s.\n", dir_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct dirent *entry;
+    int found = 0;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, STATS_PREFIX, strlen(STATS_PREFIX)) != 0) continue;
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        found += print_stats(path);
+    }
+
+    closedir(dir);
+    return found > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}